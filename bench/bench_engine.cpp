@@ -0,0 +1,509 @@
+// Микробенчмарк движка PollMessageEngine.
+// Движок работает так же, как в сервере: отдельный поток ждет событий, а готовые коллбеки выполняются в пуле.
+// Каждая цепочка держит в движке одну операцию за раз и сразу после ее завершения ставит следующую;
+// задержка - время от постановки операции до вызова ее коллбека.
+// Дополнительно в движке зарегистрированы простаивающие дескрипторы, на которых никогда не бывает событий:
+// так видно, как стоимость цикла ожидания зависит от их количества
+#include <PollMessageEngine.h>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/program_options.hpp>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum class Operation
+{
+    ReadSome,
+    Write,
+    ReadUntil,
+    Accept
+};
+
+enum class Transport
+{
+    SocketPair,
+    Tcp
+};
+
+struct Config
+{
+    Operation m_operation;
+    Transport m_transport;
+    std::size_t m_registeredFds;
+    unsigned m_threads;
+    unsigned m_chainsPerThread;
+    Clock::duration m_duration;
+    std::size_t m_writeSize;
+};
+
+struct Result
+{
+    std::uint64_t m_operations = 0;
+    double m_seconds = 0;
+    std::vector<std::uint32_t> m_latencies; // Наносекунды
+};
+
+std::string_view operationName(Operation operation)
+{
+    switch (operation)
+    {
+        case Operation::ReadSome: return "read_some";
+        case Operation::Write: return "write";
+        case Operation::ReadUntil: return "read_until";
+        case Operation::Accept: return "accept";
+    }
+    return "";
+}
+
+std::string_view transportName(Transport transport)
+{
+    return transport == Transport::SocketPair ? "socketpair" : "tcp";
+}
+
+void check(bool isSuccessful, const char* what)
+{
+    if (!isSuccessful)
+        throw std::system_error(errno, std::system_category(), what);
+}
+
+void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Слушающий сокет: на 127.0.0.1 со случайным портом либо в абстрактном пространстве имен Unix
+int makeListener(Transport transport, sockaddr_storage& address, socklen_t& addressLength)
+{
+    static std::atomic_uint listenerIndex = 0;
+    int fd;
+    if (transport == Transport::Tcp)
+    {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        check(fd >= 0, "socket");
+        auto &inetAddress = reinterpret_cast<sockaddr_in&>(address);
+        inetAddress = {};
+        inetAddress.sin_family = AF_INET;
+        inetAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addressLength = sizeof inetAddress;
+        check(bind(fd, reinterpret_cast<sockaddr*>(&address), addressLength) == 0, "bind");
+        check(getsockname(fd, reinterpret_cast<sockaddr*>(&address), &addressLength) == 0, "getsockname");
+    }
+    else
+    {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        check(fd >= 0, "socket");
+        auto &unixAddress = reinterpret_cast<sockaddr_un&>(address);
+        unixAddress = {};
+        unixAddress.sun_family = AF_UNIX;
+        auto name = "bench_engine." + std::to_string(getpid()) + "." + std::to_string(listenerIndex++);
+        std::copy(name.begin(), name.end(), unixAddress.sun_path + 1);
+        addressLength = offsetof(sockaddr_un, sun_path) + 1 + name.size();
+        check(bind(fd, reinterpret_cast<sockaddr*>(&address), addressLength) == 0, "bind");
+    }
+    check(listen(fd, SOMAXCONN) == 0, "listen");
+    setNonBlocking(fd);
+    return fd;
+}
+
+int makeClient(Transport transport)
+{
+    int fd = socket(transport == Transport::Tcp ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    check(fd >= 0, "socket");
+    if (transport == Transport::Tcp)
+    {
+        // Соединение закрывается сбросом, чтобы клиентские порты не копились в TIME_WAIT
+        linger reset{1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof reset);
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+    }
+    return fd;
+}
+
+void connectTo(int fd, const sockaddr_storage& address, socklen_t addressLength)
+{
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), addressLength) < 0 && errno != EINPROGRESS)
+        check(false, "connect");
+}
+
+// Пара соединенных неблокирующих сокетов
+std::pair<int, int> makePair(Transport transport)
+{
+    if (transport == Transport::SocketPair)
+    {
+        int fds[2];
+        check(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) == 0, "socketpair");
+        return {fds[0], fds[1]};
+    }
+    sockaddr_storage address;
+    socklen_t addressLength;
+    int listener = makeListener(transport, address, addressLength);
+    int client = makeClient(transport);
+    connectTo(client, address, addressLength);
+    int server = -1;
+    while (server < 0)
+    {
+        server = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (server < 0 && errno != EAGAIN)
+            check(false, "accept");
+    }
+    close(listener);
+    int noDelay = 1;
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+    return {server, client};
+}
+
+// Цепочка операций одного вида; следующая операция ставится из коллбека предыдущей
+struct Chain
+{
+    int m_in = -1, m_out = -1; // Для accept m_in - слушающий сокет
+    sockaddr_storage m_address;
+    socklen_t m_addressLength = 0;
+    std::string m_buffer, m_drainBuffer;
+    Clock::time_point m_issued;
+    std::vector<std::uint32_t> m_latencies;
+    std::uint64_t m_completed = 0;
+};
+
+class Bench
+{
+public:
+    explicit Bench(const Config& config)
+    : m_config(config)
+    , m_pool(config.m_threads)
+    , m_chains(static_cast<std::size_t>(config.m_threads) * config.m_chainsPerThread)
+    , m_payload(config.m_operation == Operation::Write ? config.m_writeSize : 64, 'x')
+    {
+        // Простаивающие дескрипторы - всегда пары Unix-сокетов: это дешевле и не расходует порты
+        m_idle.reserve(config.m_registeredFds);
+        for (std::size_t i = 0; i < config.m_registeredFds; ++i)
+        {
+            m_idle.push_back(makePair(Transport::SocketPair));
+            m_engine->async_read_some(m_idle.back().first, m_idleBuffer, std::make_shared<messaging::CallbackType>([](int) {}));
+        }
+        if (m_config.m_operation == Operation::ReadUntil)
+            m_payload.append("\r\n");
+        for (auto &chain: m_chains)
+        {
+            if (config.m_operation == Operation::Accept)
+                chain.m_in = makeListener(config.m_transport, chain.m_address, chain.m_addressLength);
+            else
+                std::tie(chain.m_in, chain.m_out) = makePair(config.m_transport);
+            chain.m_latencies.reserve(1 << 16);
+        }
+    }
+
+    ~Bench()
+    {
+        for (auto &chain: m_chains)
+        {
+            close(chain.m_in);
+            if (chain.m_out >= 0)
+                close(chain.m_out);
+        }
+        for (auto [first, second]: m_idle)
+        {
+            close(first);
+            close(second);
+        }
+    }
+
+    Result run()
+    {
+        std::thread reactor(
+                [this]()
+                {
+                    while (!m_isReactorStopping.load())
+                        boost::asio::post(m_pool, m_engine->waitForEvent());
+                });
+        m_activeChains = m_chains.size();
+        for (auto &chain: m_chains)
+            boost::asio::post(m_pool, [this, &chain]() { start(chain); });
+
+        // Первая десятая часть времени - прогрев, он не учитывается
+        std::this_thread::sleep_for(m_config.m_duration / 10);
+        m_isMeasuring.store(true);
+        auto measureStart = Clock::now();
+        std::this_thread::sleep_for(m_config.m_duration);
+        m_isMeasuring.store(false);
+        auto measureEnd = Clock::now();
+
+        // Цепочки завершают операции, которые уже в движке, и больше новых не ставят
+        m_isStopping.store(true);
+        auto deadline = Clock::now() + std::chrono::seconds(5);
+        while (m_activeChains.load() > 0 && Clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        m_isReactorStopping.store(true);
+        m_engine->interrupt();
+        reactor.join();
+        m_pool.join();
+
+        Result result;
+        result.m_seconds = std::chrono::duration<double>(measureEnd - measureStart).count();
+        for (auto &chain: m_chains)
+        {
+            result.m_operations += chain.m_completed;
+            result.m_latencies.insert(result.m_latencies.end(), chain.m_latencies.begin(), chain.m_latencies.end());
+        }
+        return result;
+    }
+
+private:
+    void start(Chain& chain)
+    {
+        // Операция записи нуждается в читателе на другом конце
+        if (m_config.m_operation == Operation::Write)
+        {
+            chain.m_drainBuffer.resize(64 * 1024);
+            drain(chain);
+        }
+        issue(chain);
+    }
+
+    void drain(Chain& chain)
+    {
+        m_engine->async_read_some(
+                chain.m_out,
+                chain.m_drainBuffer,
+                std::make_shared<messaging::CallbackType>(
+                        [this, &chain](int res)
+                        {
+                            if (res > 0)
+                                drain(chain);
+                        }));
+    }
+
+    void complete(Chain& chain)
+    {
+        if (m_isMeasuring.load(std::memory_order_relaxed))
+        {
+            ++chain.m_completed;
+            chain.m_latencies.push_back(
+                    static_cast<std::uint32_t>(std::min<std::int64_t>(
+                            std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - chain.m_issued).count(),
+                            std::numeric_limits<std::uint32_t>::max())));
+        }
+        issue(chain);
+    }
+
+    void issue(Chain& chain)
+    {
+        if (m_isStopping.load(std::memory_order_relaxed))
+        {
+            --m_activeChains;
+            return;
+        }
+        chain.m_issued = Clock::now();
+        auto callback = std::make_shared<messaging::CallbackType>(
+                [this, &chain](int res)
+                {
+                    if (res < 0 && res != -EAGAIN)
+                    {
+                        std::cerr << operationName(m_config.m_operation) << " failed: " << res << '\n';
+                        --m_activeChains;
+                        return;
+                    }
+                    if (m_config.m_operation == Operation::Accept)
+                    {
+                        close(res);
+                        close(std::exchange(chain.m_out, -1));
+                    }
+                    complete(chain);
+                });
+        switch (m_config.m_operation)
+        {
+            case Operation::ReadSome:
+                // Операция ставится до появления данных, поэтому всегда проходит через poll
+                chain.m_buffer.resize(m_payload.size());
+                m_engine->async_read_some(chain.m_in, chain.m_buffer, callback);
+                check(write(chain.m_out, m_payload.data(), m_payload.size()) > 0, "write");
+                break;
+            case Operation::ReadUntil:
+                chain.m_buffer.clear();
+                chain.m_buffer.reserve(256);
+                m_engine->async_read_until(chain.m_in, chain.m_buffer, callback, std::string_view("\r\n"));
+                check(write(chain.m_out, m_payload.data(), m_payload.size()) > 0, "write");
+                break;
+            case Operation::Write:
+                // Блок больше буфера сокета, поэтому запись завершается только после вычитывания
+                m_engine->async_write(chain.m_in, m_payload, callback);
+                break;
+            case Operation::Accept:
+                // Клиентский сокет создается заранее: коллбек может выполниться в другом потоке сразу после connect
+                chain.m_out = makeClient(m_config.m_transport);
+                m_engine->async_accept(chain.m_in, callback);
+                connectTo(chain.m_out, chain.m_address, chain.m_addressLength);
+                break;
+        }
+    }
+
+    Config m_config;
+    std::shared_ptr<messaging::PollMessageEngine> m_engine = std::make_shared<messaging::PollMessageEngine>();
+    boost::asio::thread_pool m_pool;
+    std::vector<Chain> m_chains;
+    std::vector<std::pair<int, int>> m_idle;
+    std::string m_idleBuffer = std::string(1, '\0');
+    std::string m_payload;
+    std::atomic_bool m_isMeasuring = false, m_isStopping = false, m_isReactorStopping = false;
+    std::atomic_size_t m_activeChains = 0;
+};
+
+double percentileMicroseconds(std::vector<std::uint32_t>& latencies, double quantile)
+{
+    if (latencies.empty())
+        return 0;
+    auto position = latencies.begin() + static_cast<std::ptrdiff_t>(quantile * static_cast<double>(latencies.size() - 1));
+    std::nth_element(latencies.begin(), position, latencies.end());
+    return *position / 1000.0;
+}
+
+template<typename T>
+std::vector<T> parseList(const std::string& text, const std::function<T(const std::string&)>& parse)
+{
+    std::vector<T> values;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        values.push_back(parse(item));
+    return values;
+}
+
+// Поднимает ограничение на количество дескрипторов до жесткого предела; возвращает итоговое ограничение
+rlim_t raiseDescriptorLimit()
+{
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur;
+}
+
+} //namespace
+
+int main(int argc, const char* argv[])
+{
+    std::string operations, transports, fdCounts, threadCounts;
+    unsigned chainsPerThread = 4, durationMilliseconds = 500;
+    std::size_t writeSize = 1024 * 1024;
+    auto hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    boost::program_options::options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "produce help message")
+            ("ops", boost::program_options::value<std::string>(&operations)->default_value("read_some,write,read_until,accept"),
+                    "comma-separated operations: read_some, write, read_until, accept")
+            ("transports", boost::program_options::value<std::string>(&transports)->default_value("socketpair,tcp"),
+                    "comma-separated transports: socketpair, tcp")
+            ("fds", boost::program_options::value<std::string>(&fdCounts)->default_value("1,100,1000,10000,100000"),
+                    "comma-separated numbers of idle descriptors registered in the engine")
+            ("threads", boost::program_options::value<std::string>(&threadCounts)->default_value(
+                    hardwareThreads > 1 ? "1," + std::to_string(hardwareThreads) : "1"),
+                    "comma-separated numbers of worker threads running callbacks")
+            ("chains-per-thread", boost::program_options::value<unsigned>(&chainsPerThread), "concurrent operation chains per worker thread")
+            ("duration", boost::program_options::value<unsigned>(&durationMilliseconds), "measurement time of every configuration in ms")
+            ("write-size", boost::program_options::value<std::size_t>(&writeSize), "bytes per async_write operation");
+    boost::program_options::variables_map options;
+    try
+    {
+        boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), options);
+        boost::program_options::notify(options);
+    } catch (const std::exception& error)
+    {
+        std::cerr << error.what() << "\nUse \"--help\" option to view the list of available options\n";
+        return 2;
+    }
+    if (options.count("help"))
+    {
+        std::cout << desc << '\n';
+        return 1;
+    }
+
+    std::vector<Operation> operationList;
+    std::vector<Transport> transportList;
+    std::vector<std::size_t> fdList;
+    std::vector<unsigned> threadList;
+    try
+    {
+        operationList = parseList<Operation>(operations, [](const std::string& name)
+        {
+            for (auto operation: {Operation::ReadSome, Operation::Write, Operation::ReadUntil, Operation::Accept})
+            {
+                if (operationName(operation) == name)
+                    return operation;
+            }
+            throw std::invalid_argument("unknown operation " + name);
+        });
+        transportList = parseList<Transport>(transports, [](const std::string& name)
+        {
+            if (name == "socketpair" || name == "tcp")
+                return name == "tcp" ? Transport::Tcp : Transport::SocketPair;
+            throw std::invalid_argument("unknown transport " + name);
+        });
+        fdList = parseList<std::size_t>(fdCounts, [](const std::string& count) { return std::stoul(count); });
+        threadList = parseList<unsigned>(threadCounts, [](const std::string& count) { return std::max(1ul, std::stoul(count)); });
+    } catch (const std::exception& error)
+    {
+        std::cerr << "Invalid option value: " << error.what() << '\n';
+        return 2;
+    }
+
+    auto descriptorLimit = raiseDescriptorLimit();
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << std::left << std::setw(12) << "operation" << std::setw(12) << "transport" << std::right
+              << std::setw(8) << "fds" << std::setw(8) << "threads" << std::setw(14) << "ops/s"
+              << std::setw(11) << "p50, us" << std::setw(11) << "p99, us" << std::setw(11) << "p99.9, us" << '\n';
+    for (auto operation: operationList)
+    {
+        for (auto transport: transportList)
+        {
+            for (auto fdCount: fdList)
+            {
+                for (auto threadCount: threadList)
+                {
+                    std::cout << std::left << std::setw(12) << operationName(operation)
+                              << std::setw(12) << transportName(transport) << std::right
+                              << std::setw(8) << fdCount << std::setw(8) << threadCount << std::flush;
+                    // Простаивающая пара - два дескриптора, цепочка - не больше трех, плюс запас для самой программы
+                    auto requiredDescriptors = 2 * fdCount + 3 * threadCount * chainsPerThread + 64;
+                    if (requiredDescriptors > descriptorLimit)
+                    {
+                        std::cout << "  skipped: needs " << requiredDescriptors << " descriptors, limit is " << descriptorLimit << '\n';
+                        continue;
+                    }
+                    try
+                    {
+                        Bench bench({
+                                operation, transport, fdCount, threadCount, chainsPerThread,
+                                std::chrono::milliseconds(durationMilliseconds), writeSize});
+                        auto result = bench.run();
+                        std::cout << std::fixed << std::setprecision(0)
+                                  << std::setw(14) << result.m_operations / result.m_seconds << std::setprecision(1)
+                                  << std::setw(11) << percentileMicroseconds(result.m_latencies, 0.5)
+                                  << std::setw(11) << percentileMicroseconds(result.m_latencies, 0.99)
+                                  << std::setw(11) << percentileMicroseconds(result.m_latencies, 0.999) << '\n';
+                    } catch (const std::system_error& error)
+                    {
+                        std::cout << "  failed: " << error.what() << '\n';
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,779 @@
+// Проверка бюджета выделений памяти и системных вызовов сервера на команду и на передачу.
+// Сервер запускается в этом же процессе, а сценарии выполняет простой блокирующий клиент в главном потоке.
+// Выделения считаются заменой глобального operator new во всех потоках, кроме клиентского; выделения
+// внутри libc (например, буфер FILE у fopen) в счет не попадают.
+// Системные вызовы считаются фильтром seccomp с уведомлением пользовательского пространства: фильтр
+// ставит поток, который создает сервер, и его наследуют все потоки сервера, поэтому учитываются и вызовы
+// из libc, например чтение файла внутри fread. Ожидания (poll, futex, сон) зависят от времени и
+// конкуренции потоков, а не от работы, поэтому они показываются отдельно и в бюджет не входят.
+// Бюджеты на итерацию сценария хранятся в текстовом файле; превышение хотя бы одного дает код выхода 1
+#include <FTPServer.h>
+#include <boost/program_options.hpp>
+#include <arpa/inet.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstddef>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+
+namespace {
+
+constexpr std::size_t syscallCount = 512;
+
+std::atomic_uint64_t s_allocations = 0, s_allocatedBytes = 0;
+std::array<std::atomic_uint64_t, syscallCount> s_syscalls{};
+// Поток клиента и поток-счетчик системных вызовов не относятся к серверу
+thread_local bool t_isCounted = true;
+
+void countAllocation(std::size_t size)
+{
+    if (t_isCounted)
+    {
+        s_allocations.fetch_add(1, std::memory_order_relaxed);
+        s_allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+}
+
+void* allocate(std::size_t size, std::align_val_t alignment = std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__))
+{
+    countAllocation(size);
+    auto align = static_cast<std::size_t>(alignment);
+    void* pointer = align > __STDCPP_DEFAULT_NEW_ALIGNMENT__
+                    ? std::aligned_alloc(align, (std::max<std::size_t>(size, 1) + align - 1) / align * align)
+                    : std::malloc(std::max<std::size_t>(size, 1));
+    if (!pointer)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+} //namespace
+
+void* operator new(std::size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new[](std::size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, alignment);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try
+    {
+        return allocate(size);
+    } catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    try
+    {
+        return allocate(size);
+    } catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void* pointer, std::size_t, std::align_val_t) noexcept
+{
+    std::free(pointer);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void check(bool isSuccessful, const char* what)
+{
+    if (!isSuccessful)
+        throw std::system_error(errno, std::system_category(), what);
+}
+
+std::string syscallName(std::size_t number)
+{
+    static const std::map<std::size_t, std::string_view> names = {
+#define FTP_BUDGET_SYSCALL(name) {SYS_##name, #name},
+            FTP_BUDGET_SYSCALL(read) FTP_BUDGET_SYSCALL(write) FTP_BUDGET_SYSCALL(readv) FTP_BUDGET_SYSCALL(writev)
+            FTP_BUDGET_SYSCALL(pread64) FTP_BUDGET_SYSCALL(pwrite64) FTP_BUDGET_SYSCALL(sendto) FTP_BUDGET_SYSCALL(recvfrom)
+            FTP_BUDGET_SYSCALL(sendfile) FTP_BUDGET_SYSCALL(splice) FTP_BUDGET_SYSCALL(ppoll) FTP_BUDGET_SYSCALL(accept4)
+            FTP_BUDGET_SYSCALL(accept) FTP_BUDGET_SYSCALL(close) FTP_BUDGET_SYSCALL(openat) FTP_BUDGET_SYSCALL(fstat)
+            FTP_BUDGET_SYSCALL(newfstatat) FTP_BUDGET_SYSCALL(statx) FTP_BUDGET_SYSCALL(lseek) FTP_BUDGET_SYSCALL(fcntl)
+            FTP_BUDGET_SYSCALL(ioctl) FTP_BUDGET_SYSCALL(futex) FTP_BUDGET_SYSCALL(mmap) FTP_BUDGET_SYSCALL(munmap)
+            FTP_BUDGET_SYSCALL(mprotect) FTP_BUDGET_SYSCALL(madvise) FTP_BUDGET_SYSCALL(brk) FTP_BUDGET_SYSCALL(socket)
+            FTP_BUDGET_SYSCALL(bind) FTP_BUDGET_SYSCALL(listen) FTP_BUDGET_SYSCALL(setsockopt) FTP_BUDGET_SYSCALL(getsockopt)
+            FTP_BUDGET_SYSCALL(getsockname) FTP_BUDGET_SYSCALL(getpeername) FTP_BUDGET_SYSCALL(shutdown)
+            FTP_BUDGET_SYSCALL(inotify_add_watch) FTP_BUDGET_SYSCALL(inotify_rm_watch) FTP_BUDGET_SYSCALL(getdents64)
+            FTP_BUDGET_SYSCALL(clock_nanosleep) FTP_BUDGET_SYSCALL(sched_yield) FTP_BUDGET_SYSCALL(getrandom)
+            FTP_BUDGET_SYSCALL(rt_sigprocmask) FTP_BUDGET_SYSCALL(epoll_pwait) FTP_BUDGET_SYSCALL(readlinkat)
+#ifdef SYS_poll
+            FTP_BUDGET_SYSCALL(poll) FTP_BUDGET_SYSCALL(open) FTP_BUDGET_SYSCALL(stat) FTP_BUDGET_SYSCALL(lstat)
+            FTP_BUDGET_SYSCALL(nanosleep) FTP_BUDGET_SYSCALL(epoll_wait)
+#endif
+#undef FTP_BUDGET_SYSCALL
+    };
+    if (auto name = names.find(number); name != names.end())
+        return std::string(name->second);
+    return "syscall " + std::to_string(number);
+}
+
+// Вызовы, количество которых определяется временем ожидания и конкуренцией потоков, а не выполненной работой
+bool isWaiting(std::size_t number)
+{
+    switch (number)
+    {
+        case SYS_ppoll:
+        case SYS_futex:
+        case SYS_clock_nanosleep:
+        case SYS_sched_yield:
+        case SYS_epoll_pwait:
+#ifdef SYS_poll
+        case SYS_poll:
+        case SYS_nanosleep:
+        case SYS_epoll_wait:
+#endif
+            return true;
+        default:
+            return false;
+    }
+}
+
+struct Counters
+{
+    std::uint64_t m_allocations = 0, m_allocatedBytes = 0;
+    std::array<std::uint64_t, syscallCount> m_syscalls{};
+
+    static Counters now()
+    {
+        Counters counters;
+        counters.m_allocations = s_allocations.load();
+        counters.m_allocatedBytes = s_allocatedBytes.load();
+        for (std::size_t i = 0; i < syscallCount; ++i)
+            counters.m_syscalls[i] = s_syscalls[i].load();
+        return counters;
+    }
+
+    Counters operator-(const Counters& other) const
+    {
+        Counters difference;
+        difference.m_allocations = m_allocations - other.m_allocations;
+        difference.m_allocatedBytes = m_allocatedBytes - other.m_allocatedBytes;
+        for (std::size_t i = 0; i < syscallCount; ++i)
+            difference.m_syscalls[i] = m_syscalls[i] - other.m_syscalls[i];
+        return difference;
+    }
+
+    std::uint64_t workSyscalls() const
+    {
+        std::uint64_t total = 0;
+        for (std::size_t i = 0; i < syscallCount; ++i)
+            total += isWaiting(i) ? 0 : m_syscalls[i];
+        return total;
+    }
+
+    std::uint64_t waitSyscalls() const
+    {
+        std::uint64_t total = 0;
+        for (std::size_t i = 0; i < syscallCount; ++i)
+            total += isWaiting(i) ? m_syscalls[i] : 0;
+        return total;
+    }
+};
+
+// Фильтр, который отправляет каждый системный вызов на уведомление; возвращает дескриптор для получения уведомлений.
+// Действует на вызвавший поток и на все потоки, которые он создаст позже
+int installSyscallFilter()
+{
+#if defined(__x86_64__)
+    constexpr std::uint32_t arch = AUDIT_ARCH_X86_64;
+#elif defined(__aarch64__)
+    constexpr std::uint32_t arch = AUDIT_ARCH_AARCH64;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+    sock_filter filter[] = {
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch)),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, arch, 1, 0),
+            BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+            BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+    };
+    sock_fprog program{static_cast<unsigned short>(std::size(filter)), filter};
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
+        return -1;
+    return static_cast<int>(syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &program));
+}
+
+// Считает уведомления и разрешает вызовы. Пока уведомление не обработано, вызвавший поток стоит,
+// поэтому здесь нельзя ничего выделять: поток сервера может держать блокировку аллокатора
+void countSyscalls(int notifyFd)
+{
+    t_isCounted = false;
+    seccomp_notif request;
+    seccomp_notif_resp response;
+    while (true)
+    {
+        std::memset(&request, 0, sizeof request);
+        if (ioctl(notifyFd, SECCOMP_IOCTL_NOTIF_RECV, &request) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            // Все потоки с фильтром завершились
+            return;
+        }
+        if (request.data.nr >= 0 && static_cast<std::size_t>(request.data.nr) < syscallCount)
+            s_syscalls[request.data.nr].fetch_add(1, std::memory_order_relaxed);
+        std::memset(&response, 0, sizeof response);
+        response.id = request.id;
+        response.flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+        // Ошибка здесь означает, что вызвавший поток уже прерван сигналом
+        ioctl(notifyFd, SECCOMP_IOCTL_NOTIF_SEND, &response);
+    }
+}
+
+// Блокирующий клиент
+class Session
+{
+public:
+    explicit Session(const sockaddr_in& server)
+    : m_server(server)
+    , m_fd(connectTo(server))
+    {
+        expect(readReply(), 220, "greeting");
+    }
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    ~Session()
+    {
+        close(m_fd);
+    }
+
+    int command(std::string_view text)
+    {
+        sendCommand(text);
+        return readReply();
+    }
+
+    void expectCommand(std::string_view text, int code)
+    {
+        expect(command(text), code, text);
+    }
+
+    // Передача с сервера через PASV: LIST или RETR; возвращает количество принятых байтов
+    std::uint64_t download(std::string_view text)
+    {
+        int dataFd = openDataConnection();
+        sendCommand(text);
+        expect(readReply(), 150, text);
+        std::uint64_t bytes = 0;
+        for (ssize_t res; (res = read(dataFd, m_buffer.data(), m_buffer.size())) != 0;)
+        {
+            if (res < 0 && errno == EINTR)
+                continue;
+            check(res > 0, "read");
+            bytes += res;
+        }
+        close(dataFd);
+        expect(readReply(), 250, text);
+        return bytes;
+    }
+
+    // Передача на сервер через PASV: STOR
+    void upload(std::string_view text, std::string_view payload)
+    {
+        int dataFd = openDataConnection();
+        sendCommand(text);
+        expect(readReply(), 150, text);
+        for (std::size_t offset = 0; offset < payload.size();)
+        {
+            auto res = write(dataFd, payload.data() + offset, payload.size() - offset);
+            if (res < 0 && errno == EINTR)
+                continue;
+            check(res > 0, "write");
+            offset += res;
+        }
+        close(dataFd);
+        expect(readReply(), 250, text);
+    }
+
+private:
+    static int connectTo(const sockaddr_in& address)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        check(fd >= 0, "socket");
+        if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof address) < 0)
+        {
+            close(fd);
+            check(false, "connect");
+        }
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+        return fd;
+    }
+
+    static void expect(int code, int expected, std::string_view what)
+    {
+        if (code != expected)
+            throw std::runtime_error(std::string(what) + ": reply " + std::to_string(code) + ", expected " + std::to_string(expected));
+    }
+
+    void sendCommand(std::string_view text)
+    {
+        std::string line(text);
+        line.append("\r\n");
+        check(write(m_fd, line.data(), line.size()) == static_cast<ssize_t>(line.size()), "write");
+    }
+
+    std::string readLine()
+    {
+        std::size_t lineEnd;
+        while ((lineEnd = m_input.find("\r\n")) == std::string::npos)
+        {
+            auto res = read(m_fd, m_buffer.data(), m_buffer.size());
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+                throw std::runtime_error("control connection closed");
+            m_input.append(m_buffer.data(), res);
+        }
+        auto line = m_input.substr(0, lineEnd);
+        m_input.erase(0, lineEnd + 2);
+        return line;
+    }
+
+    int readReply()
+    {
+        return std::atoi(readLine().substr(0, 3).c_str());
+    }
+
+    int openDataConnection()
+    {
+        sendCommand("PASV");
+        auto line = readLine();
+        unsigned address[4], port[2];
+        auto argumentStart = line.find('(');
+        if (!line.starts_with("227") || argumentStart == std::string::npos
+            || sscanf(line.c_str() + argumentStart, "(%u,%u,%u,%u,%u,%u)",
+                      &address[0], &address[1], &address[2], &address[3], &port[0], &port[1]) != 6)
+            throw std::runtime_error("PASV: " + line);
+        auto dataAddress = m_server;
+        dataAddress.sin_port = htons(static_cast<std::uint16_t>(port[0] << 8 | port[1]));
+        return connectTo(dataAddress);
+    }
+
+    sockaddr_in m_server;
+    int m_fd;
+    std::string m_input;
+    std::array<char, 64 * 1024> m_buffer;
+};
+
+struct Scenario
+{
+    std::string m_name;
+    unsigned m_iterations;
+    std::function<void(Session&)> m_iteration;
+};
+
+struct Measurement
+{
+    const Scenario* m_scenario;
+    Counters m_counters;
+
+    double perIteration(std::uint64_t value) const
+    {
+        return static_cast<double>(value) / m_scenario->m_iterations;
+    }
+};
+
+struct Budget
+{
+    double m_allocations, m_syscalls;
+};
+
+// Допуск покрывает фоновые события, например такт колеса таймеров, попавший в окно измерения,
+// и разбиение передачи на блоки, которое зависит от того, как быстро читает и пишет клиент.
+// Лишнее выделение или вызов на каждую команду или на каждый блок передачи его превышает
+bool isWithin(double measured, double budget)
+{
+    return measured <= budget + std::max(0.5, budget * 0.1);
+}
+
+std::map<std::string, Budget> loadBudgets(const std::filesystem::path& path)
+{
+    std::map<std::string, Budget> budgets;
+    std::ifstream input(path);
+    std::string line;
+    while (std::getline(input, line))
+    {
+        if (line.empty() || line.front() == '#')
+            continue;
+        std::istringstream fields(line);
+        Budget budget;
+        std::string name;
+        if (fields >> budget.m_allocations >> budget.m_syscalls >> std::ws && std::getline(fields, name))
+            budgets[name] = budget;
+    }
+    return budgets;
+}
+
+void saveBudgets(const std::filesystem::path& path, const std::vector<Measurement>& measurements)
+{
+    std::ofstream output(path, std::ios::trunc);
+    output << "# Budgets per scenario iteration, written by ftp_budget --record.\n"
+              "# System calls exclude waiting (poll, futex, sleeps). A scenario fails when it needs more than\n"
+              "# the budget plus max(0.5, 10%).\n"
+              "# allocations syscalls scenario\n"
+           << std::fixed << std::setprecision(1);
+    for (const auto &measurement: measurements)
+    {
+        output << std::setw(13) << measurement.perIteration(measurement.m_counters.m_allocations)
+               << std::setw(10) << measurement.perIteration(measurement.m_counters.workSyscalls())
+               << "  " << measurement.m_scenario->m_name << '\n';
+    }
+    if (!output)
+        throw std::system_error(errno, std::system_category(), "Budget file " + path.string());
+}
+
+std::vector<Scenario> makeScenarios(const std::string& payload)
+{
+    auto payloadOf = [&](std::size_t size) { return std::string_view(payload).substr(0, size); };
+    return {
+            {"USER", 200, [](Session& session) { session.expectCommand("USER anonymous", 230); }},
+            {"NOOP", 200, [](Session& session) { session.expectCommand("NOOP", 200); }},
+            {"TYPE I", 200, [](Session& session) { session.expectCommand("TYPE I", 200); }},
+            {"PASV", 200, [](Session& session) { session.expectCommand("PASV", 227); }},
+            {"SIZE", 200, [](Session& session) { session.expectCommand("SIZE file_1M", 213); }},
+            {"LIST", 50, [](Session& session) { session.download("LIST"); }},
+            // 1 MiB - наибольший файл, который попадает в кэш содержимого с настройками по умолчанию
+            {"RETR 1 MiB in TYPE I", 20, [](Session& session) { session.download("RETR file_1M"); }},
+            {"RETR 4 MiB in TYPE I", 5, [](Session& session) { session.download("RETR file_4M"); }},
+            {"RETR 8 MiB in TYPE I", 5, [](Session& session) { session.download("RETR file_8M"); }},
+            {"STOR 1 MiB in TYPE I", 5, [=](Session& session) { session.upload("STOR upload", payloadOf(1 << 20)); }},
+            {"STOR 2 MiB in TYPE I", 5, [=](Session& session) { session.upload("STOR upload", payloadOf(2 << 20)); }},
+    };
+}
+
+// Стоимость одного МиБ передачи как разница между двумя размерами одной и той же передачи;
+// она не зависит от того, какими блоками сервер передает данные
+void printMarginal(std::ostream& out, const std::vector<Measurement>& measurements,
+                   std::string_view smaller, std::string_view larger, double megabytes, std::string_view title)
+{
+    auto find = [&](std::string_view name)
+    {
+        return std::find_if(measurements.begin(), measurements.end(),
+                            [&](const Measurement& measurement) { return measurement.m_scenario->m_name == name; });
+    };
+    auto first = find(smaller), second = find(larger);
+    if (first == measurements.end() || second == measurements.end())
+        return;
+    out << title << ": "
+        << (second->perIteration(second->m_counters.m_allocations) - first->perIteration(first->m_counters.m_allocations)) / megabytes
+        << " allocations, "
+        << (second->perIteration(second->m_counters.workSyscalls()) - first->perIteration(first->m_counters.workSyscalls())) / megabytes
+        << " syscalls\n";
+}
+
+void createFile(const std::filesystem::path& path, std::uint64_t size)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    check(fd >= 0, "open");
+    std::string block(64 * 1024, 'x');
+    for (std::uint64_t written = 0; written < size;)
+    {
+        auto res = write(fd, block.data(), std::min<std::uint64_t>(block.size(), size - written));
+        if (res <= 0)
+        {
+            close(fd);
+            check(false, "write");
+        }
+        written += res;
+    }
+    close(fd);
+}
+
+} //namespace
+
+int main(int argc, const char* argv[])
+{
+    std::filesystem::path budgetPath = FTP_BUDGET_FILE;
+    std::string filter;
+    boost::program_options::options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "produce help message")
+            ("budgets", boost::program_options::value<std::filesystem::path>(&budgetPath)->default_value(budgetPath),
+                    "file with the recorded budgets")
+            ("record", "write the measured values to the budget file instead of checking them")
+            ("scenario", boost::program_options::value<std::string>(&filter), "run only scenarios containing the given text")
+            ("verbose", "print every system call of every scenario");
+    boost::program_options::variables_map options;
+    try
+    {
+        boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), options);
+        boost::program_options::notify(options);
+    } catch (const std::exception& error)
+    {
+        std::cerr << error.what() << "\nUse \"--help\" option to view the list of available options\n";
+        return 2;
+    }
+    if (options.count("help"))
+    {
+        std::cout << desc << '\n';
+        return 1;
+    }
+    bool isRecording = options.count("record") > 0, isVerbose = options.count("verbose") > 0;
+    if (isRecording && !filter.empty())
+    {
+        std::cerr << "--record needs all scenarios\n";
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    t_isCounted = false;
+
+    std::string rootTemplate = (std::filesystem::temp_directory_path()/"ftp_budget.XXXXXX").string();
+    if (!mkdtemp(rootTemplate.data()))
+    {
+        std::cerr << "Cannot create the server root: " << std::system_error(errno, std::system_category()).what() << '\n';
+        return 2;
+    }
+    std::filesystem::path root = rootTemplate;
+    std::string payload(2 << 20, 'x');
+    int status = 0;
+    try
+    {
+        createFile(root/"file_1M", 1 << 20);
+        createFile(root/"file_4M", 4 << 20);
+        createFile(root/"file_8M", 8 << 20);
+        createFile(root/"upload", 0);
+        for (int i = 0; i < 16; ++i)
+            createFile(root/("small_" + std::to_string(i)), 1024);
+
+        int listenerFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        check(listenerFd >= 0, "socket");
+        sockaddr_in serverAddress{};
+        serverAddress.sin_family = AF_INET;
+        serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addressLength = sizeof serverAddress;
+        check(bind(listenerFd, reinterpret_cast<sockaddr*>(&serverAddress), addressLength) == 0
+              && listen(listenerFd, SOMAXCONN) == 0
+              && getsockname(listenerFd, reinterpret_cast<sockaddr*>(&serverAddress), &addressLength) == 0, "listen");
+        ftp::details::helpers::setNonBlocking(listenerFd);
+
+        // Поток-счетчик создается до фильтра и ждет дескриптор уведомлений без блокирующих примитивов:
+        // поток сервера после установки фильтра сам не может сделать ни одного системного вызова, пока счетчик не запущен
+        std::atomic_int notifyFd = -1;
+        std::atomic_int serverState = 0; // 0 - запускается, 1 - работает, 2 - остановить, -1 - ошибка запуска
+        std::string serverError;
+        std::thread counter(
+                [&]()
+                {
+                    t_isCounted = false;
+                    while (notifyFd.load() == -1)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    if (notifyFd.load() >= 0)
+                        countSyscalls(notifyFd.load());
+                });
+        std::thread serverThread(
+                [&]()
+                {
+                    int fd = installSyscallFilter();
+                    if (fd < 0)
+                    {
+                        serverError = std::string("seccomp: ") + std::system_error(errno, std::system_category()).what();
+                        notifyFd.store(-2);
+                        serverState.store(-1);
+                        return;
+                    }
+                    notifyFd.store(fd);
+                    std::unique_ptr<ftp::Server> server;
+                    try
+                    {
+                        server = std::make_unique<ftp::Server>(listenerFd, (root/"").lexically_normal(), 1);
+                        server->start();
+                    } catch (const std::exception& error)
+                    {
+                        serverError = error.what();
+                        serverState.store(-1);
+                        return;
+                    }
+                    serverState.store(1);
+                    while (serverState.load() == 1)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    server.reset();
+                });
+        while (serverState.load() == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        auto scenarios = makeScenarios(payload);
+        std::vector<Measurement> measurements;
+        if (serverState.load() == 1)
+        {
+            try
+            {
+                for (const auto &scenario: scenarios)
+                {
+                    if (!filter.empty() && scenario.m_name.find(filter) == std::string::npos)
+                        continue;
+                    Session session(serverAddress);
+                    session.expectCommand("USER anonymous", 230);
+                    session.expectCommand("TYPE I", 200);
+                    // Прогрев заполняет кэши сервера и пулы буферов
+                    for (unsigned i = 0; i < std::max(1u, scenario.m_iterations / 10); ++i)
+                        scenario.m_iteration(session);
+                    // Сервер заканчивает работу после отправки ответа, например снова ставит чтение команды,
+                    // поэтому до и после измерения ему дается время закончить
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                    auto before = Counters::now();
+                    for (unsigned i = 0; i < scenario.m_iterations; ++i)
+                        scenario.m_iteration(session);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                    measurements.push_back({&scenario, Counters::now() - before});
+                }
+            } catch (...)
+            {
+                serverState.store(2);
+                serverThread.join();
+                close(notifyFd.load());
+                counter.join();
+                throw;
+            }
+            serverState.store(2);
+        }
+        serverThread.join();
+        if (notifyFd.load() >= 0)
+            close(notifyFd.load());
+        counter.join();
+        // Слушающий сокет закрывает сервер; если сервер не запустился, сокет остался за нами
+        if (!serverError.empty())
+        {
+            close(listenerFd);
+            throw std::runtime_error(serverError);
+        }
+
+        std::map<std::string, Budget> budgets;
+        if (!isRecording)
+            budgets = loadBudgets(budgetPath);
+        std::cout << std::left << std::setw(24) << "scenario" << std::right << std::setw(10) << "allocs" << std::setw(12) << "bytes"
+                  << std::setw(10) << "syscalls" << std::setw(8) << "waits";
+        if (!isRecording)
+            std::cout << std::setw(20) << "budget" << "  result";
+        std::cout << "\n" << std::fixed;
+        for (const auto &measurement: measurements)
+        {
+            const auto &counters = measurement.m_counters;
+            auto allocations = measurement.perIteration(counters.m_allocations);
+            auto syscalls = measurement.perIteration(counters.workSyscalls());
+            std::cout << std::left << std::setw(24) << measurement.m_scenario->m_name << std::right << std::setprecision(1)
+                      << std::setw(10) << allocations << std::setprecision(0)
+                      << std::setw(12) << measurement.perIteration(counters.m_allocatedBytes) << std::setprecision(1)
+                      << std::setw(10) << syscalls << std::setw(8) << measurement.perIteration(counters.waitSyscalls());
+            if (!isRecording)
+            {
+                auto budget = budgets.find(measurement.m_scenario->m_name);
+                if (budget == budgets.end())
+                {
+                    std::cout << std::setw(20) << "-" << "  FAIL: no budget, run with --record";
+                    status = 1;
+                }
+                else
+                {
+                    std::ostringstream budgetText;
+                    budgetText << std::fixed << std::setprecision(1) << budget->second.m_allocations << " / " << budget->second.m_syscalls;
+                    bool isPassed = isWithin(allocations, budget->second.m_allocations) && isWithin(syscalls, budget->second.m_syscalls);
+                    std::cout << std::setw(20) << budgetText.str() << (isPassed ? "  ok" : "  FAIL: over budget");
+                    if (!isPassed)
+                        status = 1;
+                }
+            }
+            std::cout << '\n';
+            if (isVerbose)
+            {
+                for (std::size_t i = 0; i < syscallCount; ++i)
+                {
+                    if (counters.m_syscalls[i] > 0)
+                        std::cout << "    " << std::left << std::setw(20) << syscallName(i) << std::right
+                                  << std::setw(12) << std::setprecision(2) << measurement.perIteration(counters.m_syscalls[i])
+                                  << (isWaiting(i) ? "  (wait)" : "") << '\n';
+                }
+            }
+        }
+        std::cout << std::setprecision(1);
+        printMarginal(std::cout, measurements, "RETR 4 MiB in TYPE I", "RETR 8 MiB in TYPE I", 4, "RETR from disk per MiB");
+        printMarginal(std::cout, measurements, "STOR 1 MiB in TYPE I", "STOR 2 MiB in TYPE I", 1, "STOR per MiB");
+        if (isRecording)
+        {
+            saveBudgets(budgetPath, measurements);
+            std::cout << "Budgets written to " << budgetPath.string() << '\n';
+        }
+    } catch (const std::exception& error)
+    {
+        std::cerr << "Budget check failed to run: " << error.what() << '\n';
+        status = 2;
+    }
+    std::error_code ignored;
+    std::filesystem::remove_all(root, ignored);
+    return status;
+}
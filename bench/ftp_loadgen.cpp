@@ -0,0 +1,1091 @@
+// Генератор нагрузки на сервер целиком.
+// Сервер запускается в этом же процессе на 127.0.0.1 с корнем в сгенерированном каталоге, а клиенты работают
+// на отдельном экземпляре PollMessageEngine со своим пулом потоков. Каждый клиент входит в систему и затем
+// по кругу выполняет действия, выбираемые случайно с весами из сценария: NOOP, LIST, RETR и STOR через PASV.
+// Сценарий - текстовый файл или один из встроенных, см. scenarioHelp.
+// С --storage memory файлы создаются сразу в MemoryStorage, и сетевой путь сервера измеряется без диска
+#include <FTPServer.h>
+#include <MemoryStorage.h>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/program_options.hpp>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::string_view scenarioHelp =
+        "Scenario file format, one directive per line, '#' starts a comment:\n"
+        "  clients <n>                  simultaneous client sessions\n"
+        "  duration <seconds>           measurement time after all clients have logged in\n"
+        "  server-threads <n>           server worker threads\n"
+        "  client-threads <n>           threads running client callbacks\n"
+        "  think <ms>                   pause of every client between actions\n"
+        "  fileset <name> <count> <size>  generate files <name>_0 .. <name>_<count-1> in the root\n"
+        "  action <weight> NOOP\n"
+        "  action <weight> LIST\n"
+        "  action <weight> RETR <fileset>  download a random file of the set\n"
+        "  action <weight> STOR <size>     upload to a file of its own\n"
+        "  action <weight> QUIT            close the session and log in on a new connection\n"
+        "Sizes accept K, M and G suffixes (powers of 1024).\n"
+        "Built-in scenarios: small-files, large-files, mixed, stress.\n";
+
+// Много мелких файлов: каталог на десятки тысяч записей, передачи в несколько килобайт
+constexpr std::string_view smallFilesScenario = R"(
+clients 1000
+duration 10
+fileset small 20000 4K
+action 70 RETR small
+action 15 STOR 4K
+action 10 NOOP
+action 5 LIST
+)";
+
+// Несколько огромных файлов и немного клиентов: упор в пропускную способность передачи
+constexpr std::string_view largeFilesScenario = R"(
+clients 16
+duration 10
+fileset huge 4 256M
+action 90 RETR huge
+action 10 STOR 16M
+)";
+
+constexpr std::string_view mixedScenario = R"(
+clients 1000
+duration 10
+fileset small 5000 16K
+fileset medium 200 1M
+fileset huge 4 128M
+action 60 RETR small
+action 10 RETR medium
+action 1 RETR huge
+action 15 STOR 16K
+action 10 NOOP
+action 4 LIST
+)";
+
+// Проверка на гонки под ThreadSanitizer: кэшируемые и отдаваемые через sendfile файлы, листинги
+// каталога, который меняют загрузки, и постоянные подключения и отключения сессий
+constexpr std::string_view stressScenario = R"(
+clients 64
+duration 5
+server-threads 8
+client-threads 4
+fileset small 200 4K
+fileset medium 8 2M
+action 30 LIST
+action 30 RETR small
+action 10 RETR medium
+action 10 STOR 4K
+action 20 QUIT
+)";
+
+enum class Verb
+{
+    Noop,
+    List,
+    Retr,
+    Stor,
+    Quit
+};
+
+struct FileSet
+{
+    std::string m_name;
+    std::size_t m_count;
+    std::uint64_t m_size;
+};
+
+struct Action
+{
+    unsigned m_weight;
+    Verb m_verb;
+    std::size_t m_fileSet = 0; // Для RETR
+    std::uint64_t m_size = 0;  // Для STOR
+    std::string m_description;
+};
+
+struct Scenario
+{
+    std::string m_name;
+    std::size_t m_clients = 100;
+    unsigned m_durationSeconds = 10;
+    unsigned m_serverThreads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned m_clientThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::chrono::milliseconds m_thinkTime{0};
+    std::vector<FileSet> m_fileSets;
+    std::vector<Action> m_actions;
+
+    bool hasUploads() const
+    {
+        return std::any_of(m_actions.begin(), m_actions.end(), [](const Action& action) { return action.m_verb == Verb::Stor; });
+    }
+};
+
+void check(bool isSuccessful, const char* what)
+{
+    if (!isSuccessful)
+        throw std::system_error(errno, std::system_category(), what);
+}
+
+std::uint64_t parseSize(const std::string& text)
+{
+    std::size_t suffixPosition = 0;
+    auto size = std::stoull(text, &suffixPosition);
+    auto suffix = text.substr(suffixPosition);
+    if (suffix.empty())
+        return size;
+    if (suffix == "K" || suffix == "k")
+        return size << 10;
+    if (suffix == "M" || suffix == "m")
+        return size << 20;
+    if (suffix == "G" || suffix == "g")
+        return size << 30;
+    throw std::invalid_argument("invalid size " + text);
+}
+
+Scenario parseScenario(std::istream& input, std::string name)
+{
+    Scenario scenario;
+    scenario.m_name = std::move(name);
+    std::string line;
+    for (unsigned lineNumber = 1; std::getline(input, line); ++lineNumber)
+    {
+        if (auto comment = line.find('#'); comment != std::string::npos)
+            line.erase(comment);
+        std::istringstream words(line);
+        std::string directive;
+        if (!(words >> directive))
+            continue;
+        try
+        {
+            std::string first, second, third;
+            words >> first >> second >> third;
+            if (directive == "clients")
+                scenario.m_clients = std::stoul(first);
+            else if (directive == "duration")
+                scenario.m_durationSeconds = std::stoul(first);
+            else if (directive == "server-threads")
+                scenario.m_serverThreads = std::max(1ul, std::stoul(first));
+            else if (directive == "client-threads")
+                scenario.m_clientThreads = std::max(1ul, std::stoul(first));
+            else if (directive == "think")
+                scenario.m_thinkTime = std::chrono::milliseconds(std::stoul(first));
+            else if (directive == "fileset")
+            {
+                if (first.empty() || first.find('/') != std::string::npos)
+                    throw std::invalid_argument("invalid file set name");
+                scenario.m_fileSets.push_back({first, std::stoul(second), parseSize(third)});
+                if (scenario.m_fileSets.back().m_count == 0)
+                    throw std::invalid_argument("empty file set");
+            }
+            else if (directive == "action")
+            {
+                Action action{static_cast<unsigned>(std::stoul(first)), Verb::Noop, 0, 0, second};
+                if (second == "NOOP")
+                    action.m_verb = Verb::Noop;
+                else if (second == "LIST")
+                    action.m_verb = Verb::List;
+                else if (second == "RETR")
+                {
+                    action.m_verb = Verb::Retr;
+                    auto fileSet = std::find_if(
+                            scenario.m_fileSets.begin(), scenario.m_fileSets.end(),
+                            [&](const FileSet& set) { return set.m_name == third; });
+                    if (fileSet == scenario.m_fileSets.end())
+                        throw std::invalid_argument("unknown file set " + third);
+                    action.m_fileSet = fileSet - scenario.m_fileSets.begin();
+                    action.m_description += " " + third;
+                }
+                else if (second == "STOR")
+                {
+                    action.m_verb = Verb::Stor;
+                    action.m_size = parseSize(third);
+                    action.m_description += " " + third;
+                }
+                else if (second == "QUIT")
+                    action.m_verb = Verb::Quit;
+                else
+                    throw std::invalid_argument("unknown action " + second);
+                scenario.m_actions.push_back(std::move(action));
+            }
+            else
+                throw std::invalid_argument("unknown directive " + directive);
+        } catch (const std::exception& error)
+        {
+            throw std::invalid_argument(scenario.m_name + ":" + std::to_string(lineNumber) + ": " + error.what());
+        }
+    }
+    if (scenario.m_actions.empty())
+        throw std::invalid_argument(scenario.m_name + ": no actions");
+    return scenario;
+}
+
+Scenario loadScenario(const std::string& name)
+{
+    for (auto [builtinName, text]: {
+            std::pair{"small-files", smallFilesScenario},
+            std::pair{"large-files", largeFilesScenario},
+            std::pair{"mixed", mixedScenario},
+            std::pair{"stress", stressScenario}})
+    {
+        if (name == builtinName)
+        {
+            std::istringstream input{std::string(text)};
+            return parseScenario(input, name);
+        }
+    }
+    std::ifstream input(name);
+    if (!input)
+        throw std::invalid_argument("cannot open scenario " + name);
+    return parseScenario(input, name);
+}
+
+std::string fileName(const FileSet& fileSet, std::size_t index)
+{
+    return fileSet.m_name + "_" + std::to_string(index);
+}
+
+std::string uploadName(std::size_t clientIndex)
+{
+    return "upload_" + std::to_string(clientIndex);
+}
+
+// Файлы наборов создаются разреженными: их содержимое - нули, а место на диске не расходуется.
+// STOR сервера принимает только существующие файлы, поэтому у каждого клиента заранее есть свой файл для загрузки
+void generateTree(const std::filesystem::path& root, const Scenario& scenario)
+{
+    auto createFile = [&](const std::string& name, std::uint64_t size)
+    {
+        int fd = open((root/name).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        check(fd >= 0, "open");
+        int res = ftruncate(fd, static_cast<off_t>(size));
+        close(fd);
+        check(res == 0, "ftruncate");
+    };
+    for (const auto &fileSet: scenario.m_fileSets)
+    {
+        for (std::size_t i = 0; i < fileSet.m_count; ++i)
+            createFile(fileName(fileSet, i), fileSet.m_size);
+    }
+    if (scenario.hasUploads())
+    {
+        for (std::size_t i = 0; i < scenario.m_clients; ++i)
+            createFile(uploadName(i), 0);
+    }
+}
+
+// То же дерево в памяти: все файлы набора разделяют один буфер содержимого
+void generateTree(ftp::MemoryStorage& storage, const Scenario& scenario)
+{
+    for (const auto &fileSet: scenario.m_fileSets)
+    {
+        auto content = std::make_shared<const std::string>(fileSet.m_size, '\0');
+        for (std::size_t i = 0; i < fileSet.m_count; ++i)
+            storage.put(fileName(fileSet, i), content);
+    }
+    if (scenario.hasUploads())
+    {
+        auto empty = std::make_shared<const std::string>();
+        for (std::size_t i = 0; i < scenario.m_clients; ++i)
+            storage.put(uploadName(i), empty);
+    }
+}
+
+void setNonBlocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Блокирующее соединение с последующим переводом в неблокирующий режим:
+// на loopback connect завершается сразу, если у слушающего сокета не переполнена очередь
+int connectTo(const sockaddr_in& address)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof address) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+    setNonBlocking(fd);
+    return fd;
+}
+
+// Соединение закрывается сбросом, чтобы клиентские порты не копились в TIME_WAIT.
+// Годится только когда все данные уже приняты: при сбросе неотправленные данные теряются
+void resetAndClose(int fd)
+{
+    linger reset{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof reset);
+    close(fd);
+}
+
+std::uint32_t elapsedMicroseconds(Clock::time_point start)
+{
+    return static_cast<std::uint32_t>(std::min<std::int64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count(),
+            std::numeric_limits<std::uint32_t>::max()));
+}
+
+// Результаты клиента; их меняют только коллбеки этого клиента, которые выполняются строго по очереди
+struct ClientStatistics
+{
+    std::uint64_t m_commands = 0;
+    std::uint64_t m_transfers = 0;
+    std::uint64_t m_bytes = 0;
+    std::uint64_t m_errors = 0;
+    std::vector<std::uint32_t> m_commandLatencies;             // Микросекунды до первой строки ответа
+    std::vector<std::vector<std::uint32_t>> m_actionLatencies; // Микросекунды действия целиком, по индексу действия
+};
+
+class LoadGenerator;
+
+class Client
+{
+public:
+    Client(LoadGenerator& generator, std::size_t index, int controlFd);
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    ~Client()
+    {
+        close(m_controlFd);
+        if (m_dataFd >= 0)
+            close(m_dataFd);
+    }
+
+    void start();
+
+    const ClientStatistics& statistics() const
+    {
+        return m_statistics;
+    }
+
+private:
+    using ReplyHandler = std::function<void(int code, std::string_view line)>;
+
+    // Принимает приветствие сервера и входит в сессию
+    void login(std::function<void()> done);
+    // Завершает сессию и входит заново на новом управляющем соединении
+    void reconnect(std::size_t actionIndex);
+    void readReply(ReplyHandler handler);
+    void command(std::string text, ReplyHandler handler);
+    // Выполняет следующий шаг; при слишком глубокой цепочке завершившихся сразу операций - через пул
+    void proceed(std::function<void()> step);
+    void nextAction();
+    void runAction();
+    void transfer(std::size_t actionIndex, std::string text, std::uint64_t uploadSize);
+    void receive(std::function<void()> done);
+    void finishTransfer(std::size_t actionIndex, std::uint64_t bytes);
+    void error(std::string_view what, std::string_view line = {});
+    void broken(std::string_view what);
+    bool isMeasuring() const;
+
+    LoadGenerator& m_generator;
+    std::size_t m_index;
+    int m_controlFd;
+    int m_dataFd = -1;
+    std::minstd_rand m_random;
+    std::string m_input, m_output;
+    std::string m_dataBuffer = std::string(64 * 1024, '\0');
+    Clock::time_point m_actionStart;
+    std::uint64_t m_receivedBytes = 0;
+    ClientStatistics m_statistics;
+};
+
+class LoadGenerator
+{
+public:
+    // storage - хранилище сервера; nullptr - локальная файловая система
+    LoadGenerator(const Scenario& scenario, const std::filesystem::path& root, std::shared_ptr<ftp::Storage> storage)
+    : m_scenario(scenario)
+    , m_pool(scenario.m_clientThreads)
+    , m_payload(maxUploadSize(scenario), 'x')
+    {
+        for (const auto &action: scenario.m_actions)
+            m_totalWeight += action.m_weight;
+
+        int listenerFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        check(listenerFd >= 0, "socket");
+        m_serverAddress.sin_family = AF_INET;
+        m_serverAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addressLength = sizeof m_serverAddress;
+        if (bind(listenerFd, reinterpret_cast<sockaddr*>(&m_serverAddress), addressLength) < 0
+            || listen(listenerFd, SOMAXCONN) < 0
+            || getsockname(listenerFd, reinterpret_cast<sockaddr*>(&m_serverAddress), &addressLength) < 0)
+        {
+            close(listenerFd);
+            check(false, "listen");
+        }
+        setNonBlocking(listenerFd);
+        ftp::ServerOptions serverOptions;
+        serverOptions.m_storage = std::move(storage);
+        m_server = std::make_unique<ftp::Server>(
+                listenerFd, (root/"").lexically_normal(), static_cast<int>(scenario.m_serverThreads), serverOptions);
+    }
+
+    ~LoadGenerator()
+    {
+        stopClients();
+        m_server.reset();
+    }
+
+    void run()
+    {
+        m_server->start();
+        m_reactor = std::thread(
+                [this]()
+                {
+                    while (!m_isReactorStopping.load())
+                        boost::asio::post(m_pool, m_engine->waitForEvent());
+                });
+
+        // Соединения открываются по одному: сервер принимает их параллельно, и очередь слушающего сокета не переполняется
+        m_clients.reserve(m_scenario.m_clients);
+        for (std::size_t i = 0; i < m_scenario.m_clients; ++i)
+        {
+            int fd = connectTo(m_serverAddress);
+            check(fd >= 0, "connect");
+            m_clients.push_back(std::make_unique<Client>(*this, i, fd));
+            ++m_activeClients;
+            boost::asio::post(m_pool, [client = m_clients.back().get()]() { client->start(); });
+        }
+
+        // Измерение начинается, когда вошли все клиенты
+        auto loginDeadline = Clock::now() + std::chrono::seconds(30);
+        while (m_readyClients.load() + m_brokenClients.load() < m_clients.size() && Clock::now() < loginDeadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        m_isMeasuring.store(true);
+        m_measureStart = Clock::now();
+        std::this_thread::sleep_for(std::chrono::seconds(m_scenario.m_durationSeconds));
+        m_isMeasuring.store(false);
+        m_measureEnd = Clock::now();
+
+        // Клиенты доводят до конца текущее действие и больше новых не начинают
+        m_isStopping.store(true);
+        auto stopDeadline = Clock::now() + std::chrono::seconds(30);
+        while (m_activeClients.load() > 0 && Clock::now() < stopDeadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        m_unfinishedClients = m_activeClients.load();
+        stopClients();
+    }
+
+    void report(std::ostream& out) const;
+
+    // Были ли ошибки команд, оборванные или не завершившиеся вовремя сессии
+    bool isFailed() const;
+
+    const Scenario& scenario() const
+    {
+        return m_scenario;
+    }
+
+    messaging::PollMessageEngine& engine()
+    {
+        return *m_engine;
+    }
+
+    boost::asio::thread_pool& pool()
+    {
+        return m_pool;
+    }
+
+    const sockaddr_in& serverAddress() const
+    {
+        return m_serverAddress;
+    }
+
+    std::string_view payload(std::uint64_t size) const
+    {
+        return std::string_view(m_payload).substr(0, size);
+    }
+
+    // Индекс действия, выбранного случайно с весами сценария
+    std::size_t chooseAction(std::minstd_rand& random) const
+    {
+        auto point = std::uniform_int_distribution<std::uint64_t>(0, m_totalWeight - 1)(random);
+        for (std::size_t i = 0; i < m_scenario.m_actions.size(); ++i)
+        {
+            if (point < m_scenario.m_actions[i].m_weight)
+                return i;
+            point -= m_scenario.m_actions[i].m_weight;
+        }
+        return m_scenario.m_actions.size() - 1;
+    }
+
+    bool isMeasuring() const
+    {
+        return m_isMeasuring.load(std::memory_order_relaxed);
+    }
+
+    bool isStopping() const
+    {
+        return m_isStopping.load(std::memory_order_relaxed);
+    }
+
+    void clientReady()
+    {
+        ++m_readyClients;
+    }
+
+    void clientFinished(bool isBroken)
+    {
+        if (isBroken)
+            ++m_brokenClients;
+        --m_activeClients;
+    }
+
+private:
+    static std::size_t maxUploadSize(const Scenario& scenario)
+    {
+        std::uint64_t size = 0;
+        for (const auto &action: scenario.m_actions)
+            size = std::max(size, action.m_size);
+        return size;
+    }
+
+    void stopClients()
+    {
+        if (!m_reactor.joinable())
+            return;
+        m_isReactorStopping.store(true);
+        m_engine->interrupt();
+        m_reactor.join();
+        m_pool.join();
+    }
+
+    Scenario m_scenario;
+    std::shared_ptr<messaging::PollMessageEngine> m_engine = std::make_shared<messaging::PollMessageEngine>();
+    boost::asio::thread_pool m_pool;
+    std::thread m_reactor;
+    std::unique_ptr<ftp::Server> m_server;
+    sockaddr_in m_serverAddress{};
+    std::string m_payload;
+    std::uint64_t m_totalWeight = 0;
+    std::vector<std::unique_ptr<Client>> m_clients;
+    std::atomic_bool m_isMeasuring = false, m_isStopping = false, m_isReactorStopping = false;
+    std::atomic_size_t m_activeClients = 0, m_readyClients = 0, m_brokenClients = 0;
+    std::size_t m_unfinishedClients = 0;
+    Clock::time_point m_measureStart, m_measureEnd;
+};
+
+Client::Client(LoadGenerator& generator, std::size_t index, int controlFd)
+: m_generator(generator)
+, m_index(index)
+, m_controlFd(controlFd)
+, m_random(static_cast<std::minstd_rand::result_type>(index + 1))
+{
+    m_input.reserve(4096);
+    m_statistics.m_actionLatencies.resize(generator.scenario().m_actions.size());
+}
+
+bool Client::isMeasuring() const
+{
+    return m_generator.isMeasuring();
+}
+
+void Client::start()
+{
+    login([this]()
+    {
+        m_generator.clientReady();
+        nextAction();
+    });
+}
+
+void Client::login(std::function<void()> done)
+{
+    readReply([this, done = std::move(done)](int code, std::string_view line) mutable
+    {
+        if (code != 220)
+            return broken(line);
+        command("USER anonymous", [this, done = std::move(done)](int code, std::string_view line) mutable
+        {
+            if (code != 230)
+                return broken(line);
+            command("TYPE I", [this, done = std::move(done)](int code, std::string_view line)
+            {
+                if (code != 200)
+                    return broken(line);
+                done();
+            });
+        });
+    });
+}
+
+void Client::reconnect(std::size_t actionIndex)
+{
+    command("QUIT", [this, actionIndex](int code, std::string_view line)
+    {
+        if (code != 221)
+            return broken(line);
+        // Сервер закрывает соединение после 221, поэтому закрытие обычное, без сброса
+        close(m_controlFd);
+        m_input.clear();
+        m_controlFd = connectTo(m_generator.serverAddress());
+        if (m_controlFd < 0)
+            return broken("connect");
+        login([this, actionIndex]()
+        {
+            if (isMeasuring())
+                m_statistics.m_actionLatencies[actionIndex].push_back(elapsedMicroseconds(m_actionStart));
+            nextAction();
+        });
+    });
+}
+
+void Client::readReply(ReplyHandler handler)
+{
+    m_generator.engine().async_read_until(
+            m_controlFd,
+            m_input,
+            std::make_shared<messaging::CallbackType>(
+                    [this, handler = std::move(handler)](int res)
+                    {
+                        if (res <= 0)
+                            return broken("control connection closed");
+                        // Прочитанное может содержать и следующие ответы, например 150 вместе с 250
+                        auto lineEnd = m_input.find("\r\n");
+                        std::string line = m_input.substr(0, lineEnd);
+                        m_input.erase(0, lineEnd + 2);
+                        int code = 0;
+                        std::from_chars(line.data(), line.data() + std::min<std::size_t>(line.size(), 3), code);
+                        handler(code, line);
+                    }),
+            std::string_view("\r\n"));
+}
+
+void Client::command(std::string text, ReplyHandler handler)
+{
+    m_output = std::move(text);
+    m_output.append("\r\n");
+    auto issued = Clock::now();
+    m_generator.engine().async_write(
+            m_controlFd,
+            m_output,
+            std::make_shared<messaging::CallbackType>(
+                    [this, issued, handler = std::move(handler)](int res) mutable
+                    {
+                        if (res < 0)
+                            return broken("control connection write failed");
+                        readReply([this, issued, handler = std::move(handler)](int code, std::string_view line)
+                        {
+                            if (isMeasuring())
+                            {
+                                ++m_statistics.m_commands;
+                                m_statistics.m_commandLatencies.push_back(elapsedMicroseconds(issued));
+                            }
+                            handler(code, line);
+                        });
+                    }));
+}
+
+void Client::proceed(std::function<void()> step)
+{
+    // Операция, завершившаяся сразу, вызывает коллбек в том же стеке, поэтому глубина считается для потока
+    constexpr int maxInlineDepth = 16;
+    thread_local int depth = 0;
+    if (depth >= maxInlineDepth)
+    {
+        boost::asio::post(m_generator.pool(), std::move(step));
+        return;
+    }
+    ++depth;
+    step();
+    --depth;
+}
+
+void Client::nextAction()
+{
+    if (m_generator.isStopping())
+        return m_generator.clientFinished(false);
+    if (m_generator.scenario().m_thinkTime.count() > 0)
+    {
+        m_generator.engine().async_wait(
+                m_generator.scenario().m_thinkTime,
+                std::make_shared<messaging::CallbackType>([this](int) { runAction(); }));
+    }
+    else
+        proceed([this]() { runAction(); });
+}
+
+void Client::runAction()
+{
+    auto actionIndex = m_generator.chooseAction(m_random);
+    const auto &action = m_generator.scenario().m_actions[actionIndex];
+    m_actionStart = Clock::now();
+    switch (action.m_verb)
+    {
+        case Verb::Noop:
+            command("NOOP", [this, actionIndex](int code, std::string_view line)
+            {
+                if (code != 200)
+                    error("NOOP", line);
+                else if (isMeasuring())
+                    m_statistics.m_actionLatencies[actionIndex].push_back(elapsedMicroseconds(m_actionStart));
+                nextAction();
+            });
+            break;
+        case Verb::List:
+            transfer(actionIndex, "LIST", 0);
+            break;
+        case Verb::Retr:
+        {
+            const auto &fileSet = m_generator.scenario().m_fileSets[action.m_fileSet];
+            auto fileIndex = std::uniform_int_distribution<std::size_t>(0, fileSet.m_count - 1)(m_random);
+            transfer(actionIndex, "RETR " + fileName(fileSet, fileIndex), 0);
+            break;
+        }
+        case Verb::Stor:
+            transfer(actionIndex, "STOR " + uploadName(m_index), action.m_size);
+            break;
+        case Verb::Quit:
+            reconnect(actionIndex);
+            break;
+    }
+}
+
+void Client::transfer(std::size_t actionIndex, std::string text, std::uint64_t uploadSize)
+{
+    command("PASV", [=, this, text = std::move(text)](int code, std::string_view line) mutable
+    {
+        unsigned address[4], port[2];
+        auto argumentStart = line.find('(');
+        if (code != 227 || argumentStart == std::string_view::npos
+            || sscanf(line.data() + argumentStart, "(%u,%u,%u,%u,%u,%u)",
+                      &address[0], &address[1], &address[2], &address[3], &port[0], &port[1]) != 6)
+        {
+            error("PASV", line);
+            return nextAction();
+        }
+        // Сервер принимает соединение данных только после 150, но loopback-соединение встает в очередь
+        // слушающего сокета сразу, поэтому подключиться можно до отправки команды
+        auto dataAddress = m_generator.serverAddress();
+        dataAddress.sin_port = htons(static_cast<std::uint16_t>(port[0] << 8 | port[1]));
+        m_dataFd = connectTo(dataAddress);
+        if (m_dataFd < 0)
+        {
+            error("data connection");
+            return nextAction();
+        }
+        command(std::move(text), [=, this](int code, std::string_view line)
+        {
+            if (code != 150)
+            {
+                close(std::exchange(m_dataFd, -1));
+                error("transfer start", line);
+                return nextAction();
+            }
+            if (uploadSize == 0)
+            {
+                m_receivedBytes = 0;
+                return receive([=, this]() { finishTransfer(actionIndex, m_receivedBytes); });
+            }
+            m_generator.engine().async_write(
+                    m_dataFd,
+                    m_generator.payload(uploadSize),
+                    std::make_shared<messaging::CallbackType>(
+                            [=, this](int res)
+                            {
+                                // Конец загрузки для сервера - закрытие соединения, поэтому закрытие обычное, без сброса
+                                close(std::exchange(m_dataFd, -1));
+                                if (res < 0)
+                                    error("upload");
+                                finishTransfer(actionIndex, res < 0 ? 0 : uploadSize);
+                            }));
+        });
+    });
+}
+
+void Client::receive(std::function<void()> done)
+{
+    m_generator.engine().async_read_some(
+            m_dataFd,
+            m_dataBuffer,
+            std::make_shared<messaging::CallbackType>(
+                    [this, done = std::move(done)](int res) mutable
+                    {
+                        if (res > 0)
+                        {
+                            m_receivedBytes += res;
+                            return proceed([this, done = std::move(done)]() mutable { receive(std::move(done)); });
+                        }
+                        if (res < 0)
+                            error("download");
+                        resetAndClose(std::exchange(m_dataFd, -1));
+                        done();
+                    }));
+}
+
+void Client::finishTransfer(std::size_t actionIndex, std::uint64_t bytes)
+{
+    readReply([=, this](int code, std::string_view line)
+    {
+        if (code != 250)
+            error("transfer", line);
+        else if (isMeasuring())
+        {
+            ++m_statistics.m_transfers;
+            m_statistics.m_bytes += bytes;
+            m_statistics.m_actionLatencies[actionIndex].push_back(elapsedMicroseconds(m_actionStart));
+        }
+        nextAction();
+    });
+}
+
+void Client::error(std::string_view what, std::string_view line)
+{
+    // Ошибки считаются и вне окна измерения: они означают неисправность, а не снижение производительности.
+    // Выводится только первая ошибка за запуск, остальные попадают в итоговый счетчик
+    static std::atomic_bool s_isReported = false;
+    ++m_statistics.m_errors;
+    if (!s_isReported.exchange(true))
+        std::cerr << "client " << m_index << ": " << what << " failed" << (line.empty() ? "" : ": ") << line << '\n';
+}
+
+void Client::broken(std::string_view what)
+{
+    error(what);
+    m_generator.clientFinished(true);
+}
+
+double percentileMilliseconds(std::vector<std::uint32_t>& latencies, double quantile)
+{
+    if (latencies.empty())
+        return 0;
+    auto position = latencies.begin() + static_cast<std::ptrdiff_t>(quantile * static_cast<double>(latencies.size() - 1));
+    std::nth_element(latencies.begin(), position, latencies.end());
+    return *position / 1000.0;
+}
+
+// Значение поля /proc/self/status в килобайтах, например VmRSS
+std::uint64_t processStatusKilobytes(std::string_view field)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.starts_with(field) && line.size() > field.size() && line[field.size()] == ':')
+            return std::stoull(line.substr(field.size() + 1));
+    }
+    return 0;
+}
+
+void LoadGenerator::report(std::ostream& out) const
+{
+    ClientStatistics total;
+    total.m_actionLatencies.resize(m_scenario.m_actions.size());
+    for (const auto &client: m_clients)
+    {
+        const auto &statistics = client->statistics();
+        total.m_commands += statistics.m_commands;
+        total.m_transfers += statistics.m_transfers;
+        total.m_bytes += statistics.m_bytes;
+        total.m_errors += statistics.m_errors;
+        total.m_commandLatencies.insert(
+                total.m_commandLatencies.end(), statistics.m_commandLatencies.begin(), statistics.m_commandLatencies.end());
+        for (std::size_t i = 0; i < m_scenario.m_actions.size(); ++i)
+        {
+            total.m_actionLatencies[i].insert(
+                    total.m_actionLatencies[i].end(),
+                    statistics.m_actionLatencies[i].begin(), statistics.m_actionLatencies[i].end());
+        }
+    }
+    auto seconds = std::chrono::duration<double>(m_measureEnd - m_measureStart).count();
+
+    out << "scenario " << m_scenario.m_name << ": " << m_clients.size() << " clients, "
+        << m_scenario.m_serverThreads << " server threads, " << m_scenario.m_clientThreads << " client threads, "
+        << std::fixed << std::setprecision(1) << seconds << " s measured\n";
+    out << "commands        " << std::setw(12) << total.m_commands
+        << std::setw(14) << std::setprecision(0) << total.m_commands / seconds << " /s\n";
+    out << "transfers       " << std::setw(12) << total.m_transfers
+        << std::setw(14) << total.m_transfers / seconds << " /s\n";
+    out << "transferred     " << std::setw(12) << std::setprecision(3) << total.m_bytes / 1e9 << " GB"
+        << std::setw(11) << total.m_bytes / 1e9 / seconds << " GB/s\n";
+    out << "errors          " << std::setw(12) << total.m_errors << '\n';
+    if (m_brokenClients.load() > 0 || m_unfinishedClients > 0)
+    {
+        out << "broken sessions " << std::setw(12) << m_brokenClients.load()
+            << ", not finished in time " << m_unfinishedClients << '\n';
+    }
+
+    out << std::left << std::setw(22) << "latency, ms" << std::right << std::setw(10) << "count"
+        << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10) << "p99.9" << '\n';
+    auto printLatencies = [&](std::string_view name, std::vector<std::uint32_t>& latencies)
+    {
+        out << std::left << std::setw(22) << name << std::right << std::setw(10) << latencies.size()
+            << std::setprecision(2) << std::setw(10) << percentileMilliseconds(latencies, 0.5)
+            << std::setw(10) << percentileMilliseconds(latencies, 0.99)
+            << std::setw(10) << percentileMilliseconds(latencies, 0.999) << '\n';
+    };
+    printLatencies("any command", total.m_commandLatencies);
+    for (std::size_t i = 0; i < m_scenario.m_actions.size(); ++i)
+        printLatencies(m_scenario.m_actions[i].m_description, total.m_actionLatencies[i]);
+
+    // Сервер и клиенты работают в одном процессе, поэтому память - общая для них
+    out << "RSS, server and clients: " << processStatusKilobytes("VmRSS") / 1024 << " MiB, peak "
+        << processStatusKilobytes("VmHWM") / 1024 << " MiB\n";
+}
+
+bool LoadGenerator::isFailed() const
+{
+    for (const auto &client: m_clients)
+    {
+        if (client->statistics().m_errors > 0)
+            return true;
+    }
+    return m_brokenClients.load() > 0 || m_unfinishedClients > 0;
+}
+
+// Поднимает ограничение на количество дескрипторов до жесткого предела; возвращает итоговое ограничение
+rlim_t raiseDescriptorLimit()
+{
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur;
+}
+
+} //namespace
+
+int main(int argc, const char* argv[])
+{
+    std::string scenarioName, storageName;
+    std::filesystem::path root;
+    boost::program_options::options_description desc("Allowed options");
+    desc.add_options()
+            ("help", "produce help message and the scenario file format")
+            ("scenario", boost::program_options::value<std::string>(&scenarioName)->default_value("mixed"),
+                    "built-in scenario name or scenario file")
+            ("root", boost::program_options::value<std::filesystem::path>(&root),
+                    "generate files in the given directory and keep them; a temporary directory is used by default")
+            ("storage", boost::program_options::value<std::string>(&storageName)->default_value("local"),
+                    "serve the files from \"local\" disk or from \"memory\" without touching the disk")
+            ("clients", boost::program_options::value<std::size_t>(), "override the number of clients")
+            ("duration", boost::program_options::value<unsigned>(), "override the measurement time in seconds")
+            ("server-threads", boost::program_options::value<unsigned>(), "override the number of server worker threads")
+            ("client-threads", boost::program_options::value<unsigned>(), "override the number of client threads")
+            ("strict", "exit with code 1 if a command failed or a session broke");
+    boost::program_options::variables_map options;
+    try
+    {
+        boost::program_options::store(boost::program_options::parse_command_line(argc, argv, desc), options);
+        boost::program_options::notify(options);
+    } catch (const std::exception& error)
+    {
+        std::cerr << error.what() << "\nUse \"--help\" option to view the list of available options\n";
+        return 2;
+    }
+    if (options.count("help"))
+    {
+        std::cout << desc << '\n' << scenarioHelp;
+        return 1;
+    }
+    if (storageName != "local" && storageName != "memory")
+    {
+        std::cerr << "Unknown storage " << storageName << "\nUse \"--help\" option to view the list of available options\n";
+        return 2;
+    }
+
+    Scenario scenario;
+    try
+    {
+        scenario = loadScenario(scenarioName);
+    } catch (const std::exception& error)
+    {
+        std::cerr << "Invalid scenario: " << error.what() << '\n';
+        return 2;
+    }
+    if (options.count("clients"))
+        scenario.m_clients = options["clients"].as<std::size_t>();
+    if (options.count("duration"))
+        scenario.m_durationSeconds = options["duration"].as<unsigned>();
+    if (options.count("server-threads"))
+        scenario.m_serverThreads = std::max(1u, options["server-threads"].as<unsigned>());
+    if (options.count("client-threads"))
+        scenario.m_clientThreads = std::max(1u, options["client-threads"].as<unsigned>());
+
+    // Сессия с передачей держит на двух сторонах до шести дескрипторов: управляющее соединение, сокет PASV,
+    // соединение данных и открытый сервером файл
+    auto descriptorLimit = raiseDescriptorLimit();
+    auto requiredDescriptors = 6 * scenario.m_clients + 256;
+    if (requiredDescriptors > descriptorLimit)
+    {
+        std::cerr << scenario.m_clients << " clients need about " << requiredDescriptors
+                  << " descriptors, the limit is " << descriptorLimit << '\n';
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::shared_ptr<ftp::MemoryStorage> memoryStorage;
+    if (storageName == "memory")
+    {
+        // Корень существует только в хранилище, на диске ничего не создается
+        if (root.empty())
+            root = "/ftp_loadgen";
+        root = std::filesystem::absolute(root);
+        memoryStorage = std::make_shared<ftp::MemoryStorage>(root);
+        generateTree(*memoryStorage, scenario);
+    }
+    bool isTemporaryRoot = root.empty();
+    if (!memoryStorage)
+    {
+        try
+        {
+            if (isTemporaryRoot)
+            {
+                std::string rootTemplate = (std::filesystem::temp_directory_path()/"ftp_loadgen.XXXXXX").string();
+                check(mkdtemp(rootTemplate.data()) != nullptr, "mkdtemp");
+                root = rootTemplate;
+            }
+            else
+                std::filesystem::create_directories(root);
+            root = std::filesystem::absolute(root);
+            generateTree(root, scenario);
+        } catch (const std::exception& error)
+        {
+            std::cerr << "Cannot generate files: " << error.what() << '\n';
+            return 2;
+        }
+    }
+
+    int status = 0;
+    try
+    {
+        LoadGenerator generator(scenario, root, memoryStorage);
+        generator.run();
+        generator.report(std::cout);
+        if (options.count("strict") && generator.isFailed())
+            status = 1;
+    } catch (const std::exception& error)
+    {
+        std::cerr << "Load generation failed: " << error.what() << '\n';
+        status = 2;
+    }
+    if (isTemporaryRoot)
+    {
+        std::error_code ignored;
+        std::filesystem::remove_all(root, ignored);
+    }
+    return status;
+}
@@ -0,0 +1,54 @@
+#ifndef FTP_SERVER_POLL_ADMISSIONCONTROL_H
+#define FTP_SERVER_POLL_ADMISSIONCONTROL_H
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <netinet/in.h>
+
+namespace ftp {
+
+// Ограничение количества одновременных сессий: общее для сервера и для каждого адреса клиента.
+// Решение принимается сразу после accept(), до создания соединения,
+// поэтому при перегрузке отказ новым клиентам не замедляет уже принятые сессии
+class AdmissionControl
+{
+public:
+    enum class Verdict
+    {
+        Admitted,
+        TooManySessions, // Достигнуто общее ограничение сервера
+        TooManySessionsFromAddress // Достигнуто ограничение для адреса клиента
+    };
+
+    // 0 - без ограничения
+    AdmissionControl(std::size_t maxSessions, std::size_t maxSessionsPerAddress)
+    : m_maxSessions(maxSessions), m_maxSessionsPerAddress(maxSessionsPerAddress) {}
+
+    // Учитывает новую сессию от клиента с адресом peer, если ограничения это позволяют.
+    // Для каждой допущенной сессии по ее завершении должен быть вызван release()
+    Verdict admit(in_addr_t peer);
+
+    void release(in_addr_t peer);
+
+    std::size_t sessionCount() const
+    {
+        return m_sessionCount.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t rejected() const
+    {
+        return m_rejected.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::size_t m_maxSessions, m_maxSessionsPerAddress;
+    std::mutex m_sessionsMutex;
+    std::unordered_map<in_addr_t, std::size_t> m_sessionsPerAddress;
+    std::atomic_size_t m_sessionCount = 0;
+    std::atomic_uint64_t m_rejected = 0;
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_ADMISSIONCONTROL_H
@@ -0,0 +1,125 @@
+#ifndef FTP_SERVER_POLL_AUDITLOG_H
+#define FTP_SERVER_POLL_AUDITLOG_H
+
+#include <netinet/in.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace ftp {
+
+// Журнал команд и передач для учета и разбора инцидентов.
+// Каждый поток пишет записи в собственное кольцо без блокировок и системных вызовов;
+// фоновый поток периодически забирает записи из всех колец и дописывает их в файлы пачками.
+// Если кольцо потока заполнено, запись отбрасывается и учитывается в dropped(), а не ждет писателя
+class AuditLog
+{
+public:
+    struct Record
+    {
+        enum class Kind : std::uint8_t
+        {
+            Command, // Команда выполнена; код - первый ответ на нее
+            Transfer // Передача данных окончена; код - итоговый ответ
+        };
+
+        static constexpr std::size_t maxArgumentLength = 255;
+
+        std::chrono::system_clock::time_point m_time;
+        std::chrono::microseconds m_duration{};
+        std::uint64_t m_bytes = 0;
+        in_addr_t m_peer = 0;
+        std::uint16_t m_code = 0;
+        Kind m_kind = Kind::Command;
+        bool m_isAuthenticated = false;
+        char m_transferType = 'a'; // 'a' - ASCII, 'b' - двоичный, как в xferlog
+        char m_verb[4] = {};
+        std::uint8_t m_argumentLength = 0;
+        char m_argument[maxArgumentLength];
+
+        // Запоминает команду; аргумент, не помещающийся в запись, обрезается
+        void setCommand(std::string_view verb, std::string_view argument);
+
+        std::string_view verb() const
+        {
+            return {m_verb, strnlen(m_verb, sizeof m_verb)};
+        }
+
+        std::string_view argument() const
+        {
+            return {m_argument, m_argumentLength};
+        }
+    };
+
+    // Пустой путь отключает соответствующий журнал.
+    // Если файл не удается открыть, выбрасывается std::system_error
+    AuditLog(const std::filesystem::path& transferLogPath, const std::filesystem::path& accessLogPath,
+             std::chrono::milliseconds flushInterval = std::chrono::milliseconds(200));
+
+    AuditLog(const AuditLog&) = delete;
+    AuditLog& operator=(const AuditLog&) = delete;
+
+    // Дописывает оставшиеся записи и закрывает файлы
+    ~AuditLog();
+
+    // Передачи файлов (RETR, STOR) попадают в журнал передач в формате xferlog,
+    // команды и окончания всех передач - в журнал доступа
+    void append(const Record& record);
+
+    // Записи, отброшенные из-за заполненных колец
+    std::uint64_t dropped() const;
+
+    // Записи, переданные в файлы
+    std::uint64_t written() const
+    {
+        return m_written.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr std::size_t ringCapacity = 1024;
+
+    // Кольцо записей одного потока: пишет только этот поток, читает только писатель журнала
+    struct Ring
+    {
+        alignas(64) std::atomic_uint64_t m_tail = 0;
+        std::atomic_uint64_t m_dropped = 0;
+        alignas(64) std::atomic_uint64_t m_head = 0;
+        std::atomic_bool m_isOrphaned = false; // Поток-владелец завершился
+        std::array<Record, ringCapacity> m_records;
+    };
+    struct LocalRing;
+
+    Ring& localRing();
+
+    void format(const Record& record);
+
+    // Забирает записи из всех колец и дописывает их в файлы; выполняется только в потоке писателя
+    void drain();
+
+    void run();
+
+    const std::uint64_t m_generation; // Отличает кольца этого журнала в кэше потока от колец уже уничтоженных
+    int m_transferLogFd = -1, m_accessLogFd = -1;
+    std::chrono::milliseconds m_flushInterval;
+    mutable std::mutex m_ringsMutex;
+    std::vector<std::shared_ptr<Ring>> m_rings;
+    std::atomic_uint64_t m_retiredDropped = 0, m_written = 0;
+    std::string m_transferBatch, m_accessBatch;
+    std::mutex m_writerMutex;
+    std::condition_variable m_writerCondition;
+    bool m_isStopping = false;
+    std::thread m_writer;
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_AUDITLOG_H
@@ -0,0 +1,81 @@
+#ifndef FTP_SERVER_POLL_BANDWIDTHLIMITER_H
+#define FTP_SERVER_POLL_BANDWIDTHLIMITER_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace ftp {
+
+// Корзина токенов для одного ограничения скорости.
+// Списание может увести баланс в минус: данные уже переданы, а следующая порция
+// откладывается на время, за которое долг будет восполнен.
+// Не синхронизирована - владелец корзины отвечает за последовательный доступ
+class TokenBucket
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Списывает bytes при скорости bytesPerSecond (0 - без ограничения)
+    // и возвращает задержку перед передачей следующих данных
+    std::chrono::nanoseconds consume(std::size_t bytes, std::uint64_t bytesPerSecond, Clock::time_point now);
+
+private:
+    // Наименьший запас, который корзина может накопить за время простоя
+    static constexpr double minBurst = 16 * 1024;
+
+    double m_tokens = 0;
+    Clock::time_point m_lastRefill{}; // Изначально корзина полна
+};
+
+// Ограничения скорости передачи данных: общее для сервера, для классов пользователей
+// и для каждой сессии. Все ограничения можно менять во время работы сервера:
+// новые значения применяются к следующей порции данных уже идущих передач
+class BandwidthLimiter
+{
+public:
+    // Класс пользователей со своим общим ограничением
+    class UserClass
+    {
+        friend class BandwidthLimiter;
+
+        std::atomic_uint64_t m_bytesPerSecond = 0;
+        TokenBucket m_bucket;
+    };
+
+    // Возвращает класс с именем name, создавая его без ограничения, если его еще нет.
+    // Классы не удаляются, поэтому указатель остается действительным все время жизни ограничителя
+    UserClass* userClass(std::string_view name);
+
+    void setGlobalLimit(std::uint64_t bytesPerSecond);
+    void setSessionLimit(std::uint64_t bytesPerSecond);
+    void setClassLimit(std::string_view name, std::uint64_t bytesPerSecond);
+
+    // Задано ли хотя бы одно ограничение
+    bool isLimited() const
+    {
+        return m_limitCount.load(std::memory_order_relaxed) > 0;
+    }
+
+    // Списывает bytes с корзины сессии, ее класса и общей корзины
+    // и возвращает наибольшую из задержек перед передачей следующих данных
+    std::chrono::nanoseconds consume(TokenBucket& session, UserClass* userClass, std::size_t bytes);
+
+private:
+    void updateLimit(std::atomic_uint64_t& limit, std::uint64_t bytesPerSecond);
+
+    std::atomic_uint64_t m_globalBytesPerSecond = 0, m_sessionBytesPerSecond = 0;
+    std::atomic_int m_limitCount = 0; // Количество ненулевых ограничений
+    std::mutex m_bucketMutex; // Защищает общую корзину и корзины классов
+    TokenBucket m_globalBucket;
+    std::mutex m_classMutex;
+    std::unordered_map<std::string, std::unique_ptr<UserClass>> m_classes;
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_BANDWIDTHLIMITER_H
@@ -0,0 +1,146 @@
+#ifndef FTP_SERVER_POLL_BOUNDEDBUFFER_H
+#define FTP_SERVER_POLL_BOUNDEDBUFFER_H
+
+#include <array>
+#include <memory>
+#include <string_view>
+#include <cstring>
+#include <algorithm>
+
+namespace ftp::details {
+
+// Буфер байт для PollMessageEngine::async_read_until, который хранит до InlineCapacity байт в самом объекте
+// и только при переполнении переносит содержимое в кучу, в блок емкостью MaxSize.
+// Как и у FixedBuffer, max_size() ограничивает рост: при заполнении операция чтения завершается с -ENOMEM.
+// Когда содержимое снова помещается в объект, блок в куче освобождается, поэтому длинные строки
+// не увеличивают память, которую буфер занимает все остальное время.
+// Адрес данных меняется только в push_back, erase и clear, то есть не во время ожидающего чтения
+template<std::size_t InlineCapacity, std::size_t MaxSize>
+class BoundedBuffer
+{
+    static_assert(InlineCapacity < MaxSize);
+
+public:
+    static constexpr std::size_t npos = std::string_view::npos;
+
+    BoundedBuffer() = default;
+    BoundedBuffer(const BoundedBuffer&) = delete;
+    BoundedBuffer& operator=(const BoundedBuffer&) = delete;
+
+    char* data()
+    {
+        return m_heap ? m_heap.get() : m_inline.data();
+    }
+
+    const char* data() const
+    {
+        return m_heap ? m_heap.get() : m_inline.data();
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    std::size_t capacity() const
+    {
+        return m_heap ? MaxSize : InlineCapacity;
+    }
+
+    static constexpr std::size_t max_size()
+    {
+        return MaxSize;
+    }
+
+    // Новые байты не инициализируются: они сразу заполняются чтением из сокета
+    void resize(std::size_t size)
+    {
+        m_size = std::min(size, capacity());
+    }
+
+    void clear()
+    {
+        m_size = 0;
+        m_heap.reset();
+    }
+
+    char* begin()
+    {
+        return data();
+    }
+
+    char* end()
+    {
+        return data() + m_size;
+    }
+
+    const char* begin() const
+    {
+        return data();
+    }
+
+    const char* end() const
+    {
+        return data() + m_size;
+    }
+
+    char back() const
+    {
+        return data()[m_size - 1];
+    }
+
+    // Движок вызывает push_back, когда буфер заполнен до capacity(), чтобы увеличить емкость
+    void push_back(char c)
+    {
+        if (m_size == MaxSize)
+            return;
+        if (m_size == InlineCapacity && !m_heap)
+        {
+            m_heap = std::make_unique_for_overwrite<char[]>(MaxSize);
+            std::memcpy(m_heap.get(), m_inline.data(), m_size);
+        }
+        data()[m_size++] = c;
+    }
+
+    void pop_back()
+    {
+        --m_size;
+    }
+
+    std::string_view view() const
+    {
+        return {data(), m_size};
+    }
+
+    std::size_t find(std::string_view pattern, std::size_t pos = 0) const
+    {
+        return view().find(pattern, pos);
+    }
+
+    void erase(std::size_t pos, std::size_t len)
+    {
+        pos = std::min(pos, m_size);
+        len = std::min(len, m_size - pos);
+        std::memmove(data() + pos, data() + pos + len, m_size - pos - len);
+        m_size -= len;
+        if (m_heap && m_size <= InlineCapacity)
+        {
+            std::memcpy(m_inline.data(), m_heap.get(), m_size);
+            m_heap.reset();
+        }
+    }
+
+private:
+    std::size_t m_size = 0;
+    std::unique_ptr<char[]> m_heap;
+    std::array<char, InlineCapacity> m_inline;
+};
+
+} //namespace ftp::details
+
+#endif //FTP_SERVER_POLL_BOUNDEDBUFFER_H
@@ -0,0 +1,112 @@
+#ifndef FTP_SERVER_POLL_BUFFERPOOL_H
+#define FTP_SERVER_POLL_BUFFERPOOL_H
+
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace ftp::details {
+
+// Набор блоков памяти для буферов передачи данных, свой у каждого потока.
+// Новый блок заполняется потоком, который его выделил, поэтому при политике first-touch
+// его страницы размещаются на узле NUMA этого потока; после освобождения блок
+// возвращается в набор текущего потока и переиспользуется без обращения к куче.
+// Запросы больше blockSize обслуживаются обычным operator new
+class BufferPool
+{
+public:
+    static constexpr std::size_t blockSize = 16 * 1024;
+    static constexpr std::size_t maxFreeBlocks = 64;
+
+    // Набор блоков вызывающего потока
+    static BufferPool& local()
+    {
+        thread_local BufferPool pool;
+        return pool;
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    ~BufferPool()
+    {
+        for (void* block: m_freeBlocks)
+            ::operator delete(block);
+    }
+
+    void* allocate(std::size_t size)
+    {
+        if (size > blockSize)
+            return ::operator new(size);
+        if (!m_freeBlocks.empty())
+        {
+            void* block = m_freeBlocks.back();
+            m_freeBlocks.pop_back();
+            return block;
+        }
+        void* block = ::operator new(blockSize);
+        std::memset(block, 0, blockSize);
+        return block;
+    }
+
+    void deallocate(void* pointer, std::size_t size)
+    {
+        if (size > blockSize || m_freeBlocks.size() >= maxFreeBlocks)
+            ::operator delete(pointer);
+        else
+            m_freeBlocks.push_back(pointer);
+    }
+
+    // Заранее выделяет и заполняет count блоков в текущем потоке
+    void reserve(std::size_t count)
+    {
+        std::vector<void*> blocks;
+        for (std::size_t i = 0; i < std::min(count, maxFreeBlocks); ++i)
+            blocks.push_back(allocate(blockSize));
+        for (void* block: blocks)
+            deallocate(block, blockSize);
+    }
+
+private:
+    BufferPool()
+    {
+        m_freeBlocks.reserve(maxFreeBlocks);
+    }
+
+    std::vector<void*> m_freeBlocks;
+};
+
+// Аллокатор, берущий память из BufferPool потока, в котором он вызван
+template<typename T>
+struct BufferPoolAllocator
+{
+    using value_type = T;
+
+    BufferPoolAllocator() = default;
+
+    template<typename U>
+    BufferPoolAllocator(const BufferPoolAllocator<U>&) {}
+
+    T* allocate(std::size_t count)
+    {
+        return static_cast<T*>(BufferPool::local().allocate(count * sizeof(T)));
+    }
+
+    void deallocate(T* pointer, std::size_t count)
+    {
+        BufferPool::local().deallocate(pointer, count * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const BufferPoolAllocator<U>&) const
+    {
+        return true;
+    }
+};
+
+using PooledString = std::basic_string<char, std::char_traits<char>, BufferPoolAllocator<char>>;
+
+} //namespace ftp::details
+
+#endif //FTP_SERVER_POLL_BUFFERPOOL_H
@@ -0,0 +1,28 @@
+#ifndef FTP_SERVER_POLL_CPUAFFINITY_H
+#define FTP_SERVER_POLL_CPUAFFINITY_H
+
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace ftp::details {
+
+// Разбирает список процессоров вида "0-3,8,10-11".
+// Возвращает std::nullopt, если строка записана с ошибкой
+std::optional<std::vector<int>> parseCpuList(std::string_view list);
+
+// Доступен ли процессор cpu текущему процессу
+bool isCpuAvailable(int cpu);
+
+// Разрешает текущему потоку выполняться только на процессорах cpus.
+// Пустой список оставляет привязку без изменений
+bool pinCurrentThread(std::span<const int> cpus);
+
+// Процессор, который обрабатывал входящие пакеты соединения (SO_INCOMING_CPU),
+// либо -1, если ядро его не сообщает
+int incomingCpu(int fd);
+
+} //namespace ftp::details
+
+#endif //FTP_SERVER_POLL_CPUAFFINITY_H
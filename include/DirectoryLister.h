@@ -0,0 +1,70 @@
+#ifndef FTP_SERVER_POLL_DIRECTORYLISTER_H
+#define FTP_SERVER_POLL_DIRECTORYLISTER_H
+
+#include <Storage.h>
+#include <span>
+#include <cstddef>
+#include <climits>
+
+namespace ftp::details {
+
+enum class ListingFormat
+{
+    LongList,   // Формат "ls -l" для LIST
+    Machine     // Машиночитаемый формат RFC 3659 для MLSD
+};
+
+// Записывает в out набор фактов RFC 3659 ("type=file;size=...;modify=...;perm=...;unique=...; ")
+// для элемента с атрибутами st, включая завершающий пробел перед именем.
+// Возвращает длину записанной строки либо 0, если она не поместилась
+std::size_t formatMachineFacts(const struct statx& st, std::span<char> out);
+
+// Записывает в out время модификации в формате RFC 3659 (YYYYMMDDHHMMSS, UTC).
+// Возвращает длину записанной строки либо 0, если она не поместилась
+std::size_t formatMachineTime(const struct statx_timestamp& time, std::span<char> out);
+
+// Генератор листинга каталога в форматах LIST и MLSD, работающий внутри процесса.
+// Элементы вместе с атрибутами берутся у хранилища по одному,
+// а строки форматируются сразу в буфер вызывающей стороны.
+// Сам генератор на каждый элемент каталога не производит ни одной аллокации, поэтому
+// листинг можно отдавать в сокет по мере формирования.
+class DirectoryLister
+{
+public:
+    // Максимальная длина одной строки листинга:
+    // атрибуты, имя файла и цель символической ссылки
+    static constexpr std::size_t maxLineLength = 128 + 2 * NAME_MAX;
+
+    // entries - каталог, открытый через Storage::list
+    explicit DirectoryLister(
+            std::unique_ptr<Storage::DirectoryReader> entries, ListingFormat format = ListingFormat::LongList);
+
+    DirectoryLister(const DirectoryLister&) = delete;
+    DirectoryLister& operator=(const DirectoryLister&) = delete;
+
+    // Записывает в out столько целых строк листинга, сколько в него помещается.
+    // Возвращает количество записанных байт, 0, если листинг закончился,
+    // и -1 при ошибке чтения каталога (код ошибки в errno).
+    // Размер out должен быть не меньше maxLineLength
+    int read(std::span<char> out);
+
+private:
+    // Подготавливает в m_line строку для очередного элемента каталога.
+    // Возвращает false, если элементы закончились или произошла ошибка
+    bool formatNextEntry();
+
+    // Форматирует строку листинга для элемента entry в m_line
+    void formatLongListEntry(const Storage::DirectoryReader::Entry& entry);
+    void formatMachineEntry(const Storage::DirectoryReader::Entry& entry);
+
+    std::unique_ptr<Storage::DirectoryReader> m_entries;
+    ListingFormat m_format;
+    bool m_isFinished = false;
+    // Строка, которая уже сформирована, но еще не поместилась в выходной буфер
+    std::size_t m_lineLen = 0;
+    char m_line[maxLineLength];
+};
+
+} //namespace ftp::details
+
+#endif //FTP_SERVER_POLL_DIRECTORYLISTER_H
@@ -0,0 +1,55 @@
+#ifndef FTP_SERVER_POLL_ENGINESTATISTICS_H
+#define FTP_SERVER_POLL_ENGINESTATISTICS_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+namespace messaging {
+
+// Гистограмма с ячейками по степеням двойки: ячейка 0 - значение 0, ячейка i - значения [2^(i-1), 2^i).
+// Последняя ячейка принимает и все большие значения
+struct HistogramSnapshot
+{
+    static constexpr std::size_t bucketCount = 28;
+
+    std::array<std::uint64_t, bucketCount> m_buckets{};
+    std::uint64_t m_count = 0, m_sum = 0;
+
+    // Верхняя граница ячейки, в которую попадает доля quantile всех значений
+    std::uint64_t quantile(double quantile) const;
+};
+
+// Гистограмма, в которую пишут несколько потоков
+class AtomicHistogram
+{
+public:
+    void record(std::uint64_t value);
+
+    HistogramSnapshot snapshot() const;
+
+    void reset();
+
+private:
+    std::array<std::atomic_uint64_t, HistogramSnapshot::bucketCount> m_buckets{};
+    std::atomic_uint64_t m_count = 0, m_sum = 0;
+};
+
+// Снимок гистограмм работы движка. Времена - в микросекундах
+struct EngineStatistics
+{
+    HistogramSnapshot m_pollWait; // Ожидание в poll() до появления готовых дескрипторов или таймеров
+    HistogramSnapshot m_fdsRebuild; // Сборка m_fds перед poll() за один цикл ожидания
+    HistogramSnapshot m_readyDispatch; // Сопоставление готовых дескрипторов с ожидающими операциями
+    HistogramSnapshot m_readyCount; // Количество коллбеков, ставших готовыми за один цикл ожидания
+    HistogramSnapshot m_dispatchLag; // От обнаружения готовности до начала выполнения коллбека
+    HistogramSnapshot m_callbackDuration; // Выполнение коллбека
+
+    // Выводит количество, среднее и квантили каждой гистограммы
+    void dump(std::ostream& out) const;
+};
+
+} //namespace messaging
+
+#endif //FTP_SERVER_POLL_ENGINESTATISTICS_H
@@ -2,59 +2,362 @@
 #define FTP_SERVER_POLL_FTPSERVER_H
 
 #include <boost/asio/thread_pool.hpp>
+#include <thread>
 #include <boost/intrusive/list.hpp>
 #include <FtpConnection.h>
+#include <SlabPool.h>
+#include <CpuAffinity.h>
+#include <BufferPool.h>
+#include <AdmissionControl.h>
+#include <MetricsEndpoint.h>
+#include <LocalStorage.h>
 
 namespace ftp {
 
+struct ServerOptions
+{
+    // Хранилище файлов; nullptr - локальная файловая система.
+    // Для хранилища в памяти кэши содержимого и листингов не создаются
+    std::shared_ptr<Storage> m_storage;
+    // Суммарный объем кэша содержимого файлов; 0 отключает кэш
+    std::size_t m_fileCacheSize = 64 * 1024 * 1024;
+    // Наибольший размер файла, который попадает в кэш
+    std::size_t m_fileCacheMaxFileSize = 1024 * 1024;
+    // Потоки, в которых выполняется копирование SITE COPY, чтобы оно не занимало рабочие потоки
+    std::size_t m_copyThreads = 2;
+    // Диапазон портов общего набора сокетов пассивного режима;
+    // 0 - каждое соединение открывает для PASV собственный сокет на случайном порту
+    std::uint16_t m_passivePortMin = 0, m_passivePortMax = 0;
+    // Процессоры потока ожидания событий; пустой список - без привязки
+    std::vector<int> m_reactorCpus;
+    // Процессоры рабочих потоков: поток i привязывается к m_workerCpus[i % size]; пустой список - без привязки
+    std::vector<int> m_workerCpus;
+    // Передавать новое соединение рабочему потоку на процессоре, который принимает его пакеты (SO_INCOMING_CPU)
+    bool m_steerByIncomingCpu = false;
+    // Сколько блоков для буферов передачи каждый рабочий поток выделяет при запуске
+    std::size_t m_bufferBlocksPerWorker = 16;
+    // Ограничения скорости передачи данных в байтах в секунду; 0 - без ограничения
+    std::uint64_t m_globalRateLimit = 0, m_sessionRateLimit = 0;
+    std::vector<std::pair<std::string, std::uint64_t>> m_classRateLimits; // Класс пользователей -> ограничение
+    // Наибольшее количество одновременных сессий: всего и с одного адреса; 0 - без ограничения
+    std::size_t m_maxSessions = 0, m_maxSessionsPerAddress = 0;
+    SessionTimeouts m_timeouts;
+    // Порт на 127.0.0.1 для сбора метрик в формате Prometheus; 0 - метрики не отдаются
+    std::uint16_t m_metricsPort = 0;
+    // Собирать гистограммы движка событий: ожидание в poll, задержку и длительность коллбеков
+    bool m_engineStatistics = false;
+    // Журнал передач файлов в формате xferlog и журнал команд; пустой путь - журнал не ведется
+    std::filesystem::path m_transferLogPath, m_accessLogPath;
+};
+
 class Server
 {
 public:
-    //Сокет, передаваемый в конструктор сервера, должен быть доведен до готовности принимать соединения
-    explicit Server(int socketFd, const std::filesystem::path& root, int threadCount = 1)
-    : m_socketFd(socketFd)
-    , m_threadCount(threadCount)
-    , m_root(root)
-    , m_threadPool(threadCount)
-    , m_messageEngine(std::make_shared<messaging::PollMessageEngine>()) {}
+    //Сокет, передаваемый в конструктор сервера, должен быть доведен до готовности принимать соединения.
+    //Если не удается открыть корневой каталог, ни одного порта из диапазона пассивного режима, порт метрик или файл журнала
+    //либо указан недоступный процессор, выбрасывается std::system_error
+    explicit Server(int socketFd, const std::filesystem::path& root, int threadCount = 1, const ServerOptions& options = {})
+    : m_options(checkCpus(options))
+    , m_workers(makeWorkers(std::max(threadCount, 1), m_options))
+    , m_copyPool(std::make_shared<boost::asio::thread_pool>(std::max<std::size_t>(options.m_copyThreads, 1)))
+    , m_messageEngine(std::make_shared<messaging::PollMessageEngine>())
+    , m_storage(options.m_storage ? options.m_storage : std::make_shared<LocalStorage>(root))
+    , m_fsWatcher(m_storage->isMemoryResident() ? nullptr : makeFsWatcher(m_messageEngine))
+    , m_listingCache(m_fsWatcher ? std::make_shared<ListingCache>(m_fsWatcher) : nullptr)
+    , m_fileCache(
+            m_fsWatcher && options.m_fileCacheSize > 0
+            ? std::make_shared<FileCache>(
+                    m_fsWatcher, options.m_fileCacheSize, options.m_fileCacheMaxFileSize)
+            : nullptr)
+    , m_passivePortPool(makePassivePortPool(m_messageEngine, socketFd, options))
+    , m_bandwidthLimiter(makeBandwidthLimiter(options))
+    , m_admissionControl(std::make_shared<AdmissionControl>(options.m_maxSessions, options.m_maxSessionsPerAddress))
+    , m_timingWheel(std::make_shared<details::TimingWheel>(timingWheelResolution))
+    , m_auditLog(
+            options.m_transferLogPath.empty() && options.m_accessLogPath.empty()
+            ? nullptr
+            : std::make_shared<AuditLog>(options.m_transferLogPath, options.m_accessLogPath))
+    , m_connectionContext{
+            m_messageEngine,
+            root,
+            m_storage,
+            m_copyPool,
+            m_listingCache,
+            m_fileCache,
+            m_passivePortPool,
+            m_bandwidthLimiter,
+            m_timingWheel,
+            options.m_timeouts,
+            m_auditLog,
+            [this](Connection &connection)
+            {
+                m_admissionControl->release(connection.peer());
+                metrics::ThreadMetrics::local().add(metrics::Counter::SessionsClosed);
+                auto connectionsLock = std::lock_guard(m_connectionListMutex);
+                m_connectionList.erase_and_dispose(
+                        m_connectionList.iterator_to(connection),
+                        [this](Connection *connection) { m_connectionPool.destroy(connection); });
+            }}
+    , m_metricsEndpoint(
+            options.m_metricsPort == 0
+            ? nullptr
+            : std::make_unique<MetricsEndpoint>(
+                    m_messageEngine,
+                    options.m_metricsPort,
+                    [this](std::string &out) { renderMetrics(out); },
+                    [](std::string &out) { tracing::exportChromeTrace(out); }))
+    , m_socketFd(socketFd)
+    {
+        m_messageEngine->enableStatistics(options.m_engineStatistics);
+    }
 
     void start()
     {
         auto aliveCriteria = m_isAlive;
-        m_isUp.store(true);
         m_messageEngine->release();
         // Сервер рекурсивно получает и обрабатывает новые соединения
         handleNewConnections();
-        // И забрасывает в пул новые коллбеки для обработки
-        m_threadPool.executor().post(
+        advanceTimingWheel();
+        // Ожиданием событий занимается отдельный поток, а готовые коллбеки выполняются в пуле.
+        // Поэтому сервер работает при любом размере пула, включая один поток
+        m_reactorThread = std::thread(
                 [this, aliveCriteria]()
                 {
+                    details::pinCurrentThread(m_options.m_reactorCpus);
+                    tracing::setThreadName("reactor");
+                    std::size_t nextWorker = 0;
                     while(aliveCriteria->load())
                     {
-                        m_threadPool.executor().post(m_messageEngine->waitForEvent(), std::allocator<void>());
+                        auto waitTraceStart = tracing::start();
+                        auto callback = m_messageEngine->waitForEvent();
+                        tracing::complete("wait for event", waitTraceStart);
+                        m_workers[nextWorker++ % m_workers.size()]->executor().post(std::move(callback), std::allocator<void>());
                     }
-                }, std::allocator<void>());
+                });
+    }
+
+    // Кэши могут отсутствовать, если они отключены или недоступен inotify
+    std::shared_ptr<const ListingCache> listingCache() const
+    {
+        return m_listingCache;
+    }
+
+    std::shared_ptr<const FileCache> fileCache() const
+    {
+        return m_fileCache;
+    }
+
+    // Ограничения скорости можно менять во время работы сервера
+    std::shared_ptr<BandwidthLimiter> bandwidthLimiter() const
+    {
+        return m_bandwidthLimiter;
+    }
+
+    std::shared_ptr<const AdmissionControl> admissionControl() const
+    {
+        return m_admissionControl;
     }
 
+    // Сбор гистограмм движка можно включать и выключать во время работы сервера
+    void enableEngineStatistics(bool isEnabled)
+    {
+        m_messageEngine->enableStatistics(isEnabled);
+    }
+
+    bool isEngineStatisticsEnabled() const
+    {
+        return m_messageEngine->isStatisticsEnabled();
+    }
+
+    messaging::EngineStatistics engineStatistics() const
+    {
+        return m_messageEngine->statistics();
+    }
+
+    // Дописывает в out метрики сервера в текстовом формате Prometheus
+    void renderMetrics(std::string& out) const
+    {
+        metrics::render(out);
+        metrics::renderGauge(out, "ftp_sessions_active", "Control connections currently open", m_admissionControl->sessionCount());
+        metrics::renderCounter(out, "ftp_sessions_rejected_total", "Control connections rejected by session limits", m_admissionControl->rejected());
+        metrics::renderGauge(out, "ftp_engine_pending_operations", "Operations waiting for descriptor readiness", m_messageEngine->pendingOperations());
+        metrics::renderGauge(out, "ftp_engine_pending_timers", "Engine timers not yet expired", m_messageEngine->pendingTimers());
+        metrics::renderGauge(out, "ftp_engine_ready_callbacks", "Ready callbacks queued in the engine", m_messageEngine->readyCallbacks());
+        metrics::renderGauge(out, "ftp_session_timers", "Session deadlines scheduled in the timing wheel", m_timingWheel->size());
+        if (m_auditLog)
+        {
+            metrics::renderCounter(out, "ftp_audit_records_written_total", "Audit log records written to files", m_auditLog->written());
+            metrics::renderCounter(out, "ftp_audit_records_dropped_total", "Audit log records dropped on full per-thread rings", m_auditLog->dropped());
+        }
+        if (m_fileCache)
+        {
+            metrics::renderCounter(out, "ftp_file_cache_hits_total", "File cache hits", m_fileCache->hits());
+            metrics::renderCounter(out, "ftp_file_cache_misses_total", "File cache misses", m_fileCache->misses());
+        }
+        if (m_listingCache)
+        {
+            metrics::renderCounter(out, "ftp_listing_cache_hits_total", "Listing cache hits", m_listingCache->hits());
+            metrics::renderCounter(out, "ftp_listing_cache_misses_total", "Listing cache misses", m_listingCache->misses());
+        }
+    }
+
+    // Останавливает ожидание событий, дожидается завершения выполняющихся коллбеков
+    // и только после этого уничтожает соединения. Не должен вызываться из потоков сервера
     void stop()
     {
         m_isAlive->store(false);
-        m_threadPool.stop();
         m_messageEngine->interrupt();
-        m_connectionList.clear_and_dispose(std::default_delete<Connection>());
-        m_threadPool.join();
+        if (m_reactorThread.joinable())
+            m_reactorThread.join();
+        // Копирование прерывается между порциями; его ответы ставятся в strand соединений,
+        // поэтому пул копирования останавливается раньше рабочих потоков
+        m_copyPool->stop();
+        m_copyPool->join();
+        for (auto &worker: m_workers)
+            worker->stop();
+        for (auto &worker: m_workers)
+            worker->join();
+        auto connectionsLock = std::lock_guard(m_connectionListMutex);
+        m_connectionList.clear_and_dispose([this](Connection *connection) { m_connectionPool.destroy(connection); });
     }
 
     ~Server()
     {
-        m_isAlive->store(false);
-        m_threadPool.stop();
-        m_messageEngine->interrupt();
-        m_connectionList.clear_and_dispose(std::default_delete<Connection>());
+        stop();
         close(m_socketFd);
-        m_threadPool.join();
     }
 private:
+    static constexpr std::chrono::seconds timingWheelResolution{1};
+
+    static ServerOptions checkCpus(const ServerOptions& options)
+    {
+        for (const auto *cpus: {&options.m_reactorCpus, &options.m_workerCpus})
+        {
+            for (int cpu: *cpus)
+            {
+                if (!details::isCpuAvailable(cpu))
+                    throw std::system_error(EINVAL, std::system_category(), "CPU " + std::to_string(cpu) + " is not available");
+            }
+        }
+        return options;
+    }
+
+    // Каждый рабочий поток обслуживает свою часть соединений, поэтому их данные
+    // и буферы передачи остаются в памяти узла NUMA, на котором этот поток работает
+    static std::vector<std::unique_ptr<boost::asio::thread_pool>> makeWorkers(int threadCount, const ServerOptions& options)
+    {
+        std::vector<std::unique_ptr<boost::asio::thread_pool>> workers;
+        for (int i = 0; i < threadCount; ++i)
+        {
+            auto &worker = workers.emplace_back(std::make_unique<boost::asio::thread_pool>(1));
+            std::vector<int> cpus;
+            if (!options.m_workerCpus.empty())
+                cpus.push_back(options.m_workerCpus[i % options.m_workerCpus.size()]);
+            // Первая задача потока: привязка к процессору и выделение буферов уже на его узле
+            worker->executor().post(
+                    [cpus, blockCount = options.m_bufferBlocksPerWorker, i]()
+                    {
+                        details::pinCurrentThread(cpus);
+                        tracing::setThreadName("worker " + std::to_string(i));
+                        details::BufferPool::local().reserve(blockCount);
+                    }, std::allocator<void>());
+        }
+        return workers;
+    }
+
+    // Выбирает рабочий поток для нового соединения
+    std::size_t workerFor(int fd)
+    {
+        if (m_options.m_steerByIncomingCpu)
+        {
+            if (int cpu = details::incomingCpu(fd); cpu >= 0)
+            {
+                if (m_options.m_workerCpus.empty())
+                    return cpu % m_workers.size();
+                for (std::size_t i = 0; i < m_workers.size(); ++i)
+                {
+                    if (m_options.m_workerCpus[i % m_options.m_workerCpus.size()] == cpu)
+                        return i;
+                }
+            }
+        }
+        // Соединения принимаются последовательно, поэтому счетчик не требует синхронизации
+        return m_nextWorker++ % m_workers.size();
+    }
+
+    static std::shared_ptr<BandwidthLimiter> makeBandwidthLimiter(const ServerOptions& options)
+    {
+        auto limiter = std::make_shared<BandwidthLimiter>();
+        limiter->setGlobalLimit(options.m_globalRateLimit);
+        limiter->setSessionLimit(options.m_sessionRateLimit);
+        for (const auto &[userClass, bytesPerSecond]: options.m_classRateLimits)
+            limiter->setClassLimit(userClass, bytesPerSecond);
+        return limiter;
+    }
+
+    static std::shared_ptr<FsWatcher> makeFsWatcher(const std::shared_ptr<messaging::PollMessageEngine>& messageEngine)
+    {
+        // Без inotify кэши не узнают об изменениях на диске, поэтому сервер работает без них
+        try
+        {
+            return std::make_shared<FsWatcher>(messageEngine);
+        } catch (const std::system_error&)
+        {
+            return nullptr;
+        }
+    }
+
+    static std::shared_ptr<PassivePortPool> makePassivePortPool(
+            const std::shared_ptr<messaging::PollMessageEngine>& messageEngine, int socketFd, const ServerOptions& options)
+    {
+        if (options.m_passivePortMin == 0 || options.m_passivePortMax < options.m_passivePortMin)
+            return nullptr;
+        // Сокеты для передачи данных открываются на том же адресе, что и управляющий
+        sockaddr_in address{};
+        socklen_t addrLen = sizeof address;
+        getsockname(socketFd, reinterpret_cast<sockaddr*>(&address), &addrLen);
+        return std::make_shared<PassivePortPool>(
+                messageEngine, address.sin_addr, options.m_passivePortMin, options.m_passivePortMax);
+    }
+
+    // Проверяет ограничения на количество сессий. Клиенту, которому отказано,
+    // отправляется готовый ответ 421 одним неблокирующим вызовом, и сокет сразу закрывается:
+    // ожидать отправки ответа полностью ради клиента, которого сервер не может обслужить, незачем
+    bool admit(int fd, in_addr_t peer)
+    {
+        std::string_view rejection;
+        switch (m_admissionControl->admit(peer))
+        {
+            case AdmissionControl::Verdict::Admitted:
+                return true;
+            case AdmissionControl::Verdict::TooManySessions:
+                rejection = replies::tooManySessions;
+                break;
+            case AdmissionControl::Verdict::TooManySessionsFromAddress:
+                rejection = replies::tooManySessionsFromAddress;
+                break;
+        }
+        send(fd, rejection.data(), rejection.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+        return false;
+    }
+
+    // Сроки всех сессий проверяются по одному таймеру движка, продвигающему колесо таймеров
+    void advanceTimingWheel()
+    {
+        auto aliveCriteria = m_isAlive;
+        m_messageEngine->async_wait(
+                m_timingWheel->resolution(),
+                std::make_shared<messaging::CallbackType>(
+                        [this, aliveCriteria](int)
+                        {
+                            if (aliveCriteria->load())
+                            {
+                                m_timingWheel->advance(details::TimingWheel::Clock::now());
+                                advanceTimingWheel();
+                            }
+                        }));
+    }
 
     void handleNewConnections()
     {
@@ -68,38 +371,67 @@ private:
                             {
                                 if (res >= 0)
                                 {
+                                    tracing::Span acceptSpan("accept", res);
+                                    sockaddr_in peerAddress{};
+                                    socklen_t addrLen = sizeof(peerAddress);
+                                    getpeername(res, reinterpret_cast<sockaddr*>(&peerAddress), &addrLen);
+                                    if (!admit(res, peerAddress.sin_addr.s_addr))
+                                    {
+                                        handleNewConnections();
+                                        return;
+                                    }
+                                    metrics::ThreadMetrics::local().add(metrics::Counter::SessionsAccepted);
                                     // Accept() прошел успешно, создаем и запускаем новое соединение
-                                    auto *connection = new Connection(
+                                    // Соединение размещается в пуле сервера и получает ссылку на общее окружение
+                                    auto *connection = m_connectionPool.create(
                                             res,
-                                            m_messageEngine,
-                                            m_root,
-                                            [this, aliveCriteria](Connection &connection)
-                                            {
-                                                if(aliveCriteria->load())
-                                                {
-                                                    m_connectionList.erase_and_dispose(
-                                                            m_connectionList.iterator_to(connection)
-                                                            , std::default_delete<Connection>());
-                                                }
-                                            });
-                                    m_connectionList.push_back(*connection);
+                                            peerAddress.sin_addr.s_addr,
+                                            m_connectionContext,
+                                            m_workers[workerFor(res)]->executor());
+                                    {
+                                        auto connectionsLock = std::lock_guard(m_connectionListMutex);
+                                        m_connectionList.push_back(*connection);
+                                    }
                                     connection->start();
                                     handleNewConnections();
                                 }
                                 else
-                                    stop();
+                                {
+                                    // Новые соединения больше не принимаются; ресурсы освобождает stop()
+                                    m_isAlive->store(false);
+                                    m_messageEngine->interrupt();
+                                }
                             }
                         }));
     }
 
 private:
-    boost::asio::thread_pool m_threadPool;
+    ServerOptions m_options;
+    // Однопоточные пулы: соединение выполняется в strand поверх одного из них
+    std::vector<std::unique_ptr<boost::asio::thread_pool>> m_workers;
+    // Задачи копирования удерживают поведения соединений, поэтому пул уничтожается раньше рабочих потоков
+    std::shared_ptr<boost::asio::thread_pool> m_copyPool;
+    std::size_t m_nextWorker = 0;
+    std::thread m_reactorThread;
+    std::mutex m_connectionListMutex;
     boost::intrusive::list<Connection> m_connectionList;
-    std::filesystem::path m_root;
     std::shared_ptr<messaging::PollMessageEngine> m_messageEngine;
-    int m_socketFd, m_threadCount;
+    std::shared_ptr<Storage> m_storage;
+    std::shared_ptr<FsWatcher> m_fsWatcher;
+    std::shared_ptr<ListingCache> m_listingCache;
+    std::shared_ptr<FileCache> m_fileCache;
+    std::shared_ptr<PassivePortPool> m_passivePortPool;
+    std::shared_ptr<BandwidthLimiter> m_bandwidthLimiter;
+    std::shared_ptr<AdmissionControl> m_admissionControl;
+    // Таймеры колеса продлевают жизнь поведений уже закрытых соединений, вплоть до strand,
+    // поэтому колесо уничтожается раньше рабочих потоков
+    std::shared_ptr<details::TimingWheel> m_timingWheel;
+    std::shared_ptr<AuditLog> m_auditLog;
+    ConnectionContext m_connectionContext;
+    std::unique_ptr<MetricsEndpoint> m_metricsEndpoint;
+    details::SlabPool<Connection> m_connectionPool;
+    int m_socketFd;
 
-    std::atomic_bool m_isUp;
     std::shared_ptr<std::atomic_bool> m_isAlive = std::make_shared<std::atomic_bool>(true);
 };
 
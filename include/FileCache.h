@@ -0,0 +1,97 @@
+#ifndef FTP_SERVER_POLL_FILECACHE_H
+#define FTP_SERVER_POLL_FILECACHE_H
+
+#include <FsWatcher.h>
+#include <Storage.h>
+#include <list>
+#include <vector>
+
+namespace ftp {
+
+// Общий для сервера кэш содержимого небольших файлов.
+// Файлы хранятся сразу в двух видах: как есть (для TYPE I) и с концами строк,
+// замененными на \r\n (для TYPE A), так что повторная отдача файла
+// не требует ни одного системного вызова для работы с файлом.
+// Актуальность записей поддерживается только уведомлениями FsWatcher: при отдаче из кэша
+// файл не проверяется. Каждая запись держит наблюдение за каталогом файла и снимает его,
+// когда сбрасывается или вытесняется. Вытеснение - по LRU отдельно в каждом сегменте.
+class FileCache
+{
+public:
+    struct Content
+    {
+        std::string m_raw, m_ascii;
+    };
+    using ContentType = std::shared_ptr<const Content>;
+
+    // maxBytes - суммарный объем кэша (учитываются обе формы содержимого),
+    // maxFileSize - наибольший размер файла, который попадает в кэш
+    FileCache(
+            const std::shared_ptr<FsWatcher>& watcher,
+            std::size_t maxBytes,
+            std::size_t maxFileSize,
+            std::size_t shardCount = 16);
+
+    // Возвращает содержимое файла из кэша либо nullptr.
+    // Системных вызовов не выполняет
+    ContentType find(const std::filesystem::path& file);
+
+    // Читает через reader уже открытый файл file и сохраняет в кэш.
+    // Возвращает nullptr, если файл слишком велик или не может быть прочитан; reader при этом
+    // остается пригоден для отдачи файла, так что большой файл открывается один раз
+    ContentType load(const std::filesystem::path& file, Storage::Reader& reader);
+
+    std::uint64_t hits() const
+    {
+        return m_hits.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t misses() const
+    {
+        return m_misses.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Entry
+    {
+        std::string m_file;
+        ContentType m_content;
+        int m_watch; // Дескриптор наблюдения за каталогом файла
+    };
+
+    struct Shard
+    {
+        std::mutex m_mutex;
+        // Записи в порядке от недавно использованных к давно использованным
+        std::list<Entry> m_lru;
+        std::unordered_map<std::string, decltype(m_lru)::iterator> m_entries;
+        std::size_t m_bytes = 0;
+        // Меняется при каждом сбросе записей сегмента;
+        // файл, прочитанный в другом поколении, в кэш не попадает
+        std::uint64_t m_generation = 0;
+    };
+
+    Shard& shardFor(const std::string& file);
+
+    void invalidate(const std::filesystem::path& directory, std::string_view name);
+
+    // Удаляет запись из сегмента, запоминая ее наблюдение в releasedWatches
+    static void erase(Shard& shard, std::list<Entry>::iterator entryIterator, std::vector<int>& releasedWatches);
+
+    // Снимает наблюдения удаленных записей; вызывается без блокировки сегмента
+    void unwatch(const std::vector<int>& releasedWatches);
+
+    static std::size_t contentBytes(const Content& content)
+    {
+        return content.m_raw.size() + content.m_ascii.size();
+    }
+
+    std::shared_ptr<FsWatcher> m_watcher;
+    std::size_t m_maxShardBytes, m_maxFileSize;
+    std::vector<Shard> m_shards;
+    std::atomic_uint64_t m_hits = 0, m_misses = 0;
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_FILECACHE_H
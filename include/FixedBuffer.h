@@ -0,0 +1,124 @@
+#ifndef FTP_SERVER_POLL_FIXEDBUFFER_H
+#define FTP_SERVER_POLL_FIXEDBUFFER_H
+
+#include <array>
+#include <string_view>
+#include <cstring>
+#include <algorithm>
+
+namespace ftp::details {
+
+// Буфер байт фиксированной емкости с интерфейсом, достаточным для
+// PollMessageEngine::async_read_until: емкость совпадает с max_size(),
+// поэтому буфер никогда не перераспределяется, а при заполнении
+// операция чтения завершается с -ENOMEM.
+// Удаление из начала сдвигает оставшиеся байты, объем сдвига ограничен емкостью
+template<std::size_t Capacity>
+class FixedBuffer
+{
+public:
+    static constexpr std::size_t npos = std::string_view::npos;
+
+    char* data()
+    {
+        return m_data.data();
+    }
+
+    const char* data() const
+    {
+        return m_data.data();
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+    bool empty() const
+    {
+        return m_size == 0;
+    }
+
+    static constexpr std::size_t capacity()
+    {
+        return Capacity;
+    }
+
+    static constexpr std::size_t max_size()
+    {
+        return Capacity;
+    }
+
+    // Новые байты не инициализируются: они сразу заполняются чтением из сокета
+    void resize(std::size_t size)
+    {
+        m_size = std::min(size, Capacity);
+    }
+
+    void clear()
+    {
+        m_size = 0;
+    }
+
+    char* begin()
+    {
+        return m_data.data();
+    }
+
+    char* end()
+    {
+        return m_data.data() + m_size;
+    }
+
+    const char* begin() const
+    {
+        return m_data.data();
+    }
+
+    const char* end() const
+    {
+        return m_data.data() + m_size;
+    }
+
+    char back() const
+    {
+        return m_data[m_size - 1];
+    }
+
+    void push_back(char c)
+    {
+        if (m_size < Capacity)
+            m_data[m_size++] = c;
+    }
+
+    void pop_back()
+    {
+        --m_size;
+    }
+
+    std::string_view view() const
+    {
+        return {m_data.data(), m_size};
+    }
+
+    std::size_t find(std::string_view pattern, std::size_t pos = 0) const
+    {
+        return view().find(pattern, pos);
+    }
+
+    void erase(std::size_t pos, std::size_t len)
+    {
+        pos = std::min(pos, m_size);
+        len = std::min(len, m_size - pos);
+        std::memmove(m_data.data() + pos, m_data.data() + pos + len, m_size - pos - len);
+        m_size -= len;
+    }
+
+private:
+    std::size_t m_size = 0;
+    std::array<char, Capacity> m_data;
+};
+
+} //namespace ftp::details
+
+#endif //FTP_SERVER_POLL_FIXEDBUFFER_H
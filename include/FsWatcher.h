@@ -0,0 +1,75 @@
+#ifndef FTP_SERVER_POLL_FSWATCHER_H
+#define FTP_SERVER_POLL_FSWATCHER_H
+
+#include <PollMessageEngine.h>
+#include <filesystem>
+#include <string_view>
+#include <unordered_map>
+#include <array>
+#include <sys/inotify.h>
+
+namespace ftp {
+
+// Наблюдатель за изменениями в каталогах на основе inotify.
+// Дескриптор inotify регистрируется в PollMessageEngine, поэтому события
+// обрабатываются теми же потоками, что и обычные сетевые операции.
+// Кэши подписываются на уведомления и точечно сбрасывают устаревшие записи.
+class FsWatcher
+{
+public:
+    // Подписчик получает каталог, в котором произошло изменение, и имя измененного элемента.
+    // Пустое имя означает изменение самого каталога,
+    // пустой каталог - потерю событий (переполнение очереди inotify) либо удаление или перемещение
+    // вложенного каталога, после которых подписчик должен считать устаревшими все свои данные
+    using ListenerType = std::function<void(const std::filesystem::path&, std::string_view)>;
+
+    // При ошибке создания дескриптора inotify выбрасывает std::system_error
+    explicit FsWatcher(const std::shared_ptr<messaging::PollMessageEngine>& messageEngine);
+
+    FsWatcher(const FsWatcher&) = delete;
+    FsWatcher& operator=(const FsWatcher&) = delete;
+
+    ~FsWatcher();
+
+    // Подписчики добавляются до начала наблюдения за каталогами
+    void addListener(ListenerType listener);
+
+    // Начинает наблюдение за каталогом directory либо добавляет ссылку на уже ведущееся.
+    // Возвращает дескриптор наблюдения, который нужно передать в unwatch(), когда наблюдение
+    // станет не нужно, либо -1, если наблюдение установить не удалось
+    int watch(const std::filesystem::path& directory);
+
+    // Снимает ссылку на наблюдение; наблюдение без ссылок снимается и перестает занимать
+    // лимит max_user_watches. Наблюдение, уже снятое ядром, пропускается
+    void unwatch(int watchDescriptor);
+
+private:
+    // Запрашивает у PollMessageEngine чтение очередной порции событий
+    void readEvents();
+
+    void notify(const std::filesystem::path& directory, std::string_view name);
+
+    static constexpr std::uint32_t watchMask =
+            IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+            | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+    int m_inotifyFd;
+    std::shared_ptr<messaging::PollMessageEngine> m_messageEngine;
+    std::mutex m_watchMutex;
+    struct Watch
+    {
+        std::filesystem::path m_directory;
+        std::size_t m_references;
+    };
+
+    std::unordered_map<int, Watch> m_directories; // Дескриптор наблюдения -> каталог
+    std::unordered_map<std::string, int> m_watches; // Каталог -> дескриптор наблюдения
+    std::vector<ListenerType> m_listeners;
+    alignas(inotify_event) std::array<char, 4096> m_eventBuffer;
+
+    std::shared_ptr<std::atomic_bool> m_isAlive = std::make_shared<std::atomic_bool>(true);
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_FSWATCHER_H
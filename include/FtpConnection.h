@@ -4,16 +4,34 @@
 #include <PollMessageEngine.h>
 #include <string>
 #include <filesystem>
+#include <utility>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <boost/intrusive/list.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/post.hpp>
 #include <fcntl.h>
+#include <ListingCache.h>
+#include <FileCache.h>
+#include <Storage.h>
+#include <PassivePortPool.h>
+#include <RingBuffer.h>
+#include <BoundedBuffer.h>
+#include <BufferPool.h>
+#include <BandwidthLimiter.h>
+#include <TimingWheel.h>
+#include <Metrics.h>
+#include <AuditLog.h>
+#include <Tracing.h>
 
 namespace ftp {
 
 using namespace std::string_literals;
+using namespace std::string_view_literals;
 
-//Единственный валидный в данной реализации - ASCII, остальные перечислены, чтобы можно было распознавать команды
+//Валидные в данной реализации - ASCII и IMAGE, остальные перечислены, чтобы можно было распознавать команды
 enum class RepresentationType : char
 {
     A = 'A',    // ASCII
@@ -52,7 +70,83 @@ void setNonBlocking(int fd);
 
 }
 
-class Connection : public boost::intrusive::list_base_hook<>
+// Заранее сформированные ответы сервера вместе с завершающим \r\n
+namespace replies {
+
+inline constexpr std::string_view hello = "220 Hello!\r\n"sv;
+inline constexpr std::string_view loggedIn = "230 Log in successful\r\n"sv;
+inline constexpr std::string_view incorrectUser = "501 Incorrect user name\r\n"sv;
+inline constexpr std::string_view bye = "221 Bye!\r\n"sv;
+inline constexpr std::string_view notImplementedForValue = "504 Command not implemented for specified value\r\n"sv;
+inline constexpr std::string_view typeChanged = "200 Type changed\r\n"sv;
+inline constexpr std::string_view requestDenied = "534 Request denied\r\n"sv;
+inline constexpr std::string_view ok = "200 Ok\r\n"sv;
+inline constexpr std::string_view cannotOpenDataConnection = "425 Cannot open data connection\r\n"sv;
+inline constexpr std::string_view fileActionNotTaken = "450 File action not taken\r\n"sv;
+inline constexpr std::string_view actionNotTaken = "550 Requested action not taken\r\n"sv;
+inline constexpr std::string_view unknownCommand = "500 Unknown command\r\n"sv;
+inline constexpr std::string_view commandTooLong = "500 Command line too long\r\n"sv;
+inline constexpr std::string_view notLoggedIn = "530 Not logged in\r\n"sv;
+inline constexpr std::string_view invalidPath = "501 Invalid path\r\n"sv;
+inline constexpr std::string_view specifyUsername = "501 Please, specify a username\r\n"sv;
+inline constexpr std::string_view invalidArguments = "501 Invalid arguments\r\n"sv;
+inline constexpr std::string_view specifyMode = "501 Please, specify the mode\r\n"sv;
+inline constexpr std::string_view invalidMode = "501 Invalid mode\r\n"sv;
+inline constexpr std::string_view invalidStructure = "501 Invalid structure\r\n"sv;
+inline constexpr std::string_view specifyPath = "501 Please, specify the path\r\n"sv;
+inline constexpr std::string_view openingDataConnection = "150 Opening data connection\r\n"sv;
+inline constexpr std::string_view transferComplete = "250 Transfer complete\r\n"sv;
+inline constexpr std::string_view copyComplete = "250 Copy complete\r\n"sv;
+inline constexpr std::string_view transferAborted = "426 Transfer aborted due to connection close\r\n"sv;
+inline constexpr std::string_view transferTimedOut = "426 Transfer timed out, connection closed\r\n"sv;
+inline constexpr std::string_view dataConnectionTimedOut = "425 Data connection was not opened in time\r\n"sv;
+inline constexpr std::string_view idleTimeout = "421 Idle timeout, closing control connection\r\n"sv;
+inline constexpr std::string_view workingDirectory = "257 /\r\n"sv;
+inline constexpr std::string_view tooManySessions = "421 Too many sessions, try again later\r\n"sv;
+inline constexpr std::string_view tooManySessionsFromAddress = "421 Too many sessions from your address\r\n"sv;
+inline constexpr std::string_view features =
+        "211-Features:\r\n"
+        " MDTM\r\n"
+        " MLST type*;size*;modify*;perm*;unique*;\r\n"
+        " SIZE\r\n"
+        "211 End\r\n"sv;
+
+} //namespace replies
+
+class Connection;
+
+// Сроки, по истечении которых сервер закрывает зависшие сессии и передачи; нулевой срок отключает проверку
+struct SessionTimeouts
+{
+    // Управляющее соединение без команд и без передачи данных
+    std::chrono::seconds m_idle{300};
+    // Ожидание соединения для передачи данных после команды передачи
+    std::chrono::seconds m_dataConnection{30};
+    // Окно, за которое передача данных должна продвинуться не меньше чем на m_minTransferRate * окно
+    std::chrono::seconds m_transferWindow{60};
+    std::uint64_t m_minTransferRate = 0; // Байт в секунду; 0 - достаточно любого продвижения
+};
+
+// Общее для всех соединений сервера окружение.
+// Принадлежит серверу и переживает все его соединения, поэтому соединения хранят только ссылку на него
+struct ConnectionContext
+{
+    std::shared_ptr<messaging::PollMessageEngine> m_messageEngine; // Механизм для обмена сообщениями
+    std::filesystem::path m_root;
+    std::shared_ptr<Storage> m_storage; // Хранилище, из которого отдаются и в которое принимаются файлы
+    std::shared_ptr<boost::asio::thread_pool> m_copyPool; // Потоки, в которых выполняется SITE COPY
+    std::shared_ptr<ListingCache> m_listingCache; // Общий для сервера кэш листингов, может отсутствовать
+    std::shared_ptr<FileCache> m_fileCache; // Общий для сервера кэш содержимого файлов, может отсутствовать
+    // Общий для сервера набор портов пассивного режима; без него каждое соединение открывает свой порт
+    std::shared_ptr<PassivePortPool> m_passivePortPool;
+    std::shared_ptr<BandwidthLimiter> m_bandwidthLimiter; // Ограничения скорости передачи данных
+    std::shared_ptr<details::TimingWheel> m_timingWheel; // Таймеры проверки сроков сессий
+    SessionTimeouts m_timeouts;
+    std::shared_ptr<AuditLog> m_auditLog; // Журнал команд и передач, может отсутствовать
+    std::function<void(Connection&)> m_notifyOnClose; // Вызывается, когда соединение должно быть уничтожено
+};
+
+class alignas(64) Connection : public boost::intrusive::list_base_hook<>
 {
 public:
     // FTP-соединение инициализируется на сокете с дескриптором fd,
@@ -60,165 +154,257 @@ public:
     // Таким образом, connection гарантированно общается с одним клиентом и
     // не знает о сокете, на котором принимаются соединения.
     // Connection владеет своим fd и закрывает его сам при завершении работы
+    // Обработчики соединения выполняются последовательно на исполнителе executor.
+    // peer - адрес клиента, с которым установлено соединение
     explicit Connection(
-            int fd
-            , std::shared_ptr<messaging::PollMessageEngine>& messageEngine
-            , std::filesystem::path root
-            , const std::function<void(Connection&)>& connectionCloseCallback)
-    : boost::intrusive::list_base_hook<>(), m_fd(fd), m_messageEngine(messageEngine), m_root(std::move(root)), m_notifyOnCloseCallback(std::move(connectionCloseCallback))
+            int fd,
+            in_addr_t peer,
+            const ConnectionContext& context,
+            const boost::asio::thread_pool::executor_type& executor)
+    : boost::intrusive::list_base_hook<>()
+    , m_context(context)
+    , m_fd(fd)
+    , m_peer(peer)
+    , m_strand(boost::asio::make_strand(executor))
     {
         details::helpers::setNonBlocking(m_fd);
-        socklen_t addrLen = sizeof(m_socketAddress);
-        getsockname(m_fd, reinterpret_cast<sockaddr*>(&m_socketAddress), &addrLen);
-        m_dataConnectionAddress = m_socketAddress;
+        socklen_t addrLen = sizeof(m_dataConnectionAddress);
+        getsockname(m_fd, reinterpret_cast<sockaddr*>(&m_dataConnectionAddress), &addrLen);
         m_dataConnectionAddress.sin_port = 0;
 
-        auto aliveCriteria = m_isAlive;
+        // Поведения, признак жизни и strand соединения размещаются в одном блоке.
+        // Указатели на отдельные поведения ссылаются внутрь него и продлевают жизнь всего блока,
+        // пока движок хранит хотя бы одно из них, поэтому сами поведения захватывают только обычные указатели.
+        // Движок вызывает поведения из любых потоков пула, а выполняются они только в strand соединения
+        auto behaviors = std::make_shared<Behaviors>(m_strand);
+        m_isAlive = {behaviors, &behaviors->m_isAlive};
+        m_defaultBehavior = behaviors->share(behaviors->m_defaultBehavior);
+        m_commandReceiver = behaviors->share(behaviors->m_commandReceiver);
+        m_commandDelimiter = {behaviors, &behaviors->m_commandDelimiter};
+        m_outputWriter = behaviors->share(behaviors->m_outputWriter);
+        m_repeatedDataSender = behaviors->share(behaviors->m_repeatedDataSender);
+        m_repeatedDataReceiver = behaviors->share(behaviors->m_repeatedDataReceiver);
+        m_dataChunkReceiver = behaviors->share(behaviors->m_dataChunkReceiver);
+        m_throttledDataWriter = behaviors->share(behaviors->m_throttledDataWriter);
+        m_watchdog = behaviors->share(behaviors->m_watchdog);
+
+        auto *aliveCriteria = m_isAlive.get();
 
-        m_defaultBehavior =
-                std::make_shared<messaging::CallbackType>(
-                        [this, aliveCriteria](int res) mutable
+        behaviors->m_commandDelimiter =
+                [](const InputBufferType& buffer) -> std::ptrdiff_t
+                {
+                    return buffer.find("\r\n") != buffer.npos ? 2 : 0;
+                };
+
+        behaviors->m_commandReceiver.m_handler =
+                [this, aliveCriteria](int res)
+                {
+                    if(aliveCriteria->load() && !m_isClosing)
+                    {
+                        m_lastActivity = details::TimingWheel::Clock::now();
+                        if (res > 0)
+                            processNewCommand();
+                        else if (res == -ENOMEM)
+                            discardOverlongCommand();
+                        else
+                            killSelf();
+                    }
+                };
+
+        behaviors->m_defaultBehavior.m_handler =
+                [this, aliveCriteria](int res)
                 {
                     if(aliveCriteria->load())
                     {
                         if (res > 0)
-                            m_messageEngine->async_read_until(
-                                    m_fd, m_msg, std::make_shared<messaging::CallbackType>(
-                                            [this, aliveCriteria](int res)
-                                            {
-                                                if(aliveCriteria->load())
-                                                {
-                                                    if (res > 0)
-                                                        processNewCommand();
-                                                    else
-                                                        killSelf();
-                                                }
-                                            }), "\r\n"s);
+                            m_context.m_messageEngine->async_read_until(m_fd, m_msg, m_commandReceiver, m_commandDelimiter);
                         else
                             killSelf();
                     }
-                });
+                };
+
+        behaviors->m_outputWriter.m_handler =
+                [this, aliveCriteria](int res)
+                {
+                    if(aliveCriteria->load())
+                    {
+                        if (res <= 0)
+                        {
+                            // Клиент не принимает ответы - соединение больше не нужно
+                            m_isOutputWriting = false;
+                            killSelf();
+                            return;
+                        }
+                        if (!m_output.empty())
+                            m_output.consume(res);
+                        else
+                            m_outputOverflow.erase(0, res);
+                        writeOutput(res);
+                    }
+                };
 
-        m_repeatedDataSender =
-                std::make_shared<messaging::CallbackType>(
-                        [this, aliveCriteria](int res) mutable
+        behaviors->m_throttledDataWriter.m_handler =
+                [this, aliveCriteria](int)
+                {
+                    if(aliveCriteria->load())
+                    {
+                        m_isThrottled = false;
+                        m_context.m_messageEngine->async_write(m_dataTransmissionFd, m_dataChunk, m_repeatedDataSender);
+                    }
+                };
+
+        behaviors->m_watchdog.m_handler =
+                [this, aliveCriteria](int)
+                {
+                    if(aliveCriteria->load())
+                        checkTimeouts();
+                };
+
+        behaviors->m_repeatedDataSender.m_handler =
+                [this, aliveCriteria](int res)
                 {
                     if(aliveCriteria->load())
                     {// Задача этой функции заключается в том,
                         // чтобы поблочно вычитать файл и затем закрыть соединение
                         if (res >= 0)
                         {
+                            // Блок передачи в трассировке - от чтения данных до окончания их отправки
+                            tracing::async("chunk", std::exchange(m_chunkTraceStart, tracing::start()), traceId());
                             //Данные успешно отправлены или функция только что вызвана - продолжаем читать и пересылать
-                            m_dataBuffer.resize(500, 0);
-                            m_dataBuffer.reserve(1000);
-
-                            res = fread(m_dataBuffer.data(), sizeof(char), 500, m_file);
+                            m_transferredBytes += res;
+                            metrics::ThreadMetrics::local().add(metrics::Counter::BytesSent, res);
+                            res = readDataChunk();
                             if (res > 0)
                             {
-                                // Чтение продолжается, отправляем вычитанный блок получателю, заменив \n на \r\n
-                                m_dataBuffer.resize(res);
-                                replaceNormalEolsToTelnet();
-                                // Символы заменили, отправляем данные
-                                m_messageEngine->async_write(
-                                        m_dataTransmissionFd, m_dataBuffer, m_repeatedDataSender);
+                                // Чтение продолжается, отправляем вычитанный блок получателю,
+                                // если нужно - после паузы, которой требуют ограничения скорости
+                                auto delay = m_context.m_bandwidthLimiter->consume(m_sessionBucket, m_userClass, res);
+                                m_isThrottled = delay > std::chrono::nanoseconds::zero();
+                                if (m_isThrottled)
+                                    m_context.m_messageEngine->async_wait(delay, m_throttledDataWriter);
+                                else
+                                    m_context.m_messageEngine->async_write(
+                                            m_dataTransmissionFd, m_dataChunk, m_repeatedDataSender);
                             }
                             else if (res == 0)
                             {
                                 // Чтение закончилось
                                 m_dataBuffer.clear();
-                                closeDataTransmissionSockets();
-                                reply("250 Transfer complete");
+                                finishTransfer(replies::transferComplete);
                             }
                             else
                             {
                                 //Ошибка передачи данных - завершаем передачу
                                 m_dataBuffer.clear();
-                                closeDataTransmissionSockets();
-                                reply("450 File action not taken");
+                                finishTransfer(replies::fileActionNotTaken);
                             }
                         }
                         else
                         {
                             // Сокет закрыт клиентом - прерываем передачу
                             m_dataBuffer.clear();
-                            closeDataTransmissionSockets();
-                            reply("426 Transfer aborted due to connection close");
+                            finishTransfer(replies::transferAborted);
                         }
                     }
-                });
+                };
+
+        behaviors->m_dataChunkReceiver.m_handler =
+                [this, aliveCriteria](int res)
+                {
+                    if(aliveCriteria->load())
+                    {
+                        if (res > 0)
+                        {
+                            // Чтение продолжается, отправляем вычитанный блок на диск, заменив \r\n на \n
+                            m_transferredBytes += res;
+                            metrics::ThreadMetrics::local().add(metrics::Counter::BytesReceived, res);
+                            m_dataBuffer.resize(res);
+                            if (m_representationType == RepresentationType::A)
+                                replaceTelnetEolsToNormal();
+                            int written = m_writer->write(m_dataBuffer);
+                            if (written < 0)
+                            {
+                                // Файлу плохо; пауза ограничения скорости не должна скрыть ошибку записи
+                                finishTransfer(replies::fileActionNotTaken);
+                                return;
+                            }
+                            // При ограничении скорости следующий блок запрашивается после паузы
+                            auto delay = m_context.m_bandwidthLimiter->consume(m_sessionBucket, m_userClass, res);
+                            m_isThrottled = delay > std::chrono::nanoseconds::zero();
+                            if (m_isThrottled)
+                                m_context.m_messageEngine->async_wait(delay, m_repeatedDataReceiver);
+                            else
+                                (*m_repeatedDataReceiver)(written);
+                        }
+                        else if (res == 0)
+                        {
+                            // Заменяем концы строк
+                            m_dataBuffer.resize(res);
+                            if (m_representationType == RepresentationType::A)
+                                replaceTelnetEolsToNormal();
+                            // Сокет закрыт, дописываем данные и завершаем соединение
+                            res = m_writer->write(m_dataBuffer);
+                            if (res >= 0 && m_writer->close())
+                            {
+                                // Завершаем передачу, последний кусок данных успешно записан
+                                finishTransfer(replies::transferComplete);
+                            }
+                            else
+                            {
+                                // Файлу плохо
+                                finishTransfer(replies::fileActionNotTaken);
+                            }
+                        }
+                        else
+                        {
+                            // Произошла ошибка на сокете
+                            finishTransfer(replies::transferAborted);
+                        }
+                    }
+                };
 
-        m_repeatedDataReceiver =
-                std::make_shared<messaging::CallbackType>(
-                        [this, aliveCriteria](int res) mutable
+        behaviors->m_repeatedDataReceiver.m_handler =
+                [this, aliveCriteria](int res)
                 {
                     if(aliveCriteria->load())
                     {// Задача этой функции заключается в том,
                         // чтобы поблочно вычитать файл и затем закрыть соединение
+                        m_isThrottled = false;
                         if (res >= 0)
                         {
+                            // Блок передачи в трассировке - от запроса чтения из сокета до окончания записи в файл
+                            tracing::async("chunk", std::exchange(m_chunkTraceStart, tracing::start()), traceId());
                             //Данные успешно отправлены или функция только что вызвана - продолжаем читать и пересылать
-                            m_dataBuffer.resize(500, 0);
-                            m_dataBuffer.reserve(1000);
-
-                            m_messageEngine->async_read_some(
-                                    m_dataTransmissionFd, m_dataBuffer, std::make_shared<messaging::CallbackType>(
-                                            [this, aliveCriteria](int res)
-                                            {
-                                                if(aliveCriteria->load())
-                                                {
-                                                    if (res > 0)
-                                                    {
-                                                        // Чтение продолжается, отправляем вычитанный блок на диск, заменив \r\n на \n
-                                                        m_dataBuffer.resize(res);
-                                                        replaceTelnetEolsToNormal();
-                                                        (*m_repeatedDataReceiver)(
-                                                                fwrite(
-                                                                        m_dataBuffer.data(), sizeof(char), m_dataBuffer.size()
-                                                                        , m_file));
-                                                    }
-                                                    else if (res == 0)
-                                                    {
-                                                        // Заменяем концы строк
-                                                        m_dataBuffer.resize(res);
-                                                        replaceTelnetEolsToNormal();
-                                                        // Сокет закрыт, дописываем данные и завершаем соединение
-                                                        res = fwrite(
-                                                                m_dataBuffer.data(), sizeof(char), m_dataBuffer.size(), m_file);
-                                                        if (res >= 0)
-                                                        {
-                                                            // Завершаем передачу, последний кусок данных успешно записан
-                                                            closeDataTransmissionSockets();
-                                                            reply("250 Transfer complete");
-                                                        }
-                                                        else
-                                                        {
-                                                            // Файлу плохо
-                                                            closeDataTransmissionSockets();
-                                                            reply("450 File action not taken");
-                                                        }
-                                                    }
-                                                    else
-                                                    {
-                                                        // Произошла ошибка на сокете
-                                                        closeDataTransmissionSockets();
-                                                        reply("426 Transfer aborted due to connection close");
-                                                    }
-                                                }
-                                            }));
+                            m_dataBuffer.resize(fileChunkSize, 0);
+
+                            m_context.m_messageEngine->async_read_some(m_dataTransmissionFd, m_dataBuffer, m_dataChunkReceiver);
                         }
                         else
                         {
                             // Файлу плохо
-                            closeDataTransmissionSockets();
-                            reply("450 File action not taken");
+                            finishTransfer(replies::fileActionNotTaken);
                         }
                     }
-                });
+                };
     }
 
     void start()
     {
-        reply("220 Hello!");
+        boost::asio::dispatch(
+                m_strand,
+                [this, aliveCriteria = m_isAlive]()
+                {
+                    if(aliveCriteria->load())
+                    {
+                        armWatchdog();
+                        reply(replies::hello);
+                    }
+                });
+    }
+
+    in_addr_t peer() const
+    {
+        return m_peer;
     }
 
     bool operator==(const Connection& other) const
@@ -229,17 +415,28 @@ public:
     ~Connection()
     {
         m_isAlive->store(false);
+        // Таймер проверки сроков удерживал бы поведения закрытого соединения до своего срабатывания
+        if (m_watchdogDeadline != details::TimingWheel::Clock::time_point::max())
+            m_context.m_timingWheel->cancel(m_watchdogTick, m_watchdog);
+        // Ожидающие операции снимаются, чтобы они не сработали на сокетах, которые получат те же номера
+        m_context.m_messageEngine->cancel(m_fd);
         close(m_fd);
         if(m_dataTransmissionFd != -1)
+        {
+            m_context.m_messageEngine->cancel(m_dataTransmissionFd);
             close(m_dataTransmissionFd);
+        }
         if(m_dataFd != -1)
+        {
+            m_context.m_messageEngine->cancel(m_dataFd);
             close(m_dataFd);
-        if(m_file)
-            fclose(m_file);
+        }
+        if(m_passiveReservation)
+            m_context.m_passivePortPool->release(*m_passiveReservation);
     }
 
 private:
-    void user(const std::string& username);
+    void user(std::string_view username);
     void quit();
     void type(RepresentationType representationType, Format format = Format::N);
     void mode(Mode mode);
@@ -250,24 +447,219 @@ private:
     void pasv();
     void pwd()
     {
-        reply("257 /");
+        reply(replies::workingDirectory);
     }
-    void list(const std::filesystem::path& path);
+    void list(const std::filesystem::path& path, details::ListingFormat format = details::ListingFormat::LongList);
+    void mlst(const std::filesystem::path& path);
+    void size(const std::filesystem::path& path);
+    void mdtm(const std::filesystem::path& path);
+    void copy(const std::filesystem::path& from, const std::filesystem::path& to);
+    void feat();
+    // Выполняет все команды, полностью пришедшие в m_msg
     void processNewCommand();
+    // Разбирает и выполняет одну команду из начала m_msg
+    void executeCommand();
+    // Отбрасывает команду, не поместившуюся в m_msg, вместе с ее еще не пришедшим остатком
+    void discardOverlongCommand();
+    // Проверяет путь из аргумента команды и возвращает его абсолютный вариант
+    // либо отвечает клиенту об ошибке и возвращает std::nullopt
+    std::optional<std::filesystem::path> resolvePath(std::string_view argument);
+
+    // Обработчики команд: разбирают аргумент и вызывают соответствующее действие
+    void handleUser(std::string_view argument);
+    void handleQuit(std::string_view argument);
+    void handleNoop(std::string_view argument);
+    void handleFeat(std::string_view argument);
+    void handleType(std::string_view argument);
+    void handleMode(std::string_view argument);
+    void handleStru(std::string_view argument);
+    void handleRetr(std::string_view argument);
+    void handleStor(std::string_view argument);
+    void handleList(std::string_view argument);
+    void handleMlsd(std::string_view argument);
+    void handleMlst(std::string_view argument);
+    void handleSize(std::string_view argument);
+    void handleMdtm(std::string_view argument);
+    void handlePasv(std::string_view argument);
+    void handlePwd(std::string_view argument);
+    void handleSite(std::string_view argument);
+
+    struct CommandEntry
+    {
+        std::uint32_t m_verb = 0; // Имя команды, упакованное details::packVerb()
+        void (Connection::*m_handler)(std::string_view) = nullptr;
+        bool m_requiresAuthentication = false;
+    };
+    struct CommandTable;
+    static const CommandTable s_commandTable;
+    // Идентификатор сессии в трассировке
+    std::uint64_t traceId() const
+    {
+        return reinterpret_cast<std::uintptr_t>(this);
+    }
     void killSelf()
     {
-        m_notifyOnCloseCallback(*this);
+        m_context.m_notifyOnClose(*this);
+    }
+    // Ставит в очередь ответ, собранный из частей; ответ должен завершаться \r\n.
+    // Ответы отправляются строго в порядке постановки, не более одной записи в сокет за раз
+    void reply(std::initializer_list<std::string_view> parts);
+    void reply(std::string_view preformattedReply)
+    {
+        reply({preformattedReply});
+    }
+    // Ставит ответ в очередь, не запуская отправку
+    void queueReply(std::initializer_list<std::string_view> parts);
+    // Отправляет ответ и закрывает соединение; клиенту, не принимающему ответ,
+    // дается closingGracePeriod, после чего соединение закрывается без отправки
+    void replyAndClose(std::string_view preformattedReply);
+    // Команда, завершающаяся асинхронно, задает здесь, что делать после отправки накопленных ответов
+    // вместо ожидания следующей команды; обработка пришедших следом команд при этом откладывается
+    void setReplyContinuation(std::shared_ptr<messaging::CallbackType> continuation);
+    // Отправляет накопленные ответы одной записью и по ее окончании вызывает continuation
+    void flushReplies(const std::shared_ptr<messaging::CallbackType>& continuation);
+    // Отправляет очередной участок очереди ответов, а когда она опустеет - вызывает m_outputContinuation
+    void writeOutput(int lastWriteRes);
+    void sendFile();
+    // Отдает содержимое записи кэша
+    void sendCachedFile(FileCache::ContentType content);
+    void recvFile();
+    struct CopyState;
+    // Копирует очередную порцию в пуле копирования и ставит в очередь следующую либо итоговый ответ
+    static void copyStep(const std::shared_ptr<CopyState>& state);
+    // Строка продолжения ответа 150 о ходе копирования
+    void reportCopyProgress(std::uint64_t copiedBytes);
+    void finishCopy(std::uint64_t copiedBytes, bool isDone);
+    // Оборачивает callback, который может быть вызван из другого потока, так чтобы он выполнялся в strand соединения
+    std::shared_ptr<messaging::CallbackType> serialized(std::shared_ptr<messaging::CallbackType> callback)
+    {
+        return std::make_shared<messaging::CallbackType>(
+                [strand = m_strand, callback = std::move(callback)](int res)
+                {
+                    boost::asio::dispatch(strand, [callback, res]() { (*callback)(res); });
+                });
+    }
+    // Ожидает соединение для передачи данных на порту, выделенном командой PASV.
+    // Callback получает дескриптор соединения в неблокирующем режиме либо отрицательное значение
+    void acceptDataConnection(std::shared_ptr<messaging::CallbackType> callback);
+    // Прекращает ожидание соединения для передачи данных; его коллбек больше не вызывается
+    void stopAwaitingDataConnection();
+    // Ставит таймер проверки сроков на ближайший срок текущего состояния сессии,
+    // если уже поставленный таймер не сработает раньше
+    void armWatchdog();
+    // Закрывает сессию или передачу, срок которой истек
+    void checkTimeouts();
+    // Записывает в журнал выполненную команду с кодом первого ответа на нее
+    void logCommand(std::chrono::nanoseconds duration);
+    // Запоминает команду, начинающую передачу данных, для записи в журнал по окончании передачи
+    void startTransferRecord();
+    // Записывает в журнал оконченную передачу с итоговым ответом
+    void logTransfer(std::string_view preformattedReply, std::chrono::nanoseconds duration);
+    // Закрывает передачу, учитывает ее в метриках и журнале и отвечает клиенту о ее результате
+    void finishTransfer(std::string_view preformattedReply)
+    {
+        auto &threadMetrics = metrics::ThreadMetrics::local();
+        auto duration = details::TimingWheel::Clock::now() - m_transferStart;
+        threadMetrics.add(
+                preformattedReply == replies::transferComplete
+                ? metrics::Counter::TransfersCompleted
+                : metrics::Counter::TransfersFailed);
+        threadMetrics.observe(metrics::Histogram::TransferDuration, duration);
+        if (m_transferRecord)
+            logTransfer(preformattedReply, duration);
+        tracing::async("chunk", std::exchange(m_chunkTraceStart, 0), traceId());
+        tracing::async("transfer", std::exchange(m_transferTraceStart, 0), traceId());
+        closeDataTransmissionSockets();
+        reply(preformattedReply);
+    }
+    // Передача не состоялась: учитывает ее в метриках и журнале как неудачную, освобождает все,
+    // что для нее подготовлено, включая порт пассивного режима, чтобы следующая передача не получила данные этой,
+    // и отвечает клиенту
+    void abortTransfer(std::string_view preformattedReply)
+    {
+        metrics::ThreadMetrics::local().add(metrics::Counter::TransfersFailed);
+        // Несостоявшаяся передача попадает в журнал как незавершенная; ее длительность - ожидание соединения
+        if (m_transferRecord)
+        {
+            logTransfer(
+                    preformattedReply,
+                    m_isAwaitingDataConnection
+                    ? details::TimingWheel::Clock::now() - m_stateStart
+                    : std::chrono::nanoseconds::zero());
+        }
+        if (m_isAwaitingDataConnection)
+            stopAwaitingDataConnection();
+        else if (m_passiveReservation)
+        {
+            m_context.m_passivePortPool->release(*m_passiveReservation);
+            m_passiveReservation.reset();
+        }
+        closeDataTransmissionSockets();
+        reply(preformattedReply);
     }
-    void reply(const std::string& reply);
-    void echo(const std::string& msg);
-    void sendFile(int fileFd);
-    void recvFile(int fileFd);
     void closeDataTransmissionSockets()
     {
+        if (m_dataTransmissionFd != -1)
+            m_context.m_messageEngine->cancel(m_dataTransmissionFd);
         close(m_dataTransmissionFd);
         m_dataTransmissionFd = -1;
-        fclose(m_file);
-        m_file = nullptr;
+        // Время простоя управляющего соединения отсчитывается от окончания передачи
+        m_lastActivity = details::TimingWheel::Clock::now();
+        m_reader.reset();
+        m_readOffset = 0;
+        m_writer.reset();
+        m_lister.reset();
+        m_listingFill.reset();
+        m_cachedData = {};
+        m_cachedDataOwner.reset();
+        // Блок буфера возвращается в набор потока, чтобы не занимать память на время простоя
+        m_dataBuffer.clear();
+        m_dataBuffer.shrink_to_fit();
+    }
+    // Готовит в m_dataChunk очередной блок данных для отправки клиенту:
+    // данные из кэша, строки листинга каталога либо содержимое файла
+    // (в режиме ASCII - с заменой \n на \r\n).
+    // Возвращает размер блока, 0 по окончании данных и -1 при ошибке
+    int readDataChunk()
+    {
+        if (m_cachedDataOwner)
+        {
+            // Готовые данные из кэша уходят в сокет одной записью,
+            // а при ограничении скорости - блоками, чтобы задержки между ними были короткими
+            if (m_cachedData.empty())
+                return 0;
+            auto chunkSize = m_context.m_bandwidthLimiter->isLimited() ? shapedChunkSize : m_cachedData.size();
+            m_dataChunk = m_cachedData.first(std::min(chunkSize, m_cachedData.size()));
+            m_cachedData = m_cachedData.subspan(m_dataChunk.size());
+            return static_cast<int>(m_dataChunk.size());
+        }
+        if (m_lister)
+        {
+            m_dataBuffer.resize(listingChunkSize);
+            int res = m_lister->read(m_dataBuffer);
+            m_dataBuffer.resize(std::max(res, 0));
+            m_dataChunk = m_dataBuffer;
+            if (m_listingFill)
+            {
+                // Попутно накапливаем листинг для кэша
+                if (res > 0)
+                    m_listingFill->append(m_dataBuffer);
+                else if (res == 0)
+                    m_listingFill->commit();
+            }
+            return res;
+        }
+        // Запас под замену \n на \r\n в режиме ASCII; блок вместе с запасом помещается в блок набора буферов
+        m_dataBuffer.reserve(2 * fileChunkSize);
+        m_dataBuffer.resize(fileChunkSize, 0);
+        int res = m_reader->read(m_dataBuffer, m_readOffset);
+        if (res > 0)
+            m_readOffset += res;
+        m_dataBuffer.resize(std::max(res, 0));
+        if (m_representationType == RepresentationType::A)
+            replaceNormalEolsToTelnet();
+        m_dataChunk = m_dataBuffer;
+        return res;
     }
     void replaceNormalEolsToTelnet()
     {
@@ -290,25 +682,162 @@ private:
 
 
 private:
+    // Ответы короткие и уходят клиенту по мере накопления; более длинные очереди идут через m_outputOverflow
+    static constexpr std::size_t outputBufferSize = 1024;
+    // Наибольшая длина управляющей команды вместе с \r\n и пришедшими следом командами
+    static constexpr std::size_t inputBufferSize = 4096;
+    // Сколько входящих байт хранится в самом соединении; более длинные команды временно занимают блок в куче
+    static constexpr std::size_t inputInlineSize = 512;
+    // Размер блока, которым данные из кэша отправляются при ограничении скорости
+    static constexpr std::size_t shapedChunkSize = 16 * 1024;
+    // Сколько ждать отправки последнего ответа клиенту перед закрытием соединения
+    static constexpr std::chrono::seconds closingGracePeriod{5};
+    // Размер блока, которым файл читается из хранилища и принимается из сокета данных
+    static constexpr std::size_t fileChunkSize = 4 * 1024;
+    // Размер блока, которым листинг каталога отправляется в сокет данных
+    static constexpr std::size_t listingChunkSize = 4 * details::DirectoryLister::maxLineLength;
+    // Порция одной задачи копирования и наименьший промежуток между сообщениями о его ходе
+    static constexpr std::uint64_t copyChunkSize = 64 * 1024 * 1024;
+    static constexpr std::chrono::seconds copyProgressInterval{1};
+
+    using InputBufferType = details::BoundedBuffer<inputInlineSize, inputBufferSize>;
+
+    using StrandType = boost::asio::strand<boost::asio::thread_pool::executor_type>;
+
+    // Копирование SITE COPY: состояние живет в задачах пула копирования и не обращается к соединению вне его strand
+    struct CopyState
+    {
+        std::unique_ptr<Storage::Copier> m_copier;
+        boost::asio::thread_pool* m_pool;
+        StrandType m_strand;
+        std::shared_ptr<std::atomic_bool> m_isAlive;
+        Connection* m_connection;
+        std::uint64_t m_copiedBytes = 0;
+        details::TimingWheel::Clock::time_point m_nextProgress{};
+    };
+
+    // Поведение соединения: обработчик, выполняемый в strand соединения,
+    // и точка входа, через которую его вызывают движок и сам обработчик
+    struct SerializedCallback
+    {
+        messaging::CallbackType m_handler, m_entry;
+    };
+
+    struct Behaviors : std::enable_shared_from_this<Behaviors>
+    {
+        explicit Behaviors(StrandType strand)
+        : m_strand(std::move(strand)) {}
+
+        // Возвращает указатель на точку входа поведения. Вызов из strand соединения выполняется сразу,
+        // из других потоков - ставится в очередь strand; после уничтожения соединения обработчик не вызывается
+        std::shared_ptr<messaging::CallbackType> share(SerializedCallback& callback)
+        {
+            callback.m_entry = [this, &callback](int res)
+            {
+                auto handler = [self = shared_from_this(), &callback, res]()
+                {
+                    if(self->m_isAlive.load())
+                        callback.m_handler(res);
+                };
+                // Операции, завершившиеся сразу, продолжают цепочку рекурсивно;
+                // чтобы длинная передача не переполнила стек, глубокие вызовы ставятся в очередь strand
+                if (s_nestingDepth >= maxNestingDepth)
+                {
+                    boost::asio::post(m_strand, std::move(handler));
+                    return;
+                }
+                ++s_nestingDepth;
+                boost::asio::dispatch(m_strand, std::move(handler));
+                --s_nestingDepth;
+            };
+            return {shared_from_this(), &callback.m_entry};
+        }
+
+        static constexpr int maxNestingDepth = 32;
+        static inline thread_local int s_nestingDepth = 0;
+
+        std::atomic_bool m_isAlive = true;
+        StrandType m_strand;
+        SerializedCallback m_defaultBehavior;
+        SerializedCallback m_commandReceiver; // Получает результат чтения очередной команды
+        messaging::PredicateType<InputBufferType> m_commandDelimiter;
+        SerializedCallback m_outputWriter;
+        SerializedCallback m_repeatedDataSender;
+        SerializedCallback m_repeatedDataReceiver;
+        SerializedCallback m_dataChunkReceiver; // Получает очередной блок данных от клиента
+        SerializedCallback m_throttledDataWriter; // Отправляет отложенный ограничением скорости блок
+        SerializedCallback m_watchdog; // Проверяет сроки сессии по таймеру
+    };
+
+    // Поля, к которым обращается обработка каждой команды, собраны в первой кэш-линии объекта
+    const ConnectionContext& m_context;
     int m_fd, // Дескриптор, на котором работают управляющее и транспортное соединения.
-        m_dataFd = -1, // Дескриптор, на котором будут приниматься соединения для передачи данных
         m_dataTransmissionFd = -1; // Дескриптор, на котором передача данных непосредственно осуществляется
-    FILE* m_file = nullptr;
-    std::string m_msg, m_dataBuffer;
+    RepresentationType m_representationType = RepresentationType::A;
     bool m_isAuthenticated = false; // Прошел ли пользователь начальную аутентификацию
-    std::shared_ptr<messaging::PollMessageEngine> m_messageEngine; // Механизм для обмена сообщениями, должен быть общим для всех сущностей
-    std::filesystem::path m_root;
-    sockaddr_in m_socketAddress, m_dataConnectionAddress;
-
-    std::shared_ptr<std::atomic_bool> m_isAlive = std::make_shared<std::atomic_bool>(true);
+    bool m_isOutputWriting = false, m_isProcessingCommands = false;
+    bool m_isDiscardingCommand = false; // Пропускается остаток слишком длинной команды
+    std::shared_ptr<std::atomic_bool> m_isAlive;
 
+    // Указатели внутрь общего блока Behaviors
     std::shared_ptr<messaging::CallbackType> m_defaultBehavior;
-
+    std::shared_ptr<messaging::CallbackType> m_outputWriter;
+    std::shared_ptr<messaging::CallbackType> m_commandReceiver;
+    std::shared_ptr<messaging::PredicateType<InputBufferType>> m_commandDelimiter;
     std::shared_ptr<messaging::CallbackType> m_repeatedDataSender;
-
     std::shared_ptr<messaging::CallbackType> m_repeatedDataReceiver;
+    std::shared_ptr<messaging::CallbackType> m_dataChunkReceiver;
+    std::shared_ptr<messaging::CallbackType> m_throttledDataWriter;
+    std::shared_ptr<messaging::CallbackType> m_watchdog;
+
+    // Входящие команды; размер буфера ограничен, чтобы клиент, не присылающий \r\n,
+    // не мог заставить сервер выделять память без ограничений
+    InputBufferType m_msg;
+    // Очередь ответов клиенту; m_outputOverflowQueued и m_outputOverflow используются, только если ответы
+    // не помещаются в m_output
+    details::RingBuffer<outputBufferSize> m_output;
+    std::shared_ptr<messaging::CallbackType> m_outputContinuation;
+    std::shared_ptr<messaging::CallbackType> m_replyContinuation;
 
-    std::function<void(Connection&)> m_notifyOnCloseCallback;
+    // Редко используемое состояние: передача данных и пассивный режим
+    // Ответы, не поместившиеся в m_output: отправляемые сейчас и накопленные за время их отправки
+    std::string m_outputOverflow, m_outputOverflowQueued;
+    int m_dataFd = -1; // Дескриптор, на котором будут приниматься соединения для передачи данных
+    std::unique_ptr<Storage::Reader> m_reader; // Файл, который отдается клиенту
+    std::uint64_t m_readOffset = 0;
+    std::unique_ptr<Storage::Writer> m_writer; // Файл, который принимается от клиента
+    std::unique_ptr<details::DirectoryLister> m_lister; // Источник данных для LIST, пока идет передача листинга
+    std::optional<ListingCache::Fill> m_listingFill; // Листинг, накапливаемый для кэша по ходу передачи
+    std::shared_ptr<const void> m_cachedDataOwner; // Запись кэша, пока идет передача ее содержимого
+    std::span<const char> m_cachedData;
+    std::span<const char> m_dataChunk; // Блок данных, который сейчас отправляется клиенту
+    details::PooledString m_dataBuffer; // Память берется из набора буферов рабочего потока
+    std::optional<PassivePortPool::Reservation> m_passiveReservation;
+    sockaddr_in m_dataConnectionAddress;
+    in_addr_t m_peer; // Адрес клиента
+    TokenBucket m_sessionBucket; // Ограничение скорости передачи данных этой сессии
+    BandwidthLimiter::UserClass* m_userClass = nullptr; // Класс пользователя для общего ограничения скорости
+    bool m_isThrottled = false; // Передача приостановлена ограничением скорости
+    // Состояние проверки сроков
+    bool m_isAwaitingDataConnection = false, m_isClosing = false;
+    bool m_isCopying = false; // Идет SITE COPY: сроки простоя не проверяются
+    details::TimingWheel::Clock::time_point
+        m_lastActivity = details::TimingWheel::Clock::now(), // Последняя команда или окончание передачи
+        m_stateStart, // Начало ожидания соединения для передачи данных либо закрытия сессии
+        m_transferStart, // Установление соединения для текущей передачи данных
+        m_transferWindowStart, // Начало текущего окна проверки скорости передачи
+        m_watchdogDeadline = details::TimingWheel::Clock::time_point::max(); // Срок единственного поставленного таймера
+    std::uint64_t m_watchdogTick = 0; // Такт колеса, на который поставлен этот таймер
+    std::uint64_t m_transferredBytes = 0, m_transferWindowBytes = 0;
+    // Журнал: команда, которая сейчас выполняется (участки m_msg), код первого ответа на нее
+    // и запись о текущей передаче, создаваемая только при включенном журнале
+    std::string_view m_currentVerb, m_currentArgument;
+    std::uint16_t m_replyCode = 0;
+    std::unique_ptr<AuditLog::Record> m_transferRecord;
+    // Начала незавершенных интервалов трассировки; 0 - интервал не отслеживается
+    tracing::Timestamp m_flushTraceStart = 0, m_dataAcceptTraceStart = 0, m_transferTraceStart = 0, m_chunkTraceStart = 0;
+    // Все обработчики соединения выполняются последовательно в этом strand
+    StrandType m_strand;
 };
 
 } //namespace ftp
@@ -0,0 +1,97 @@
+#ifndef FTP_SERVER_POLL_LISTINGCACHE_H
+#define FTP_SERVER_POLL_LISTINGCACHE_H
+
+#include <FsWatcher.h>
+#include <DirectoryLister.h>
+#include <list>
+#include <optional>
+
+namespace ftp {
+
+// Общий для сервера кэш готовых листингов каталогов в форматах LIST и MLSD.
+// Записи сбрасываются по уведомлениям FsWatcher при любом изменении в каталоге,
+// так что попадание в кэш стоит одной записи готового буфера в сокет данных.
+// Каждая запись держит наблюдение за своим каталогом и снимает его, когда сбрасывается
+// или вытесняется; вытесняются давно не использованные каталоги.
+class ListingCache
+{
+public:
+    using ListingType = std::shared_ptr<const std::string>;
+
+    // Листинг, который формируется по ходу передачи клиенту
+    // и после ее успешного окончания попадает в кэш
+    class Fill
+    {
+    public:
+        void append(std::string_view data)
+        {
+            m_data.append(data);
+        }
+
+        // Сохраняет листинг, если за время его формирования каталог не изменился
+        void commit();
+
+    private:
+        friend class ListingCache;
+
+        Fill(ListingCache& cache, std::filesystem::path directory, details::ListingFormat format, std::uint64_t generation)
+        : m_cache(&cache), m_directory(std::move(directory)), m_format(format), m_generation(generation) {}
+
+        ListingCache* m_cache;
+        std::filesystem::path m_directory;
+        details::ListingFormat m_format;
+        std::uint64_t m_generation;
+        std::string m_data;
+    };
+
+    explicit ListingCache(const std::shared_ptr<FsWatcher>& watcher, std::size_t maxDirectories = 1024);
+
+    // Возвращает сохраненный листинг либо nullptr
+    ListingType find(const std::filesystem::path& directory, details::ListingFormat format);
+
+    // Начинает формирование листинга для кэша. Наблюдение за каталогом
+    // устанавливается до его чтения, поэтому изменения во время чтения не теряются.
+    // Возвращает std::nullopt, если наблюдение установить не удалось
+    std::optional<Fill> startFill(const std::filesystem::path& directory, details::ListingFormat format);
+
+    void invalidate(const std::filesystem::path& directory);
+
+    void clear();
+
+    std::uint64_t hits() const
+    {
+        return m_hits.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t misses() const
+    {
+        return m_misses.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Entry
+    {
+        std::string m_directory;
+        // Листинги, индексируемые форматом
+        std::array<ListingType, 2> m_listings;
+        // Номер поколения создается вместе с записью;
+        // листинг, начатый для уже сброшенной записи, в кэш не попадает
+        std::uint64_t m_generation;
+        int m_watch; // Дескриптор наблюдения за каталогом
+    };
+
+    void insert(Fill&& fill);
+
+    std::shared_ptr<FsWatcher> m_watcher;
+    std::size_t m_maxDirectories;
+    std::mutex m_cacheMutex;
+    // Записи в порядке от недавно использованных к давно использованным
+    std::list<Entry> m_lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> m_entries;
+    std::uint64_t m_generationCounter = 0;
+    std::atomic_uint64_t m_hits = 0, m_misses = 0;
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_LISTINGCACHE_H
@@ -0,0 +1,60 @@
+#ifndef FTP_SERVER_POLL_LOCALSTORAGE_H
+#define FTP_SERVER_POLL_LOCALSTORAGE_H
+
+#include <Storage.h>
+
+namespace ftp {
+
+// Хранилище в локальной файловой системе: файлы читаются через pread, каталоги - через getdents64,
+// а атрибуты всех элементов каталога собираются за тот же проход через statx относительно его дескриптора.
+// Корневой каталог открывается один раз, и каждый путь разрешается относительно его дескриптора
+// через openat2 с RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS: за одну операцию путь проходится один раз,
+// выйти за пределы корня нельзя ни через "..", ни через символические ссылки, а проверка и открытие
+// не разнесены во времени. Поэтому символические ссылки внутри корня видны в листингах, но не открываются;
+// stat с followSymlinks для них завершается ошибкой ELOOP
+class LocalStorage : public Storage
+{
+public:
+    // Открывает корневой каталог root. Если каталог недоступен или ядро не поддерживает openat2,
+    // выбрасывает std::system_error
+    explicit LocalStorage(const std::filesystem::path& root);
+
+    LocalStorage(const LocalStorage&) = delete;
+    LocalStorage& operator=(const LocalStorage&) = delete;
+
+    ~LocalStorage() override;
+
+    std::unique_ptr<Reader> openRead(const std::filesystem::path& path) override;
+
+    std::unique_ptr<Writer> openWrite(const std::filesystem::path& path) override;
+
+    bool stat(const std::filesystem::path& path, struct statx& attributes, bool followSymlinks = false) override;
+
+    std::unique_ptr<DirectoryReader> list(const std::filesystem::path& directory) override;
+
+    bool rename(const std::filesystem::path& from, const std::filesystem::path& to) override;
+
+    // Копирует через FICLONE, а где reflink не поддерживается - через copy_file_range
+    std::unique_ptr<Copier> copy(const std::filesystem::path& from, const std::filesystem::path& to) override;
+
+    bool isMemoryResident() const override
+    {
+        return false;
+    }
+
+private:
+    // Путь относительно корня: указатель внутрь path либо "." для самого корня.
+    // Для путей вне корня возвращает nullptr и выставляет errno
+    const char* relativePath(const std::filesystem::path& path) const;
+
+    // Открывает path относительно корня, не выходя за его пределы и не следуя по символическим ссылкам
+    int openBeneath(const std::filesystem::path& path, std::uint64_t flags, std::uint64_t mode = 0) const;
+    int openBeneath(const char* relative, std::uint64_t flags, std::uint64_t mode = 0) const;
+
+    std::filesystem::path m_root; // Без завершающего разделителя
+    int m_rootFd;
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_LOCALSTORAGE_H
@@ -0,0 +1,100 @@
+#ifndef FTP_SERVER_POLL_MEMORYSTORAGE_H
+#define FTP_SERVER_POLL_MEMORYSTORAGE_H
+
+#include <Storage.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ftp {
+
+// Хранилище, целиком находящееся в памяти процесса: плоский каталог файлов в корне root.
+// Файлы распределены по сегментам, у каждого своя блокировка. Содержимое файла неизменяемо
+// и разделяется между всеми, кто его читает, поэтому отдача не копирует данные, а запись
+// публикует новое содержимое целиком при close().
+// Позволяет гонять сетевой путь сервера без диска и отдавать наборы данных, помещающиеся в память
+class MemoryStorage : public Storage
+{
+public:
+    explicit MemoryStorage(const std::filesystem::path& root, std::size_t shardCount = 16);
+
+    // Кладет в корень файл name с содержимым content, заменяя существующий
+    void put(std::string_view name, std::shared_ptr<const std::string> content);
+
+    // Копирует в хранилище обычные файлы каталога directory (без вложенных каталогов).
+    // При ошибке чтения выбрасывает std::system_error
+    void load(const std::filesystem::path& directory);
+
+    std::unique_ptr<Reader> openRead(const std::filesystem::path& path) override;
+
+    std::unique_ptr<Writer> openWrite(const std::filesystem::path& path) override;
+
+    bool stat(const std::filesystem::path& path, struct statx& attributes, bool followSymlinks = false) override;
+
+    std::unique_ptr<DirectoryReader> list(const std::filesystem::path& directory) override;
+
+    bool rename(const std::filesystem::path& from, const std::filesystem::path& to) override;
+
+    // Копия разделяет содержимое с исходным файлом и появляется при close()
+    std::unique_ptr<Copier> copy(const std::filesystem::path& from, const std::filesystem::path& to) override;
+
+    bool isMemoryResident() const override
+    {
+        return true;
+    }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<const std::string> m_content;
+        struct statx_timestamp m_modificationTime;
+        std::uint64_t m_unique; // Заменяет номер inode в атрибутах
+    };
+
+    // Позволяет искать записи по std::string_view без создания строки
+    struct NameHash
+    {
+        using is_transparent = void;
+
+        std::size_t operator()(std::string_view name) const
+        {
+            return std::hash<std::string_view>()(name);
+        }
+    };
+
+    struct Shard
+    {
+        std::mutex m_mutex;
+        std::unordered_map<std::string, Entry, NameHash, std::equal_to<>> m_entries;
+    };
+
+    class MemoryReader;
+    class MemoryWriter;
+    class MemoryCopier;
+    class MemoryDirectoryReader;
+
+    // Имя файла в корне, которому соответствует path. Для путей вне корня возвращает пустую строку
+    std::string_view nameOf(const std::filesystem::path& path) const;
+
+    bool isRoot(const std::filesystem::path& path) const;
+
+    Shard& shardFor(std::string_view name);
+
+    void publish(std::string_view name, std::shared_ptr<const std::string> content);
+
+    // Атрибуты файла для листингов и команд SIZE/MDTM/MLST
+    void fillAttributes(const Entry& entry, struct statx& attributes) const;
+
+    std::filesystem::path m_root; // Без завершающего разделителя
+    // Владелец и время создания, которые хранилище сообщает для корня и всех файлов
+    std::uint32_t m_uid, m_gid;
+    struct statx_timestamp m_creationTime;
+    std::vector<Shard> m_shards;
+    std::atomic_uint64_t m_nextUnique = 1;
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_MEMORYSTORAGE_H
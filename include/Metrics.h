@@ -0,0 +1,84 @@
+#ifndef FTP_SERVER_POLL_METRICS_H
+#define FTP_SERVER_POLL_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+
+namespace ftp::metrics {
+
+enum class Counter
+{
+    SessionsAccepted,
+    SessionsClosed,
+    Commands,
+    BytesSent,
+    BytesReceived,
+    TransfersCompleted,
+    TransfersFailed,
+    Timeouts,
+    Count
+};
+
+enum class Histogram
+{
+    CommandDuration, // Время выполнения команды до постановки ответа или начала передачи
+    TransferDuration, // Время от установления соединения для передачи данных до ее окончания
+    Count
+};
+
+// Метрики одного потока. Пишет в них только сам поток, поэтому обновление - пара обычных
+// атомарных load и store без блокировок и без разделения кэш-линий с другими потоками;
+// сборка метрик читает значения всех потоков и складывает их.
+// Счетчики завершившегося потока переносятся в общий итог, так что сумма никогда не уменьшается
+class ThreadMetrics
+{
+public:
+    static constexpr std::size_t maxBuckets = 16;
+
+    static ThreadMetrics& local();
+
+    void add(Counter counter, std::uint64_t value = 1)
+    {
+        increment(m_counters[static_cast<std::size_t>(counter)], value);
+    }
+
+    void observe(Histogram histogram, std::chrono::nanoseconds duration);
+
+    ThreadMetrics(const ThreadMetrics&) = delete;
+    ThreadMetrics& operator=(const ThreadMetrics&) = delete;
+
+    ~ThreadMetrics();
+
+private:
+    friend struct Snapshot;
+
+    ThreadMetrics();
+
+    static void increment(std::atomic_uint64_t& cell, std::uint64_t value)
+    {
+        cell.store(cell.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    struct HistogramCells
+    {
+        std::array<std::atomic_uint64_t, maxBuckets + 1> m_buckets{}; // Последняя ячейка - выше всех границ
+        std::atomic_uint64_t m_sumNanoseconds = 0;
+    };
+
+    std::array<std::atomic_uint64_t, static_cast<std::size_t>(Counter::Count)> m_counters{};
+    std::array<HistogramCells, static_cast<std::size_t>(Histogram::Count)> m_histograms;
+};
+
+// Дописывает в out все счетчики и гистограммы, сложенные по потокам, в текстовом формате Prometheus
+void render(std::string& out);
+
+// Дописывает в out одно значение, которое владелец снимает в момент сборки метрик
+void renderGauge(std::string& out, std::string_view name, std::string_view help, std::uint64_t value);
+void renderCounter(std::string& out, std::string_view name, std::string_view help, std::uint64_t value);
+
+} //namespace ftp::metrics
+
+#endif //FTP_SERVER_POLL_METRICS_H
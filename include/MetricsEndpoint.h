@@ -0,0 +1,70 @@
+#ifndef FTP_SERVER_POLL_METRICSENDPOINT_H
+#define FTP_SERVER_POLL_METRICSENDPOINT_H
+
+#include <PollMessageEngine.h>
+#include <FixedBuffer.h>
+#include <netinet/in.h>
+
+namespace ftp {
+
+// Минимальный HTTP-сервер для сбора метрик: на запрос GET /metrics отвечает текстом,
+// который формирует render, на GET /trace - трассировкой в формате JSON от renderTrace, и закрывает соединение.
+// Слушает только 127.0.0.1 и работает на общем движке сервера
+class MetricsEndpoint
+{
+public:
+    using RenderType = std::function<void(std::string&)>;
+
+    // Открывает слушающий сокет на 127.0.0.1:port; если это не удалось, выбрасывает std::system_error
+    MetricsEndpoint(
+            const std::shared_ptr<messaging::PollMessageEngine>& messageEngine,
+            std::uint16_t port,
+            RenderType render,
+            RenderType renderTrace = nullptr);
+
+    MetricsEndpoint(const MetricsEndpoint&) = delete;
+    MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+
+    ~MetricsEndpoint();
+
+private:
+    // Заголовки запроса длиннее этого размера не принимаются
+    static constexpr std::size_t requestBufferSize = 4096;
+    // Запрос, не получивший ответа целиком за это время, закрывается
+    static constexpr auto requestTimeout = std::chrono::seconds(10);
+    // Пауза перед повторным accept() после ошибки, например при исчерпании дескрипторов
+    static constexpr auto acceptRetryDelay = std::chrono::milliseconds(100);
+
+    struct Request
+    {
+        explicit Request(int fd)
+        : m_fd(fd) {}
+
+        ~Request()
+        {
+            close(m_fd);
+        }
+
+        int m_fd;
+        details::FixedBuffer<requestBufferSize> m_request;
+        std::string m_response;
+    };
+
+    // Рекурсивно принимает соединения
+    void acceptNext();
+
+    void handleRequest(const std::shared_ptr<Request>& request);
+
+    // Снимает операции запроса по истечении requestTimeout; запрос держит только движок, поэтому он закрывается
+    void armRequestTimeout(const std::shared_ptr<Request>& request);
+
+    std::shared_ptr<messaging::PollMessageEngine> m_messageEngine;
+    RenderType m_render, m_renderTrace;
+    int m_fd;
+
+    std::shared_ptr<std::atomic_bool> m_isAlive = std::make_shared<std::atomic_bool>(true);
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_METRICSENDPOINT_H
@@ -0,0 +1,96 @@
+#ifndef FTP_SERVER_POLL_PASSIVEPORTPOOL_H
+#define FTP_SERVER_POLL_PASSIVEPORTPOOL_H
+
+#include <PollMessageEngine.h>
+#include <optional>
+#include <unordered_map>
+#include <netinet/in.h>
+
+namespace ftp {
+
+// Общий для сервера набор заранее открытых сокетов для пассивного режима.
+// Вместо отдельного слушающего сокета на каждое соединение сервер держит
+// фиксированное количество сокетов на портах из заданного диапазона.
+// Команда PASV резервирует порт для адреса клиента, а пришедшее на порт соединение
+// сопоставляется с ожидающей его сессией по адресу клиента через таблицу резервирований.
+class PassivePortPool
+{
+public:
+    struct Reservation
+    {
+        in_addr_t m_peer;
+        std::uint16_t m_port;
+        std::uint64_t m_ticket; // Отличает резервирования одного и того же порта одним и тем же адресом
+    };
+
+    // Открывает слушающие сокеты на адресе address для всех портов из [minPort, maxPort].
+    // Порты, которые не удалось занять, пропускаются; если не удалось занять ни одного,
+    // выбрасывает std::system_error
+    PassivePortPool(
+            const std::shared_ptr<messaging::PollMessageEngine>& messageEngine,
+            in_addr address,
+            std::uint16_t minPort,
+            std::uint16_t maxPort);
+
+    PassivePortPool(const PassivePortPool&) = delete;
+    PassivePortPool& operator=(const PassivePortPool&) = delete;
+
+    ~PassivePortPool();
+
+    // Резервирует порт для соединения от клиента с адресом peer.
+    // Возвращает std::nullopt, если все порты уже зарезервированы этим адресом
+    std::optional<Reservation> reserve(in_addr_t peer);
+
+    // Запрашивает соединение по резервированию. Callback получает дескриптор
+    // принятого соединения (сразу, если клиент уже подключился) либо отрицательное значение,
+    // если резервирование не найдено. После вызова callback резервирование снимается
+    void accept(const Reservation& reservation, std::shared_ptr<messaging::CallbackType> callback);
+
+    // Снимает резервирование, закрывая уже принятое по нему соединение
+    void release(const Reservation& reservation);
+
+    std::size_t listenerCount() const
+    {
+        return m_listeners.size();
+    }
+
+private:
+    struct Listener
+    {
+        int m_fd;
+        std::uint16_t m_port;
+    };
+
+    struct Pending
+    {
+        std::uint64_t m_ticket;
+        int m_dataFd = -1; // Соединение, принятое раньше, чем его запросила сессия
+        std::shared_ptr<messaging::CallbackType> m_callback; // Сессия, ожидающая соединения
+    };
+
+    static std::uint64_t key(in_addr_t peer, std::uint16_t port)
+    {
+        return static_cast<std::uint64_t>(peer) << 16 | port;
+    }
+
+    // Пауза перед повторным accept() после ошибки, например при исчерпании дескрипторов
+    static constexpr auto acceptRetryDelay = std::chrono::milliseconds(100);
+
+    // Рекурсивно принимает соединения на слушающем сокете
+    void acceptOn(Listener listener);
+
+    void handleNewDataConnection(Listener listener, int dataFd);
+
+    std::shared_ptr<messaging::PollMessageEngine> m_messageEngine;
+    std::vector<Listener> m_listeners;
+    std::mutex m_pendingMutex;
+    std::unordered_map<std::uint64_t, Pending> m_pending; // (адрес клиента, порт) -> резервирование
+    std::size_t m_nextListener = 0;
+    std::uint64_t m_ticketCounter = 0;
+
+    std::shared_ptr<std::atomic_bool> m_isAlive = std::make_shared<std::atomic_bool>(true);
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_PASSIVEPORTPOOL_H
@@ -12,6 +12,8 @@
 #include <unistd.h>
 #include <mutex>
 #include <atomic>
+#include <chrono>
+#include <EngineStatistics.h>
 
 namespace messaging {
 
@@ -29,14 +31,16 @@ public:
         async_read_some_impl(fd, {reinterpret_cast<std::byte *>(buffer.data()), buffer.size()}, callback);
     }
 
+    // Буфер не копируется: переданный объект должен жить до вызова callback
     template<typename BufferType>
-    void async_write_some(int fd, BufferType buffer, const std::shared_ptr<CallbackType>& callback){
-        async_write_some_impl(fd, {reinterpret_cast<std::byte *>(buffer.data()), buffer.size()}, callback);
+    void async_write_some(int fd, BufferType&& buffer, const std::shared_ptr<CallbackType>& callback){
+        async_write_some_impl(fd, {reinterpret_cast<const std::byte *>(std::data(buffer)), std::size(buffer)}, callback);
     }
 
+    // Буфер не копируется: переданный объект должен жить до вызова callback
     template<typename BufferType>
-    void async_write(int fd, BufferType buffer, const std::shared_ptr<CallbackType>& callback){
-        async_write_impl(fd, {reinterpret_cast<std::byte *>(buffer.data()), buffer.size()}, callback, 0);
+    void async_write(int fd, BufferType&& buffer, const std::shared_ptr<CallbackType>& callback){
+        async_write_impl(fd, {reinterpret_cast<const std::byte *>(std::data(buffer)), std::size(buffer)}, callback, 0);
     }
 
     template<typename BufferType>
@@ -51,7 +55,7 @@ public:
 
     template<typename BufferType, typename PredicateBufferType>
     void async_read_until(int fd, BufferType& buffer, std::shared_ptr<CallbackType> callback, const PredicateBufferType& pred){
-        async_read_until_impl(fd, buffer, callback, std::make_shared<PredicateType<PredicateBufferType>>(
+        async_read_until_impl(fd, buffer, callback, std::make_shared<PredicateType<BufferType>>(
                 [pred](const BufferType& buf)
                 {
                     auto searchRes = std::default_searcher(pred.begin(), pred.end())(buf.begin(), buf.end());
@@ -61,8 +65,54 @@ public:
 
     void async_accept(int fd, std::shared_ptr<CallbackType> callback);
 
+    // Вызывает callback со значением 0 не раньше чем через delay.
+    // Срабатывание проверяется на каждой итерации ожидания, поэтому точность - около миллисекунды
+    void async_wait(std::chrono::steady_clock::duration delay, std::shared_ptr<CallbackType> callback);
+
+    // Снимает все ожидающие операции над дескриптором fd, не вызывая их коллбеки.
+    // Должна вызываться до закрытия дескриптора, пока на нем могут быть ожидающие операции:
+    // иначе операции остаются в очереди и могут сработать на новом сокете с тем же номером
+    void cancel(int fd);
+
     ExtCallbackType waitForEvent();
 
+    // Количество операций, ожидающих готовности дескрипторов
+    std::size_t pendingOperations()
+    {
+        auto queriesLock = std::lock_guard(m_queryMutex);
+        return m_queries.size();
+    }
+
+    // Количество таймеров, которые еще не сработали
+    std::size_t pendingTimers()
+    {
+        auto queriesLock = std::lock_guard(m_queryMutex);
+        return m_timers.size();
+    }
+
+    // Количество готовых коллбеков, еще не выданных waitForEvent()
+    std::size_t readyCallbacks() const
+    {
+        return m_readyCallbackCount.load(std::memory_order_relaxed);
+    }
+
+    // Включает и выключает сбор гистограмм движка. Выключенный сбор стоит
+    // одной relaxed-загрузки флага на цикл ожидания и на каждый готовый коллбек
+    void enableStatistics(bool isEnabled)
+    {
+        m_statistics->m_isEnabled.store(isEnabled, std::memory_order_relaxed);
+    }
+
+    bool isStatisticsEnabled() const
+    {
+        return m_statistics->m_isEnabled.load(std::memory_order_relaxed);
+    }
+
+    // Снимок гистограмм; может вызываться из любого потока
+    EngineStatistics statistics() const;
+
+    void resetStatistics();
+
     void interrupt()
     {
         m_interruptanceFlag.store(true);
@@ -82,11 +132,11 @@ private:
 
     void async_read_some_impl(int fd, std::span<std::byte> buffer, std::shared_ptr<CallbackType> callback);
 
-    void async_write_some_impl(int fd, std::span<std::byte> buffer, std::shared_ptr<CallbackType> callback);
+    void async_write_some_impl(int fd, std::span<const std::byte> buffer, std::shared_ptr<CallbackType> callback);
 
     void async_read_impl(int fd, std::span<std::byte> buffer, std::shared_ptr<CallbackType> callback, int offset = 0);
 
-    void async_write_impl(int fd, std::span<std::byte> buffer, std::shared_ptr<CallbackType> callback, int offset = 0);
+    void async_write_impl(int fd, std::span<const std::byte> buffer, std::shared_ptr<CallbackType> callback, int offset = 0);
 
     template<typename BufferType>
     void async_read_until_impl(int fd, BufferType& buffer, std::shared_ptr<CallbackType> callback, std::shared_ptr<PredicateType<BufferType>> pred)
@@ -116,7 +166,7 @@ private:
                         {
                             if(aliveCriteria->load())
                             {
-                                buffer.resize(buffer.size() - len + res);
+                                buffer.resize(buffer.size() - len + std::max(res, 0));
                                 if (res <= 0)
                                 {
                                     (*callback)(res);
@@ -132,16 +182,45 @@ private:
     struct innerType {
         pollfd m_fd;
         std::shared_ptr<CallbackType> m_callback;
-        std::span<std::byte> m_buffer;
+        std::span<const std::byte> m_buffer;
         int m_associatedIndex;
     };
 
+    struct timerType {
+        std::chrono::steady_clock::time_point m_deadline;
+        std::shared_ptr<CallbackType> m_callback;
+
+        bool operator>(const timerType& other) const
+        {
+            return m_deadline > other.m_deadline;
+        }
+    };
+
+    // Гистограммы движка. Коллбеки, выданные waitForEvent(), держат их через shared_ptr,
+    // поэтому замеры в рабочих потоках не зависят от времени жизни движка
+    struct Instrumentation
+    {
+        std::atomic_bool m_isEnabled = false;
+        AtomicHistogram m_pollWait, m_fdsRebuild, m_readyDispatch, m_readyCount, m_dispatchLag, m_callbackDuration;
+    };
+
+    // Переносит сработавшие таймеры в очередь готовых коллбеков; возвращает true, если такие были
+    bool collectExpiredTimers(bool isInstrumented);
+
+    // Ставит коллбек в очередь готовых; при включенной статистике оборачивает его замером
+    // задержки от readyAt до начала выполнения и длительности выполнения
+    void pushReady(std::shared_ptr<CallbackType> callback, bool isInstrumented, std::chrono::steady_clock::time_point readyAt);
+
     std::vector<innerType> m_queries;
+    std::priority_queue<timerType, std::vector<timerType>, std::greater<>> m_timers;
     std::vector<pollfd> m_fds;
     std::queue<ExtCallbackType> m_readyForOperationQueue;
+    // Размер m_readyForOperationQueue для чтения из других потоков; очередь меняет только поток waitForEvent()
+    std::atomic_size_t m_readyCallbackCount = 0;
     std::mutex m_queryMutex;
     ExtCallbackType m_emptyCallback = [](){};
     std::atomic_bool m_interruptanceFlag = false;
+    std::shared_ptr<Instrumentation> m_statistics = std::make_shared<Instrumentation>();
 
     std::shared_ptr<std::atomic_bool> m_isAlive = std::make_shared<std::atomic_bool>(true);
 };
@@ -0,0 +1,79 @@
+#ifndef FTP_SERVER_POLL_RINGBUFFER_H
+#define FTP_SERVER_POLL_RINGBUFFER_H
+
+#include <array>
+#include <span>
+#include <string_view>
+#include <cstring>
+#include <algorithm>
+
+namespace ftp::details {
+
+// Кольцевой буфер байт фиксированной емкости.
+// Память выделяется один раз вместе с владельцем буфера и больше не перераспределяется
+template<std::size_t Capacity>
+class RingBuffer
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "RingBuffer capacity must be a power of two");
+
+public:
+    static constexpr std::size_t capacity()
+    {
+        return Capacity;
+    }
+
+    std::size_t size() const
+    {
+        return m_tail - m_head;
+    }
+
+    std::size_t freeSpace() const
+    {
+        return Capacity - size();
+    }
+
+    bool empty() const
+    {
+        return m_tail == m_head;
+    }
+
+    // Дописывает все части целиком либо, если они не помещаются, ничего не дописывает
+    bool write(std::initializer_list<std::string_view> parts)
+    {
+        std::size_t total = 0;
+        for (auto part: parts)
+            total += part.size();
+        if (total > freeSpace())
+            return false;
+        for (auto part: parts)
+        {
+            auto offset = m_tail & (Capacity - 1);
+            auto firstLen = std::min(part.size(), Capacity - offset);
+            std::memcpy(m_data.data() + offset, part.data(), firstLen);
+            std::memcpy(m_data.data(), part.data() + firstLen, part.size() - firstLen);
+            m_tail += part.size();
+        }
+        return true;
+    }
+
+    // Непрерывный участок данных от начала буфера
+    std::span<const char> readable() const
+    {
+        auto offset = m_head & (Capacity - 1);
+        return {m_data.data() + offset, std::min(size(), Capacity - offset)};
+    }
+
+    void consume(std::size_t len)
+    {
+        m_head += std::min(len, size());
+    }
+
+private:
+    // Счетчики расположены перед данными, чтобы оказаться рядом с остальными полями владельца
+    std::size_t m_head = 0, m_tail = 0;
+    std::array<char, Capacity> m_data;
+};
+
+} //namespace ftp::details
+
+#endif //FTP_SERVER_POLL_RINGBUFFER_H
@@ -0,0 +1,102 @@
+#ifndef FTP_SERVER_POLL_SLABPOOL_H
+#define FTP_SERVER_POLL_SLABPOOL_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+namespace ftp::details {
+
+// Пул объектов одного типа, выделяемых блоками по SlabSize штук.
+// Память блоков не возвращается системе до уничтожения пула:
+// освобожденные места переиспользуются для новых объектов,
+// так что создание объекта в прогретом пуле не обращается к куче
+template<typename T, std::size_t SlabSize = 64>
+class SlabPool
+{
+public:
+    SlabPool() = default;
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    // Все объекты должны быть уничтожены через destroy() до уничтожения пула
+    ~SlabPool() = default;
+
+    template<typename... Args>
+    T* create(Args&&... args)
+    {
+        Slot* slot;
+        {
+            auto poolLock = std::lock_guard(m_poolMutex);
+            if (!m_freeList)
+                grow();
+            slot = m_freeList;
+            m_freeList = slot->m_next;
+            ++m_size;
+        }
+        try
+        {
+            return ::new(static_cast<void*>(slot->m_storage)) T(std::forward<Args>(args)...);
+        } catch (...)
+        {
+            release(slot);
+            throw;
+        }
+    }
+
+    void destroy(T* object)
+    {
+        object->~T();
+        release(reinterpret_cast<Slot*>(object));
+    }
+
+    // Количество живых объектов
+    std::size_t size() const
+    {
+        auto poolLock = std::lock_guard(m_poolMutex);
+        return m_size;
+    }
+
+    // Количество мест во всех выделенных блоках
+    std::size_t capacity() const
+    {
+        auto poolLock = std::lock_guard(m_poolMutex);
+        return m_slabs.size() * SlabSize;
+    }
+
+private:
+    union Slot
+    {
+        Slot* m_next;
+        alignas(T) std::byte m_storage[sizeof(T)];
+    };
+
+    void grow()
+    {
+        auto& slab = m_slabs.emplace_back(std::make_unique_for_overwrite<Slot[]>(SlabSize));
+        for (std::size_t i = SlabSize; i > 0; --i)
+        {
+            slab[i - 1].m_next = m_freeList;
+            m_freeList = &slab[i - 1];
+        }
+    }
+
+    void release(Slot* slot)
+    {
+        auto poolLock = std::lock_guard(m_poolMutex);
+        slot->m_next = m_freeList;
+        m_freeList = slot;
+        --m_size;
+    }
+
+    mutable std::mutex m_poolMutex;
+    std::vector<std::unique_ptr<Slot[]>> m_slabs;
+    Slot* m_freeList = nullptr;
+    std::size_t m_size = 0;
+};
+
+} //namespace ftp::details
+
+#endif //FTP_SERVER_POLL_SLABPOOL_H
@@ -0,0 +1,128 @@
+#ifndef FTP_SERVER_POLL_STORAGE_H
+#define FTP_SERVER_POLL_STORAGE_H
+
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <cstdint>
+#include <sys/stat.h>
+
+namespace ftp {
+
+namespace details {
+
+// Маска атрибутов, которые хранилище заполняет в statx для листингов и команд SIZE/MDTM/MLST
+constexpr unsigned listingStatxMask =
+        STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_MTIME | STATX_INO | STATX_SIZE;
+
+} //namespace details
+
+// Хранилище файлов, которые отдает и принимает сервер.
+// Пути - те, что сервер получает, разрешая имена относительно корня: сам корень и пути внутри него.
+// Методы, которые не смогли выполнить операцию, возвращают nullptr, false или -1 и оставляют код ошибки в errno.
+// Все методы могут вызываться из нескольких потоков одновременно; открытые объекты - из одного потока за раз
+class Storage
+{
+public:
+    // Файл, открытый для чтения
+    class Reader
+    {
+    public:
+        virtual ~Reader() = default;
+
+        // Читает в out данные файла, начиная с позиции offset.
+        // Возвращает количество прочитанных байт, 0 в конце файла и -1 при ошибке
+        virtual int read(std::span<char> out, std::uint64_t offset) = 0;
+
+        // Атрибуты открытого файла
+        virtual bool attributes(struct statx& attributes) = 0;
+
+        // Все содержимое файла, если хранилище держит его в памяти целиком, иначе пустой span.
+        // Данные не меняются и живут, пока жив объект
+        virtual std::span<const char> contents() const
+        {
+            return {};
+        }
+    };
+
+    // Файл, открытый для записи с начала
+    class Writer
+    {
+    public:
+        // Запись, не завершенная close(), может остаться частичной или не появиться вовсе - в зависимости от хранилища
+        virtual ~Writer() = default;
+
+        // Дописывает data целиком; возвращает количество записанных байт либо -1 при ошибке
+        virtual int write(std::span<const char> data) = 0;
+
+        // Завершает запись и делает файл видимым для чтения
+        virtual bool close() = 0;
+    };
+
+    // Элементы каталога по одному
+    class DirectoryReader
+    {
+    public:
+        struct Entry
+        {
+            std::string_view m_name;
+            struct statx m_attributes;
+            std::string_view m_linkTarget; // Цель символической ссылки, если элемент - ссылка и ее удалось прочитать
+        };
+
+        virtual ~DirectoryReader() = default;
+
+        // Заполняет entry очередным элементом, включая скрытые. Строки в entry действительны до следующего вызова.
+        // Возвращает false, когда элементы закончились; при ошибке hasError() возвращает true
+        virtual bool next(Entry& entry) = 0;
+
+        virtual bool hasError() const = 0;
+    };
+
+    // Копирование файла внутри хранилища, выполняемое порциями
+    class Copier
+    {
+    public:
+        // Копия, не завершенная close(), может остаться частичной или не появиться вовсе - в зависимости от хранилища
+        virtual ~Copier() = default;
+
+        // Размер копируемого файла на момент начала копирования
+        virtual std::uint64_t size() const = 0;
+
+        // Копирует очередную порцию не больше maxBytes.
+        // Возвращает количество скопированных байт, 0 по окончании копирования и -1 при ошибке
+        virtual std::int64_t step(std::uint64_t maxBytes) = 0;
+
+        // Завершает копирование и делает копию видимой для чтения
+        virtual bool close() = 0;
+    };
+
+    virtual ~Storage() = default;
+
+    // Открывает обычный файл для чтения
+    virtual std::unique_ptr<Reader> openRead(const std::filesystem::path& path) = 0;
+
+    // Открывает файл для записи, создавая его или обрезая существующий
+    virtual std::unique_ptr<Writer> openWrite(const std::filesystem::path& path) = 0;
+
+    // Атрибуты элемента; для символической ссылки - самой ссылки, если не задан followSymlinks
+    virtual bool stat(const std::filesystem::path& path, struct statx& attributes, bool followSymlinks = false) = 0;
+
+    // Открывает каталог для перечисления элементов
+    virtual std::unique_ptr<DirectoryReader> list(const std::filesystem::path& directory) = 0;
+
+    virtual bool rename(const std::filesystem::path& from, const std::filesystem::path& to) = 0;
+
+    // Начинает копирование обычного файла from в файл to, создавая его или обрезая существующий.
+    // По умолчанию данные проходят через Reader и Writer; хранилища, которые умеют копировать
+    // без передачи данных через процесс, переопределяют метод
+    virtual std::unique_ptr<Copier> copy(const std::filesystem::path& from, const std::filesystem::path& to);
+
+    // Содержимое уже находится в памяти: кэши содержимого и листингов для такого хранилища не нужны
+    virtual bool isMemoryResident() const = 0;
+};
+
+} //namespace ftp
+
+#endif //FTP_SERVER_POLL_STORAGE_H
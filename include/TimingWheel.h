@@ -0,0 +1,68 @@
+#ifndef FTP_SERVER_POLL_TIMINGWHEEL_H
+#define FTP_SERVER_POLL_TIMINGWHEEL_H
+
+#include <PollMessageEngine.h>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace ftp::details {
+
+// Грубые таймеры для большого количества сессий.
+// Время делится на такты длиной resolution, ячейка колеса хранит таймеры своих тактов
+// по модулю количества ячеек; постановка таймера - одна вставка в вектор,
+// а продвижение колеса просматривает только ячейки прошедших тактов.
+// Колесо не имеет собственного потока: его продвигает владелец вызовами advance()
+class TimingWheel
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TimingWheel(Clock::duration resolution, std::size_t slotCount = 512);
+
+    // Вызывает callback со значением 0 не раньше deadline
+    // и не позже, чем через такт после него, если advance() вызывается каждый такт.
+    // Возвращает такт таймера, по которому его можно снять
+    std::uint64_t schedule(Clock::time_point deadline, std::shared_ptr<messaging::CallbackType> callback);
+
+    // Снимает таймер с коллбеком callback, поставленный на такт tick, если он еще не сработал
+    void cancel(std::uint64_t tick, const std::shared_ptr<messaging::CallbackType>& callback);
+
+    // Вызывает коллбеки всех таймеров, срок которых наступил к моменту now.
+    // Коллбеки вызываются вне блокировки и могут ставить новые таймеры
+    void advance(Clock::time_point now);
+
+    Clock::duration resolution() const
+    {
+        return m_resolution;
+    }
+
+    std::size_t size() const
+    {
+        auto wheelLock = std::lock_guard(m_wheelMutex);
+        return m_size;
+    }
+
+private:
+    struct Entry
+    {
+        std::uint64_t m_tick;
+        std::shared_ptr<messaging::CallbackType> m_callback;
+    };
+
+    std::uint64_t tickOf(Clock::time_point time) const
+    {
+        return (time - m_start) / m_resolution;
+    }
+
+    Clock::duration m_resolution;
+    Clock::time_point m_start = Clock::now();
+    mutable std::mutex m_wheelMutex;
+    std::vector<std::vector<Entry>> m_slots;
+    std::uint64_t m_currentTick = 0; // Последний обработанный такт
+    std::size_t m_size = 0;
+};
+
+} //namespace ftp::details
+
+#endif //FTP_SERVER_POLL_TIMINGWHEEL_H
@@ -0,0 +1,88 @@
+#ifndef FTP_SERVER_POLL_TRACING_H
+#define FTP_SERVER_POLL_TRACING_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace ftp::tracing {
+
+// Трассировка этапов сессий для просмотра в chrome://tracing или Perfetto.
+// Интервалы пишутся в кольцевой буфер своего потока без блокировок; когда буфер заполнен,
+// новые интервалы вытесняют самые старые. Метки времени - счетчик тактов процессора,
+// в микросекунды они переводятся только при выгрузке.
+// Выключенная трассировка стоит одной relaxed-загрузки флага на точку измерения
+
+using Timestamp = std::uint64_t;
+
+inline std::atomic_bool s_isEnabled = false;
+
+inline bool isEnabled()
+{
+    return s_isEnabled.load(std::memory_order_relaxed);
+}
+
+void enable(bool isEnabled);
+
+inline Timestamp now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Метка начала интервала; 0, если трассировка выключена - такой интервал не записывается
+inline Timestamp start()
+{
+    return isEnabled() ? now() : 0;
+}
+
+// Интервал от start до текущего момента, целиком прошедший в этом потоке; при start == 0 ничего не пишется.
+// name должен быть строковым литералом; verb - имя команды, упакованное в число, или 0
+void complete(const char* name, Timestamp start, std::uint64_t id = 0, std::uint32_t verb = 0);
+
+// Интервал от start до текущего момента, который мог начаться в другом потоке или в другом обработчике;
+// интервалы с одинаковыми name и id показываются на одной дорожке
+void async(const char* name, Timestamp start, std::uint64_t id);
+
+// Записывает интервал от создания до уничтожения объекта
+class Span
+{
+public:
+    explicit Span(const char* name, std::uint64_t id = 0, std::uint32_t verb = 0)
+    : m_name(name)
+    , m_id(id)
+    , m_verb(verb)
+    , m_start(start()) {}
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+    ~Span()
+    {
+        if (m_start != 0)
+            complete(m_name, m_start, m_id, m_verb);
+    }
+
+private:
+    const char* m_name;
+    std::uint64_t m_id;
+    std::uint32_t m_verb;
+    Timestamp m_start;
+};
+
+// Имя текущего потока в выгрузке
+void setThreadName(std::string_view name);
+
+// Дописывает в out все интервалы из буферов потоков в формате Chrome trace JSON
+void exportChromeTrace(std::string& out);
+
+} //namespace ftp::tracing
+
+#endif //FTP_SERVER_POLL_TRACING_H
@@ -0,0 +1,36 @@
+#include <AdmissionControl.h>
+
+namespace ftp {
+
+AdmissionControl::Verdict AdmissionControl::admit(in_addr_t peer)
+{
+    auto sessionsLock = std::lock_guard(m_sessionsMutex);
+    if (m_maxSessions > 0 && m_sessionCount.load(std::memory_order_relaxed) >= m_maxSessions)
+    {
+        m_rejected.fetch_add(1, std::memory_order_relaxed);
+        return Verdict::TooManySessions;
+    }
+    auto &addressSessions = m_sessionsPerAddress[peer];
+    if (m_maxSessionsPerAddress > 0 && addressSessions >= m_maxSessionsPerAddress)
+    {
+        m_rejected.fetch_add(1, std::memory_order_relaxed);
+        return Verdict::TooManySessionsFromAddress;
+    }
+    ++addressSessions;
+    m_sessionCount.fetch_add(1, std::memory_order_relaxed);
+    return Verdict::Admitted;
+}
+
+void AdmissionControl::release(in_addr_t peer)
+{
+    auto sessionsLock = std::lock_guard(m_sessionsMutex);
+    auto addressIterator = m_sessionsPerAddress.find(peer);
+    if (addressIterator == m_sessionsPerAddress.end())
+        return;
+    // Записи об адресах без сессий удаляются, чтобы таблица не росла с каждым новым клиентом
+    if (--addressIterator->second == 0)
+        m_sessionsPerAddress.erase(addressIterator);
+    m_sessionCount.fetch_sub(1, std::memory_order_relaxed);
+}
+
+} //namespace ftp
@@ -0,0 +1,252 @@
+#include <AuditLog.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <ctime>
+#include <system_error>
+
+namespace ftp {
+
+namespace {
+
+std::atomic_uint64_t s_nextGeneration = 1;
+
+int openLog(const std::filesystem::path& path)
+{
+    if (path.empty())
+        return -1;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (fd < 0)
+        throw std::system_error(errno, std::system_category(), "Log file " + path.string());
+    return fd;
+}
+
+void writeAll(int fd, std::string& batch)
+{
+    std::size_t offset = 0;
+    while (offset < batch.size())
+    {
+        auto res = write(fd, batch.data() + offset, batch.size() - offset);
+        if (res < 0 && errno == EINTR)
+            continue;
+        // Журнал не должен останавливать сервер: при ошибке записи пачка теряется
+        if (res <= 0)
+            break;
+        offset += res;
+    }
+    batch.clear();
+}
+
+void appendPeer(std::string& out, in_addr_t peer)
+{
+    char text[INET_ADDRSTRLEN];
+    in_addr address{peer};
+    out.append(inet_ntop(AF_INET, &address, text, sizeof text));
+}
+
+// Аргумент приходит от клиента, поэтому кавычки и управляющие символы экранируются,
+// чтобы клиент не мог подделать строки журнала
+void appendQuoted(std::string& out, std::string_view text)
+{
+    static constexpr char hex[] = "0123456789abcdef";
+    for (unsigned char c: text)
+    {
+        if (c == '"' || c == '\\')
+            out.append({'\\', static_cast<char>(c)});
+        else if (c < 0x20 || c == 0x7f)
+            out.append({'\\', 'x', hex[c >> 4], hex[c & 0xf]});
+        else
+            out.push_back(static_cast<char>(c));
+    }
+}
+
+} //namespace
+
+// Кольцо, закрепленное за потоком; при завершении потока кольцо передается писателю на дочитывание
+struct AuditLog::LocalRing
+{
+    std::uint64_t m_generation = 0;
+    std::shared_ptr<Ring> m_ring;
+
+    ~LocalRing()
+    {
+        if (m_ring)
+            m_ring->m_isOrphaned.store(true, std::memory_order_release);
+    }
+};
+
+void AuditLog::Record::setCommand(std::string_view verb, std::string_view argument)
+{
+    // Имя команды приводится к верхнему регистру, чтобы строки журнала можно было искать по нему
+    auto verbLength = std::min(verb.size(), sizeof m_verb);
+    std::transform(verb.begin(), verb.begin() + verbLength, m_verb, [](char c) { return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c; });
+    std::memset(m_verb + verbLength, 0, sizeof m_verb - verbLength);
+    m_argumentLength = static_cast<std::uint8_t>(std::min(argument.size(), maxArgumentLength));
+    std::memcpy(m_argument, argument.data(), m_argumentLength);
+}
+
+AuditLog::AuditLog(
+        const std::filesystem::path& transferLogPath, const std::filesystem::path& accessLogPath,
+        std::chrono::milliseconds flushInterval)
+: m_generation(s_nextGeneration.fetch_add(1))
+, m_flushInterval(flushInterval)
+{
+    m_transferLogFd = openLog(transferLogPath);
+    try
+    {
+        m_accessLogFd = openLog(accessLogPath);
+    } catch (...)
+    {
+        if (m_transferLogFd >= 0)
+            close(m_transferLogFd);
+        throw;
+    }
+    m_writer = std::thread([this]() { run(); });
+}
+
+AuditLog::~AuditLog()
+{
+    {
+        auto writerLock = std::lock_guard(m_writerMutex);
+        m_isStopping = true;
+    }
+    m_writerCondition.notify_one();
+    m_writer.join();
+    if (m_transferLogFd >= 0)
+        close(m_transferLogFd);
+    if (m_accessLogFd >= 0)
+        close(m_accessLogFd);
+}
+
+AuditLog::Ring& AuditLog::localRing()
+{
+    thread_local LocalRing local;
+    if (local.m_generation != m_generation)
+    {
+        // Первая запись потока в этот журнал; кольцо прежнего журнала, если было, больше не пополняется
+        if (local.m_ring)
+            local.m_ring->m_isOrphaned.store(true, std::memory_order_release);
+        local.m_ring = std::make_shared<Ring>();
+        local.m_generation = m_generation;
+        auto ringsLock = std::lock_guard(m_ringsMutex);
+        m_rings.push_back(local.m_ring);
+    }
+    return *local.m_ring;
+}
+
+void AuditLog::append(const Record& record)
+{
+    auto &ring = localRing();
+    auto tail = ring.m_tail.load(std::memory_order_relaxed);
+    if (tail - ring.m_head.load(std::memory_order_acquire) == ringCapacity)
+    {
+        ring.m_dropped.store(ring.m_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    ring.m_records[tail & (ringCapacity - 1)] = record;
+    ring.m_tail.store(tail + 1, std::memory_order_release);
+}
+
+std::uint64_t AuditLog::dropped() const
+{
+    auto ringsLock = std::lock_guard(m_ringsMutex);
+    auto dropped = m_retiredDropped.load(std::memory_order_relaxed);
+    for (const auto &ring: m_rings)
+        dropped += ring->m_dropped.load(std::memory_order_relaxed);
+    return dropped;
+}
+
+void AuditLog::format(const Record& record)
+{
+    auto time = std::chrono::system_clock::to_time_t(record.m_time);
+    tm calendarTime;
+    char timeText[64];
+    if (m_accessLogFd >= 0)
+    {
+        // Время в UTC с микросекундами, затем адрес, пользователь, вид записи, команда, код, байты, микросекунды
+        gmtime_r(&time, &calendarTime);
+        auto timeLength = strftime(timeText, sizeof timeText, "%Y-%m-%dT%H:%M:%S", &calendarTime);
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(record.m_time.time_since_epoch()).count() % 1000000;
+        timeLength += snprintf(timeText + timeLength, sizeof timeText - timeLength, ".%06lldZ ", static_cast<long long>(micros));
+        m_accessBatch.append(timeText, timeLength);
+        appendPeer(m_accessBatch, record.m_peer);
+        m_accessBatch.append(record.m_isAuthenticated ? " anonymous " : " - ");
+        m_accessBatch.append(record.m_kind == Record::Kind::Command ? "command \"" : "transfer \"");
+        appendQuoted(m_accessBatch, record.verb());
+        if (record.m_argumentLength > 0)
+        {
+            m_accessBatch.push_back(' ');
+            appendQuoted(m_accessBatch, record.argument());
+        }
+        m_accessBatch.append("\" ").append(std::to_string(record.m_code))
+                     .append(" ").append(std::to_string(record.m_bytes))
+                     .append(" ").append(std::to_string(record.m_duration.count())).append("\n");
+    }
+    bool isFileTransfer = record.m_kind == Record::Kind::Transfer && (record.verb() == "RETR" || record.verb() == "STOR");
+    if (m_transferLogFd >= 0 && isFileTransfer)
+    {
+        // Формат xferlog: время, секунды передачи, адрес, байты, файл, тип, флаг обработки, направление,
+        // режим доступа, пользователь, служба, метод аутентификации, идентификатор, состояние завершения
+        localtime_r(&time, &calendarTime);
+        auto timeLength = strftime(timeText, sizeof timeText, "%a %b %e %H:%M:%S %Y ", &calendarTime);
+        m_transferBatch.append(timeText, timeLength);
+        auto seconds = std::max<std::int64_t>(1, std::chrono::ceil<std::chrono::seconds>(record.m_duration).count());
+        m_transferBatch.append(std::to_string(seconds)).append(" ");
+        appendPeer(m_transferBatch, record.m_peer);
+        m_transferBatch.append(" ").append(std::to_string(record.m_bytes)).append(" ");
+        // Поля разделены пробелами, поэтому пробелы в имени файла заменяются, как это делают другие серверы
+        auto fileStart = m_transferBatch.size();
+        appendQuoted(m_transferBatch, record.argument());
+        std::replace(m_transferBatch.begin() + fileStart, m_transferBatch.end(), ' ', '_');
+        m_transferBatch.append({' ', record.m_transferType, ' ', '_', ' ', record.verb() == "RETR" ? 'o' : 'i'});
+        m_transferBatch.append(" a anonymous ftp 0 * ");
+        m_transferBatch.append(record.m_code == 226 || record.m_code == 250 ? "c\n" : "i\n");
+    }
+}
+
+void AuditLog::drain()
+{
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        auto ringsLock = std::lock_guard(m_ringsMutex);
+        rings = m_rings;
+    }
+    std::uint64_t written = 0;
+    for (auto &ring: rings)
+    {
+        // Признак завершения потока читается до хвоста: тогда прочитанный хвост - окончательный
+        bool isOrphaned = ring->m_isOrphaned.load(std::memory_order_acquire);
+        auto head = ring->m_head.load(std::memory_order_relaxed);
+        auto tail = ring->m_tail.load(std::memory_order_acquire);
+        for (auto position = head; position != tail; ++position)
+            format(ring->m_records[position & (ringCapacity - 1)]);
+        ring->m_head.store(tail, std::memory_order_release);
+        written += tail - head;
+        if (isOrphaned)
+        {
+            auto ringsLock = std::lock_guard(m_ringsMutex);
+            m_retiredDropped.fetch_add(ring->m_dropped.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            std::erase(m_rings, ring);
+        }
+    }
+    if (!m_transferBatch.empty())
+        writeAll(m_transferLogFd, m_transferBatch);
+    if (!m_accessBatch.empty())
+        writeAll(m_accessLogFd, m_accessBatch);
+    m_written.fetch_add(written, std::memory_order_relaxed);
+}
+
+void AuditLog::run()
+{
+    auto writerLock = std::unique_lock(m_writerMutex);
+    while (!m_isStopping)
+    {
+        m_writerCondition.wait_for(writerLock, m_flushInterval, [this]() { return m_isStopping; });
+        writerLock.unlock();
+        drain();
+        writerLock.lock();
+    }
+}
+
+} //namespace ftp
@@ -0,0 +1,71 @@
+#include <BandwidthLimiter.h>
+#include <algorithm>
+
+namespace ftp {
+
+std::chrono::nanoseconds TokenBucket::consume(std::size_t bytes, std::uint64_t bytesPerSecond, Clock::time_point now)
+{
+    if (bytesPerSecond == 0)
+    {
+        // Без ограничения корзина остается полной, чтобы включенное позже ограничение не наказывало за прошлое
+        m_lastRefill = {};
+        return std::chrono::nanoseconds::zero();
+    }
+    auto rate = static_cast<double>(bytesPerSecond);
+    // Запас ограничен десятой долей секунды передачи, чтобы простой не давал длинных всплесков
+    auto burst = std::max(rate / 10, minBurst);
+    if (m_lastRefill == Clock::time_point{})
+        m_tokens = burst;
+    else
+        m_tokens = std::min(burst, m_tokens + std::chrono::duration<double>(now - m_lastRefill).count() * rate);
+    m_lastRefill = now;
+    m_tokens -= static_cast<double>(bytes);
+    if (m_tokens >= 0)
+        return std::chrono::nanoseconds::zero();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(-m_tokens / rate));
+}
+
+BandwidthLimiter::UserClass* BandwidthLimiter::userClass(std::string_view name)
+{
+    auto classLock = std::lock_guard(m_classMutex);
+    auto &entry = m_classes[std::string(name)];
+    if (!entry)
+        entry = std::make_unique<UserClass>();
+    return entry.get();
+}
+
+void BandwidthLimiter::setGlobalLimit(std::uint64_t bytesPerSecond)
+{
+    updateLimit(m_globalBytesPerSecond, bytesPerSecond);
+}
+
+void BandwidthLimiter::setSessionLimit(std::uint64_t bytesPerSecond)
+{
+    updateLimit(m_sessionBytesPerSecond, bytesPerSecond);
+}
+
+void BandwidthLimiter::setClassLimit(std::string_view name, std::uint64_t bytesPerSecond)
+{
+    updateLimit(userClass(name)->m_bytesPerSecond, bytesPerSecond);
+}
+
+void BandwidthLimiter::updateLimit(std::atomic_uint64_t &limit, std::uint64_t bytesPerSecond)
+{
+    auto previous = limit.exchange(bytesPerSecond);
+    m_limitCount.fetch_add((bytesPerSecond != 0) - (previous != 0));
+}
+
+std::chrono::nanoseconds BandwidthLimiter::consume(TokenBucket &session, UserClass *userClass, std::size_t bytes)
+{
+    if (!isLimited())
+        return std::chrono::nanoseconds::zero();
+    auto now = TokenBucket::Clock::now();
+    auto delay = session.consume(bytes, m_sessionBytesPerSecond.load(std::memory_order_relaxed), now);
+    auto bucketLock = std::lock_guard(m_bucketMutex);
+    delay = std::max(delay, m_globalBucket.consume(bytes, m_globalBytesPerSecond.load(std::memory_order_relaxed), now));
+    if (userClass)
+        delay = std::max(delay, userClass->m_bucket.consume(bytes, userClass->m_bytesPerSecond.load(std::memory_order_relaxed), now));
+    return delay;
+}
+
+} //namespace ftp
@@ -0,0 +1,70 @@
+#include <CpuAffinity.h>
+#include <charconv>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+namespace ftp::details {
+
+std::optional<std::vector<int>> parseCpuList(std::string_view list)
+{
+    std::vector<int> cpus;
+    while (!list.empty())
+    {
+        auto rangeEnd = list.find(',');
+        auto range = list.substr(0, rangeEnd);
+        list = rangeEnd == std::string_view::npos ? std::string_view() : list.substr(rangeEnd + 1);
+
+        int first = -1, last = -1;
+        auto [firstEnd, firstError] = std::from_chars(range.data(), range.data() + range.size(), first);
+        if (firstError != std::errc() || first < 0 || first >= CPU_SETSIZE)
+            return std::nullopt;
+        last = first;
+        if (firstEnd != range.data() + range.size())
+        {
+            if (*firstEnd != '-')
+                return std::nullopt;
+            auto [lastEnd, lastError] = std::from_chars(firstEnd + 1, range.data() + range.size(), last);
+            if (lastError != std::errc() || lastEnd != range.data() + range.size() || last < first || last >= CPU_SETSIZE)
+                return std::nullopt;
+        }
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    if (cpus.empty())
+        return std::nullopt;
+    return cpus;
+}
+
+bool isCpuAvailable(int cpu)
+{
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    return cpu >= 0 && cpu < CPU_SETSIZE
+            && sched_getaffinity(0, sizeof cpuSet, &cpuSet) == 0
+            && CPU_ISSET(cpu, &cpuSet);
+}
+
+bool pinCurrentThread(std::span<const int> cpus)
+{
+    if (cpus.empty())
+        return true;
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for (int cpu: cpus)
+        CPU_SET(cpu, &cpuSet);
+    return pthread_setaffinity_np(pthread_self(), sizeof cpuSet, &cpuSet) == 0;
+}
+
+int incomingCpu(int fd)
+{
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t len = sizeof cpu;
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+        return cpu;
+#endif
+    return -1;
+}
+
+} //namespace ftp::details
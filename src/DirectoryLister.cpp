@@ -0,0 +1,181 @@
+#include <DirectoryLister.h>
+#include <cstring>
+#include <ctime>
+#include <cstdio>
+
+namespace ftp::details {
+
+namespace {
+
+// Записывает в out строку прав доступа вида "drwxr-xr-x"
+void formatMode(mode_t mode, char* out)
+{
+    switch (mode & S_IFMT)
+    {
+        case S_IFDIR:  out[0] = 'd'; break;
+        case S_IFLNK:  out[0] = 'l'; break;
+        case S_IFCHR:  out[0] = 'c'; break;
+        case S_IFBLK:  out[0] = 'b'; break;
+        case S_IFIFO:  out[0] = 'p'; break;
+        case S_IFSOCK: out[0] = 's'; break;
+        default:       out[0] = '-'; break;
+    }
+    out[1] = mode & S_IRUSR ? 'r' : '-';
+    out[2] = mode & S_IWUSR ? 'w' : '-';
+    out[3] = mode & S_ISUID ? (mode & S_IXUSR ? 's' : 'S') : (mode & S_IXUSR ? 'x' : '-');
+    out[4] = mode & S_IRGRP ? 'r' : '-';
+    out[5] = mode & S_IWGRP ? 'w' : '-';
+    out[6] = mode & S_ISGID ? (mode & S_IXGRP ? 's' : 'S') : (mode & S_IXGRP ? 'x' : '-');
+    out[7] = mode & S_IROTH ? 'r' : '-';
+    out[8] = mode & S_IWOTH ? 'w' : '-';
+    out[9] = mode & S_ISVTX ? (mode & S_IXOTH ? 't' : 'T') : (mode & S_IXOTH ? 'x' : '-');
+    out[10] = '\0';
+}
+
+} //namespace
+
+DirectoryLister::DirectoryLister(std::unique_ptr<Storage::DirectoryReader> entries, ListingFormat format)
+: m_entries(std::move(entries)), m_format(format)
+{}
+
+int DirectoryLister::read(std::span<char> out)
+{
+    std::size_t written = 0;
+    while (true)
+    {
+        if (m_lineLen == 0 && !formatNextEntry())
+            break;
+        if (written + m_lineLen > out.size())
+            break;
+        std::memcpy(out.data() + written, m_line, m_lineLen);
+        written += m_lineLen;
+        m_lineLen = 0;
+    }
+    if (written == 0 && m_entries->hasError())
+        return -1;
+    return static_cast<int>(written);
+}
+
+bool DirectoryLister::formatNextEntry()
+{
+    Storage::DirectoryReader::Entry entry;
+    while (!m_isFinished)
+    {
+        if (!m_entries->next(entry))
+        {
+            m_isFinished = true;
+            return false;
+        }
+        if (entry.m_name.empty() || entry.m_name == "." || entry.m_name == "..")
+            continue;
+        // Как и "ls -l", скрытые элементы не показываем; в MLSD они нужны программам зеркалирования
+        if (m_format != ListingFormat::Machine && entry.m_name[0] == '.')
+            continue;
+        if (m_format == ListingFormat::Machine)
+            formatMachineEntry(entry);
+        else
+            formatLongListEntry(entry);
+        if (m_lineLen != 0)
+            return true;
+    }
+    return false;
+}
+
+void DirectoryLister::formatLongListEntry(const Storage::DirectoryReader::Entry &entry)
+{
+    auto &st = entry.m_attributes;
+    char mode[11];
+    formatMode(st.stx_mode, mode);
+
+    // Как и ls, для файлов старше полугода вместо времени выводим год
+    char date[16];
+    tm localTime;
+    time_t mtime = st.stx_mtime.tv_sec;
+    localtime_r(&mtime, &localTime);
+    constexpr time_t halfYear = 60 * 60 * 24 * 365 / 2;
+    auto now = time(nullptr);
+    strftime(date, sizeof date,
+             mtime > now - halfYear && mtime < now + halfYear ? "%b %e %H:%M" : "%b %e  %Y",
+             &localTime);
+
+    int len = snprintf(
+            m_line, sizeof m_line, "%s %3u %5u %5u %10llu %s %.*s",
+            mode,
+            static_cast<unsigned>(st.stx_nlink),
+            static_cast<unsigned>(st.stx_uid),
+            static_cast<unsigned>(st.stx_gid),
+            static_cast<unsigned long long>(st.stx_size),
+            date,
+            static_cast<int>(entry.m_name.size()),
+            entry.m_name.data());
+    if (len < 0 || static_cast<std::size_t>(len) >= sizeof m_line - 2)
+        return;
+
+    if (S_ISLNK(st.stx_mode) && !entry.m_linkTarget.empty())
+    {
+        // Для символических ссылок, как и ls, дописываем цель
+        constexpr std::size_t arrowLen = 4;
+        std::size_t room = sizeof m_line - len - arrowLen - 2;
+        if (entry.m_linkTarget.size() < room)
+        {
+            std::memcpy(m_line + len, " -> ", arrowLen);
+            std::memcpy(m_line + len + arrowLen, entry.m_linkTarget.data(), entry.m_linkTarget.size());
+            len += static_cast<int>(arrowLen + entry.m_linkTarget.size());
+        }
+    }
+    m_line[len++] = '\r';
+    m_line[len++] = '\n';
+    m_lineLen = len;
+}
+
+void DirectoryLister::formatMachineEntry(const Storage::DirectoryReader::Entry &entry)
+{
+    auto len = formatMachineFacts(entry.m_attributes, m_line);
+    if (len == 0 || len + entry.m_name.size() + 2 > sizeof m_line)
+        return;
+    std::memcpy(m_line + len, entry.m_name.data(), entry.m_name.size());
+    len += entry.m_name.size();
+    m_line[len++] = '\r';
+    m_line[len++] = '\n';
+    m_lineLen = len;
+}
+
+std::size_t formatMachineTime(const struct statx_timestamp &time, std::span<char> out)
+{
+    tm utcTime;
+    time_t seconds = time.tv_sec;
+    gmtime_r(&seconds, &utcTime);
+    return strftime(out.data(), out.size(), "%Y%m%d%H%M%S", &utcTime);
+}
+
+std::size_t formatMachineFacts(const struct statx &st, std::span<char> out)
+{
+    // Права перечислены с точки зрения этого сервера:
+    // файлы можно скачивать и перезаписывать, каталоги - только просматривать,
+    // а по символическим ссылкам хранилище не переходит
+    const char *type = "OS.unix=special", *perm = "";
+    switch (st.stx_mode & S_IFMT)
+    {
+        case S_IFREG: type = "file"; perm = "rw"; break;
+        case S_IFDIR: type = "dir"; perm = "l"; break;
+        case S_IFLNK: type = "OS.unix=symlink"; break;
+        default: break;
+    }
+    char modify[16];
+    if (formatMachineTime(st.stx_mtime, modify) == 0)
+        return 0;
+    int len = snprintf(
+            out.data(), out.size(), "type=%s;size=%llu;modify=%s;perm=%s;unique=%xU%xU%llx; ",
+            type,
+            static_cast<unsigned long long>(st.stx_size),
+            modify,
+            perm,
+            st.stx_dev_major,
+            st.stx_dev_minor,
+            static_cast<unsigned long long>(st.stx_ino));
+    if (len < 0 || static_cast<std::size_t>(len) >= out.size())
+        return 0;
+    return len;
+}
+
+} //namespace ftp::details
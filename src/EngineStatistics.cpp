@@ -0,0 +1,74 @@
+#include <EngineStatistics.h>
+#include <bit>
+#include <iomanip>
+
+namespace messaging {
+
+std::uint64_t HistogramSnapshot::quantile(double quantile) const
+{
+    if (m_count == 0)
+        return 0;
+    auto rank = static_cast<std::uint64_t>(quantile * static_cast<double>(m_count - 1)) + 1;
+    std::uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < bucketCount; ++bucket)
+    {
+        seen += m_buckets[bucket];
+        if (seen >= rank)
+            return bucket == 0 ? 0 : (std::uint64_t(1) << bucket) - 1;
+    }
+    return (std::uint64_t(1) << (bucketCount - 1)) - 1;
+}
+
+void AtomicHistogram::record(std::uint64_t value)
+{
+    auto bucket = std::min<std::size_t>(std::bit_width(value), HistogramSnapshot::bucketCount - 1);
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+HistogramSnapshot AtomicHistogram::snapshot() const
+{
+    HistogramSnapshot snapshot;
+    for (std::size_t bucket = 0; bucket < HistogramSnapshot::bucketCount; ++bucket)
+        snapshot.m_buckets[bucket] = m_buckets[bucket].load(std::memory_order_relaxed);
+    snapshot.m_count = m_count.load(std::memory_order_relaxed);
+    snapshot.m_sum = m_sum.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+void AtomicHistogram::reset()
+{
+    for (auto &bucket: m_buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+}
+
+void EngineStatistics::dump(std::ostream& out) const
+{
+    std::pair<const char*, const HistogramSnapshot*> histograms[] = {
+            {"poll wait, us", &m_pollWait},
+            {"fds rebuild, us", &m_fdsRebuild},
+            {"ready dispatch, us", &m_readyDispatch},
+            {"ready per wakeup", &m_readyCount},
+            {"dispatch lag, us", &m_dispatchLag},
+            {"callback duration, us", &m_callbackDuration},
+    };
+    // Квантили выводятся как верхние границы ячеек
+    out << std::left << std::setw(24) << "histogram" << std::right
+        << std::setw(12) << "count" << std::setw(12) << "mean"
+        << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "p99.9" << '\n';
+    for (auto [name, histogram]: histograms)
+    {
+        out << std::left << std::setw(24) << name << std::right
+            << std::setw(12) << histogram->m_count
+            << std::setw(12) << (histogram->m_count ? histogram->m_sum / histogram->m_count : 0)
+            << std::setw(10) << histogram->quantile(0.5)
+            << std::setw(10) << histogram->quantile(0.9)
+            << std::setw(10) << histogram->quantile(0.99)
+            << std::setw(10) << histogram->quantile(0.999) << '\n';
+    }
+}
+
+} //namespace messaging
@@ -0,0 +1,157 @@
+#include <FileCache.h>
+
+namespace ftp {
+
+FileCache::FileCache(
+        const std::shared_ptr<FsWatcher> &watcher,
+        std::size_t maxBytes,
+        std::size_t maxFileSize,
+        std::size_t shardCount)
+: m_watcher(watcher)
+, m_maxShardBytes(maxBytes / std::max<std::size_t>(shardCount, 1))
+, m_maxFileSize(maxFileSize)
+, m_shards(std::max<std::size_t>(shardCount, 1))
+{
+    m_watcher->addListener(
+            [this](const std::filesystem::path &directory, std::string_view name)
+            {
+                invalidate(directory, name);
+            });
+}
+
+FileCache::Shard &FileCache::shardFor(const std::string &file)
+{
+    return m_shards[std::hash<std::string>()(file) % m_shards.size()];
+}
+
+FileCache::ContentType FileCache::find(const std::filesystem::path &file)
+{
+    auto &shard = shardFor(file.native());
+    auto shardLock = std::lock_guard(shard.m_mutex);
+    auto entryIterator = shard.m_entries.find(file.native());
+    if (entryIterator == shard.m_entries.end())
+    {
+        m_misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    m_hits.fetch_add(1, std::memory_order_relaxed);
+    shard.m_lru.splice(shard.m_lru.begin(), shard.m_lru, entryIterator->second);
+    return entryIterator->second->m_content;
+}
+
+FileCache::ContentType FileCache::load(const std::filesystem::path &file, Storage::Reader &reader)
+{
+    auto &shard = shardFor(file.native());
+    std::uint64_t generation;
+    {
+        auto shardLock = std::lock_guard(shard.m_mutex);
+        generation = shard.m_generation;
+    }
+    // Размер берется у открытого файла: слишком большой файл не читается и не наблюдается
+    struct statx before, after;
+    if (!reader.attributes(before) || before.stx_size > m_maxFileSize)
+        return nullptr;
+    // Наблюдение устанавливается до чтения файла, поэтому изменения во время чтения не теряются
+    int watch = m_watcher->watch(file.parent_path());
+    if (watch < 0)
+        return nullptr;
+
+    auto content = std::make_shared<Content>();
+    content->m_raw.resize(before.stx_size);
+    std::size_t offset = 0;
+    while (offset < content->m_raw.size())
+    {
+        auto res = reader.read(std::span(content->m_raw).subspan(offset), offset);
+        if (res <= 0)
+            break;
+        offset += res;
+    }
+    // Файл, изменившийся во время чтения, не кэшируем
+    bool isLoaded = offset == content->m_raw.size()
+            && reader.attributes(after)
+            && after.stx_size == before.stx_size
+            && after.stx_mtime.tv_sec == before.stx_mtime.tv_sec
+            && after.stx_mtime.tv_nsec == before.stx_mtime.tv_nsec;
+    if (!isLoaded)
+    {
+        m_watcher->unwatch(watch);
+        return nullptr;
+    }
+    content->m_ascii.reserve(content->m_raw.size());
+    for (char c: content->m_raw)
+    {
+        if (c == '\n')
+            content->m_ascii.push_back('\r');
+        content->m_ascii.push_back(c);
+    }
+
+    auto bytes = contentBytes(*content);
+    std::vector<int> releasedWatches;
+    {
+        auto shardLock = std::lock_guard(shard.m_mutex);
+        if (bytes > m_maxShardBytes || shard.m_generation != generation)
+            releasedWatches.push_back(watch);
+        else
+        {
+            if (auto entryIterator = shard.m_entries.find(file.native()); entryIterator != shard.m_entries.end())
+                erase(shard, entryIterator->second, releasedWatches);
+            // Вытесняем давно не использованные файлы
+            while (shard.m_bytes + bytes > m_maxShardBytes)
+                erase(shard, std::prev(shard.m_lru.end()), releasedWatches);
+            shard.m_lru.push_front(Entry{file.native(), content, watch});
+            shard.m_entries.emplace(file.native(), shard.m_lru.begin());
+            shard.m_bytes += bytes;
+        }
+    }
+    unwatch(releasedWatches);
+    return content;
+}
+
+void FileCache::invalidate(const std::filesystem::path &directory, std::string_view name)
+{
+    std::vector<int> releasedWatches;
+    if (!directory.empty() && !name.empty())
+    {
+        // Изменился конкретный файл - сбрасываем только его
+        auto file = (directory / name).native();
+        auto &shard = shardFor(file);
+        {
+            auto shardLock = std::lock_guard(shard.m_mutex);
+            ++shard.m_generation;
+            if (auto entryIterator = shard.m_entries.find(file); entryIterator != shard.m_entries.end())
+                erase(shard, entryIterator->second, releasedWatches);
+        }
+        unwatch(releasedWatches);
+        return;
+    }
+    // Изменился сам каталог или события были потеряны - сбрасываем всё, что могло устареть
+    for (auto &shard: m_shards)
+    {
+        auto shardLock = std::lock_guard(shard.m_mutex);
+        ++shard.m_generation;
+        for (auto entryIterator = shard.m_lru.begin(); entryIterator != shard.m_lru.end();)
+        {
+            auto nextIterator = std::next(entryIterator);
+            if (directory.empty() || std::filesystem::path(entryIterator->m_file).parent_path() == directory)
+                erase(shard, entryIterator, releasedWatches);
+            entryIterator = nextIterator;
+        }
+    }
+    unwatch(releasedWatches);
+}
+
+void FileCache::erase(Shard &shard, std::list<Entry>::iterator entryIterator, std::vector<int> &releasedWatches)
+{
+    shard.m_bytes -= contentBytes(*entryIterator->m_content);
+    releasedWatches.push_back(entryIterator->m_watch);
+    shard.m_entries.erase(entryIterator->m_file);
+    shard.m_lru.erase(entryIterator);
+}
+
+void FileCache::unwatch(const std::vector<int> &releasedWatches)
+{
+    for (int watch: releasedWatches)
+        m_watcher->unwatch(watch);
+}
+
+} //namespace ftp
@@ -0,0 +1,118 @@
+#include <FsWatcher.h>
+#include <system_error>
+
+namespace ftp {
+
+FsWatcher::FsWatcher(const std::shared_ptr<messaging::PollMessageEngine> &messageEngine)
+: m_inotifyFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), m_messageEngine(messageEngine)
+{
+    if (m_inotifyFd < 0)
+        throw std::system_error(errno, std::system_category());
+    readEvents();
+}
+
+FsWatcher::~FsWatcher()
+{
+    m_isAlive->store(false);
+    close(m_inotifyFd);
+}
+
+void FsWatcher::addListener(ListenerType listener)
+{
+    auto watchLock = std::lock_guard(m_watchMutex);
+    m_listeners.push_back(std::move(listener));
+}
+
+int FsWatcher::watch(const std::filesystem::path &directory)
+{
+    auto watchLock = std::lock_guard(m_watchMutex);
+    if (auto watchIterator = m_watches.find(directory.native()); watchIterator != m_watches.end())
+    {
+        ++m_directories[watchIterator->second].m_references;
+        return watchIterator->second;
+    }
+    int wd = inotify_add_watch(m_inotifyFd, directory.c_str(), watchMask | IN_ONLYDIR);
+    if (wd < 0)
+        return -1;
+    m_watches.emplace(directory.native(), wd);
+    m_directories.emplace(wd, Watch{directory, 1});
+    return wd;
+}
+
+void FsWatcher::unwatch(int watchDescriptor)
+{
+    auto watchLock = std::lock_guard(m_watchMutex);
+    auto directoryIterator = m_directories.find(watchDescriptor);
+    if (directoryIterator == m_directories.end() || --directoryIterator->second.m_references > 0)
+        return;
+    // Ядро выдает дескрипторы наблюдения по кругу, поэтому снятый дескриптор не достанется
+    // новому наблюдению сразу, и запоздавшие ссылки на него безвредны
+    m_watches.erase(directoryIterator->second.m_directory.native());
+    m_directories.erase(directoryIterator);
+    inotify_rm_watch(m_inotifyFd, watchDescriptor);
+}
+
+void FsWatcher::readEvents()
+{
+    auto aliveCriteria = m_isAlive;
+    m_messageEngine->async_read_some(
+            m_inotifyFd, m_eventBuffer, std::make_shared<messaging::CallbackType>(
+                    [this, aliveCriteria](int res)
+                    {
+                        if (!aliveCriteria->load())
+                            return;
+                        if (res <= 0)
+                        {
+                            // Дескриптор inotify больше не работает - дальнейшие изменения
+                            // не будут замечены, поэтому подписчики должны сбросить всё
+                            {
+                                auto watchLock = std::lock_guard(m_watchMutex);
+                                m_watches.clear();
+                                m_directories.clear();
+                            }
+                            notify({}, {});
+                            return;
+                        }
+                        for (int pos = 0; pos < res;)
+                        {
+                            auto *event = reinterpret_cast<const inotify_event *>(m_eventBuffer.data() + pos);
+                            pos += sizeof(inotify_event) + event->len;
+                            if (event->mask & IN_Q_OVERFLOW)
+                            {
+                                notify({}, {});
+                                continue;
+                            }
+                            std::filesystem::path directory;
+                            {
+                                auto watchLock = std::lock_guard(m_watchMutex);
+                                auto directoryIterator = m_directories.find(event->wd);
+                                if (directoryIterator == m_directories.end())
+                                    continue;
+                                directory = directoryIterator->second.m_directory;
+                                if (event->mask & IN_IGNORED)
+                                {
+                                    // Наблюдение снято ядром (каталог удален или перемещен)
+                                    m_watches.erase(directory.native());
+                                    m_directories.erase(directoryIterator);
+                                }
+                            }
+                            if (event->mask & IN_ISDIR && event->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+                            {
+                                // Удален или перемещен вложенный каталог: под старыми путями могли остаться
+                                // записи из всего его поддерева, поэтому подписчики сбрасывают всё
+                                notify({}, {});
+                                continue;
+                            }
+                            notify(directory, event->len > 0 ? std::string_view(event->name) : std::string_view());
+                        }
+                        readEvents();
+                    }));
+}
+
+void FsWatcher::notify(const std::filesystem::path &directory, std::string_view name)
+{
+    for (auto &listener: m_listeners)
+        listener(directory, name);
+}
+
+} //namespace ftp
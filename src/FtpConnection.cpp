@@ -1,4 +1,5 @@
 #include <FtpConnection.h>
+#include <utility>
 
 namespace ftp {
 
@@ -8,17 +9,18 @@ namespace details {
 namespace helpers {
 
 // Функция выбрасывает исключения при ошибках конструирования desiredPath и,
-// если desiredPath после нормализации содержит переходы вверх по дереву директорий,
-// выходящие за пределы каталога.
-// В случае, если всё хорошо, возвращает абсолютный путь относительно root.
-std::filesystem::path validatePath(const std::string &pathString)
+// если desiredPath после нормализации начинается с перехода вверх, выходящего за пределы корня.
+// Путь может вести во вложенные каталоги, ведущий "/" обозначает корень сервера.
+// Это лишь ранний отказ: выйти за корень не дает хранилище, разрешающее пути относительно него.
+// В случае, если всё хорошо, возвращает путь относительно корня (пустой для самого корня).
+std::filesystem::path validatePath(std::string_view pathString)
 {
-    std::filesystem::path desiredPath;
-    desiredPath = std::filesystem::path(pathString).lexically_normal();
-    std::string tmpPathString = desiredPath.string();
-    if (std::count(desiredPath.begin(), desiredPath.end(), std::filesystem::path("..")) != 0
-        || std::count(tmpPathString.begin(), tmpPathString.end(), '/') != 0)
+    auto desiredPath = std::filesystem::path(pathString).lexically_normal().relative_path();
+    // После нормализации ".." может остаться только в начале пути
+    if (!desiredPath.empty() && *desiredPath.begin() == "..")
         throw std::exception();
+    if (desiredPath == ".")
+        desiredPath.clear();
     return desiredPath;
 }
 
@@ -35,350 +37,888 @@ void setNonBlocking(int fd)
 
 } //namespace helpers
 
-// Пример для char_traits на cppreference
-struct ci_char_traits : public std::char_traits<char> {
-    static char to_upper(char ch) {
-        return std::toupper((unsigned char) ch);
-    }
-    static bool eq(char c1, char c2) {
-        return to_upper(c1) == to_upper(c2);
-    }
-    static bool lt(char c1, char c2) {
-        return to_upper(c1) <  to_upper(c2);
+constexpr char toUpperAscii(char c)
+{
+    return c >= 'a' && c <= 'z' ? static_cast<char>(c - 'a' + 'A') : c;
+}
+
+// Упаковывает имя команды из 3-4 латинских букв в число, приводя буквы к верхнему регистру.
+// Для строк, которые не могут быть именем команды, возвращает 0
+constexpr std::uint32_t packVerb(std::string_view verb)
+{
+    if (verb.size() < 3 || verb.size() > 4)
+        return 0;
+    std::uint32_t packedVerb = 0;
+    for (char c: verb)
+    {
+        c = toUpperAscii(c);
+        if (c < 'A' || c > 'Z')
+            return 0;
+        packedVerb = packedVerb << 8 | static_cast<std::uint8_t>(c);
     }
-    static int compare(const char* s1, const char* s2, std::size_t n) {
-        while ( n-- != 0 ) {
-            if ( to_upper(*s1) < to_upper(*s2) ) return -1;
-            if ( to_upper(*s1) > to_upper(*s2) ) return 1;
-            ++s1; ++s2;
-        }
+    return packedVerb;
+}
+
+static_assert(packVerb("retr") == packVerb("RETR") && packVerb("RETR") == 0x52455452);
+static_assert(packVerb("RE1R") == 0 && packVerb("RETRY") == 0);
+
+// Код ответа из трех первых цифр его строки; 0, если строка начинается не с кода
+constexpr std::uint16_t replyCode(std::string_view reply)
+{
+    if (reply.size() < 3)
         return 0;
+    std::uint16_t code = 0;
+    for (char c: reply.substr(0, 3))
+    {
+        if (c < '0' || c > '9')
+            return 0;
+        code = code * 10 + (c - '0');
     }
-    static const char* find(const char* s, std::size_t n, char a) {
-        auto const ua (to_upper(a));
-        while ( n-- != 0 )
+    return code;
+}
+
+static_assert(replyCode("250 Transfer complete\r\n") == 250 && replyCode("25") == 0);
+
+constexpr bool equalsIgnoreCase(std::string_view lhs, std::string_view rhs)
+{
+    return std::equal(
+            lhs.begin(), lhs.end(), rhs.begin(), rhs.end(),
+            [](char l, char r)
+            {
+                return toUpperAscii(l) == toUpperAscii(r);
+            });
+}
+
+}// namespace details
+
+// Таблица команд с идеальным хешированием, построенная на этапе компиляции:
+// упакованное имя команды умножается на подобранный множитель,
+// старшие биты произведения дают номер ячейки, в которой может лежать только эта команда.
+// Поиск обработчика - одно умножение, одно сравнение и косвенный вызов
+struct Connection::CommandTable
+{
+    static constexpr std::size_t slotBits = 6;
+
+    constexpr CommandTable(std::initializer_list<CommandEntry> commands)
+    {
+        for (m_multiplier = 0x9E3779B1u;; m_multiplier += 2)
         {
-            if (to_upper(*s) == ua)
-                return s;
-            s++;
+            m_slots = {};
+            bool isPerfect = true;
+            for (auto &command: commands)
+            {
+                auto &slot = m_slots[slotOf(command.m_verb)];
+                if (slot.m_verb != 0)
+                {
+                    isPerfect = false;
+                    break;
+                }
+                slot = command;
+            }
+            if (isPerfect)
+                return;
         }
-        return nullptr;
     }
-};
 
-using ci_string = std::basic_string<char, ci_char_traits>;
+    constexpr const CommandEntry* find(std::uint32_t verb) const
+    {
+        auto &slot = m_slots[slotOf(verb)];
+        return verb != 0 && slot.m_verb == verb ? &slot : nullptr;
+    }
+
+private:
+    constexpr std::size_t slotOf(std::uint32_t verb) const
+    {
+        return static_cast<std::uint32_t>(verb * m_multiplier) >> (32 - slotBits);
+    }
 
-}// namespace details
+    std::array<CommandEntry, 1 << slotBits> m_slots{};
+    std::uint32_t m_multiplier = 0;
+};
 
-void Connection::user(const std::string &username)
+constinit const Connection::CommandTable Connection::s_commandTable{
+        {details::packVerb("USER"), &Connection::handleUser, false},
+        {details::packVerb("QUIT"), &Connection::handleQuit, false},
+        {details::packVerb("NOOP"), &Connection::handleNoop, false},
+        {details::packVerb("FEAT"), &Connection::handleFeat, false},
+        {details::packVerb("TYPE"), &Connection::handleType, true},
+        {details::packVerb("MODE"), &Connection::handleMode, true},
+        {details::packVerb("STRU"), &Connection::handleStru, true},
+        {details::packVerb("RETR"), &Connection::handleRetr, true},
+        {details::packVerb("STOR"), &Connection::handleStor, true},
+        {details::packVerb("LIST"), &Connection::handleList, true},
+        {details::packVerb("MLSD"), &Connection::handleMlsd, true},
+        {details::packVerb("MLST"), &Connection::handleMlst, true},
+        {details::packVerb("SIZE"), &Connection::handleSize, true},
+        {details::packVerb("MDTM"), &Connection::handleMdtm, true},
+        {details::packVerb("PASV"), &Connection::handlePasv, true},
+        {details::packVerb("PWD"), &Connection::handlePwd, true},
+        {details::packVerb("SITE"), &Connection::handleSite, true},
+};
+
+void Connection::user(std::string_view username)
 {
-    details::ci_string ci_username(username.c_str());
-    if (ci_username == "anonymous")
+    if (details::equalsIgnoreCase(username, "anonymous"))
     {
         m_isAuthenticated = true;
-        reply("230 Log in successful");
+        m_userClass = m_context.m_bandwidthLimiter->userClass("anonymous");
+        reply(replies::loggedIn);
     }
     else
     {
         //Попытка повторной аутентификации после успешной также сбрасывает текущий статус аутентификации
         m_isAuthenticated = false;
-        reply("501 Incorrect user name");
+        m_userClass = nullptr;
+        reply(replies::incorrectUser);
     }
 }
 
 void Connection::quit()
 {
-    echo("221 Bye!");
-    killSelf();
+    // Соединение закрывается только после того, как прощание дошло до клиента
+    auto aliveCriteria = m_isAlive;
+    reply(replies::bye);
+    setReplyContinuation(
+            std::make_shared<messaging::CallbackType>(
+                    [this, aliveCriteria](int)
+                    {
+                        if(aliveCriteria->load())
+                            killSelf();
+                    }));
 }
 
 void Connection::type(RepresentationType representationType, Format format)
 {
-    if(representationType != RepresentationType::A || format != Format::N)
-        reply("504 Command not implemented for specified value");
+    if((representationType != RepresentationType::A && representationType != RepresentationType::I) || format != Format::N)
+        reply(replies::notImplementedForValue);
     else
-        reply("200 Type changed");
+    {
+        m_representationType = representationType;
+        reply(replies::typeChanged);
+    }
 }
 
 void Connection::mode(Mode mode)
 {
     if(mode != Mode::S)
-        reply("504 Command not implemented for specified value");
+        reply(replies::notImplementedForValue);
     else
-        reply("200 Type changed");
+        reply(replies::typeChanged);
 }
 
 void Connection::stru(Structure structure)
 {
     if(structure != Structure::F)
-        reply("504 Command not implemented for specified value");
+        reply(replies::notImplementedForValue);
     else
-        reply("200 Type changed");
+        reply(replies::typeChanged);
 }
 
 void Connection::retr(const std::filesystem::path &path)
 {
-    if(
-            !exists(path)
-            || is_directory(path))
+    // Небольшие файлы отдаются из памяти без единого системного вызова
+    if (m_context.m_fileCache)
+    {
+        if (auto content = m_context.m_fileCache->find(path))
+        {
+            sendCachedFile(std::move(content));
+            return;
+        }
+    }
+    m_reader = m_context.m_storage->openRead(path);
+    if (!m_reader)
     {
-        reply("534 Request denied");
+        reply(replies::requestDenied);
         return;
     }
-    m_file = fopen((path).string().c_str(), "r");
-    details::helpers::setNonBlocking(fileno(m_file));
-    sendFile(fileno(m_file));
+    if (m_context.m_fileCache)
+    {
+        // При промахе небольшой файл читается в кэш целиком через уже открытый дескриптор,
+        // а большой отдается через него же
+        if (auto content = m_context.m_fileCache->load(path, *m_reader))
+        {
+            m_reader.reset();
+            sendCachedFile(std::move(content));
+            return;
+        }
+    }
+    if (m_representationType == RepresentationType::I && !m_reader->contents().empty())
+    {
+        // Хранилище держит файл в памяти - отдаем его без копирования, как запись кэша
+        m_cachedData = m_reader->contents();
+        m_cachedDataOwner = std::shared_ptr<Storage::Reader>(std::move(m_reader));
+    }
+    sendFile();
+}
+
+void Connection::sendCachedFile(FileCache::ContentType content)
+{
+    m_cachedData = m_representationType == RepresentationType::A ? content->m_ascii : content->m_raw;
+    m_cachedDataOwner = std::move(content);
+    sendFile();
 }
 
 void Connection::stor(const std::filesystem::path &path)
 {
-    if(path.parent_path()/"" != m_root || !exists(path))
+    struct statx st;
+    if(!m_context.m_storage->stat(path, st, true) || !S_ISREG(st.stx_mode))
+    {
+        reply(replies::requestDenied);
+        return;
+    }
+    m_writer = m_context.m_storage->openWrite(path);
+    if (!m_writer)
     {
-        reply("534 Request denied");
+        reply(replies::requestDenied);
         return;
     }
-    m_file = fopen((path).string().c_str(), "w");
-    recvFile(fileno(m_file));
+    recvFile();
 }
 
 void Connection::noop()
 {
-    reply("200 Ok");
+    reply(replies::ok);
 }
 
 void Connection::pasv()
 {
-    if(m_dataFd < 0)
+    tracing::Span pasvSpan("pasv", traceId());
+    if (m_context.m_passivePortPool)
+    {
+        // Порт выделяется из общего набора заново для каждой передачи
+        if (m_passiveReservation)
+            m_context.m_passivePortPool->release(*m_passiveReservation);
+        m_passiveReservation = m_context.m_passivePortPool->reserve(m_peer);
+        if (!m_passiveReservation)
+        {
+            reply(replies::cannotOpenDataConnection);
+            return;
+        }
+        m_dataConnectionAddress.sin_port = htons(m_passiveReservation->m_port);
+    }
+    else if(m_dataFd < 0)
     {
         // Если PASV уже вызывалось в рамках данного соединения,
         // то существует неотрицательный сокет dataFd и смысла его пересоздавать нет
-        int systemOperationRes = 0;
-
         socklen_t addrLen = sizeof(m_dataConnectionAddress);
-        do
+        m_dataFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (m_dataFd < 0)
         {
-            m_dataFd = socket(AF_INET, SOCK_STREAM, 0);
-        } while (m_dataFd < 0);
+            reply(replies::cannotOpenDataConnection);
+            return;
+        }
 
         details::helpers::setNonBlocking(m_dataFd);
 
         m_dataConnectionAddress.sin_port = 0;
-        do
+        if (
+                bind(m_dataFd, reinterpret_cast<sockaddr *>(&m_dataConnectionAddress), sizeof(m_dataConnectionAddress)) < 0
+                || listen(m_dataFd, 15) < 0
+                || getsockname(m_dataFd, reinterpret_cast<sockaddr *>(&m_dataConnectionAddress), &addrLen) < 0)
         {
-            systemOperationRes = bind(
-                    m_dataFd, reinterpret_cast<sockaddr *>(&m_dataConnectionAddress), sizeof(m_dataConnectionAddress));
-        } while (systemOperationRes < 0);
-
-        systemOperationRes = 0;
-        do
-        {
-            systemOperationRes = listen(m_dataFd, 15);
-        } while (systemOperationRes < 0);
-
-        getsockname(m_dataFd, reinterpret_cast<sockaddr *>(&m_dataConnectionAddress), &addrLen);
+            close(m_dataFd);
+            m_dataFd = -1;
+            reply(replies::cannotOpenDataConnection);
+            return;
+        }
     }
     std::uint32_t dataIp = ntohl(m_dataConnectionAddress.sin_addr.s_addr);
     std::uint16_t dataPort = ntohs(m_dataConnectionAddress.sin_port);
 
-    std::stringstream replyStr;
+    char pasvReply[64];
+    int len = snprintf(
+            pasvReply, sizeof pasvReply, "227 Entering passive mode (%u,%u,%u,%u,%u,%u)\r\n",
+            dataIp >> 24 & 0xFF,
+            dataIp >> 16 & 0xFF,
+            dataIp >> 8 & 0xFF,
+            dataIp & 0xFF,
+            dataPort >> 8 & 0xFF,
+            dataPort & 0xFF);
+    reply({pasvReply, static_cast<std::size_t>(len)});
+}
+
+void Connection::list(const std::filesystem::path &path, details::ListingFormat format)
+{
+    struct statx st;
+    if(!m_context.m_storage->stat(path, st) || !S_ISDIR(st.stx_mode))
+    {
+        reply(replies::requestDenied);
+        return;
+    }
+    if (m_context.m_listingCache)
+    {
+        if (auto listing = m_context.m_listingCache->find(path, format))
+        {
+            m_cachedData = *listing;
+            m_cachedDataOwner = std::move(listing);
+            sendFile();
+            return;
+        }
+        m_listingFill = m_context.m_listingCache->startFill(path, format);
+    }
+    auto entries = m_context.m_storage->list(path);
+    if (!entries)
+    {
+        m_listingFill.reset();
+        reply(replies::fileActionNotTaken);
+        return;
+    }
+    m_lister = std::make_unique<details::DirectoryLister>(std::move(entries), format);
+    sendFile();
+}
 
-    replyStr << "227 Entering passive mode ("
-             << (dataIp >> 24  & 0xFF) << ","
-             << (dataIp >> 16  & 0xFF) << ","
-             << (dataIp >> 8 & 0xFF) << ","
-             << (dataIp & 0xFF) << ","
-             << (dataPort >> 8  & 0xFF) << ","
-             << (dataPort & 0xFF) << ")";
+void Connection::mlst(const std::filesystem::path &path)
+{
+    struct statx st;
+    if(!m_context.m_storage->stat(path, st))
+    {
+        reply(replies::actionNotTaken);
+        return;
+    }
+    char facts[details::DirectoryLister::maxLineLength];
+    auto factsLen = details::formatMachineFacts(st, facts);
+    if (factsLen == 0)
+    {
+        reply(replies::actionNotTaken);
+        return;
+    }
+    // Путь от корня сервера: resolvePath строит его приписыванием к корню, оканчивающемуся разделителем
+    std::string_view name = path.native();
+    name.remove_prefix(std::min(name.size(), m_context.m_root.native().size()));
+    reply({"250-Listing /", name, "\r\n ", {facts, factsLen}, "/", name, "\r\n250 End\r\n"});
+}
 
-    reply(replyStr.str());
+void Connection::size(const std::filesystem::path &path)
+{
+    struct statx st;
+    if(!m_context.m_storage->stat(path, st, true) || !S_ISREG(st.stx_mode))
+    {
+        reply(replies::actionNotTaken);
+        return;
+    }
+    char sizeReply[32];
+    int len = snprintf(sizeReply, sizeof sizeReply, "213 %llu\r\n", static_cast<unsigned long long>(st.stx_size));
+    reply({sizeReply, static_cast<std::size_t>(len)});
 }
 
-void Connection::list(const std::filesystem::path &path)
+void Connection::mdtm(const std::filesystem::path &path)
 {
+    struct statx st;
+    char modify[16];
     if(
-            path.lexically_normal() != m_root.parent_path()
-            || !exists(path)
-            || is_other(path)
-            || is_symlink(path))
+            !m_context.m_storage->stat(path, st, true)
+            || !S_ISREG(st.stx_mode)
+            || details::formatMachineTime(st.stx_mtime, modify) == 0)
     {
-        reply("534 Request denied");
+        reply(replies::actionNotTaken);
         return;
     }
-    m_file = popen(("ls -l " + (path).string()).c_str(), "r");
-    sendFile(fileno(m_file));
+    reply({"213 ", modify, "\r\n"});
+}
+
+void Connection::copy(const std::filesystem::path &from, const std::filesystem::path &to)
+{
+    auto aliveCriteria = m_isAlive;
+    // Как и STOR, копирование перезаписывает только уже существующие обычные файлы
+    struct statx st;
+    if(!m_context.m_storage->stat(to, st, true) || !S_ISREG(st.stx_mode))
+    {
+        reply(replies::requestDenied);
+        return;
+    }
+    auto copier = m_context.m_storage->copy(from, to);
+    if (!copier)
+    {
+        reply(replies::actionNotTaken);
+        return;
+    }
+    auto size = copier->size();
+    auto state = std::make_shared<CopyState>(CopyState{
+            std::move(copier), m_context.m_copyPool.get(), m_strand, m_isAlive, this});
+    m_isCopying = true;
+    // Ход копирования сообщается строками продолжения ответа 150, итог - ответом 250 либо 450.
+    // Следующие команды, как и во время передачи данных, обрабатываются после итогового ответа
+    reply({"150-Copying "sv, std::to_string(size), " bytes\r\n"sv});
+    setReplyContinuation(
+            std::make_shared<messaging::CallbackType>(
+                    [this, aliveCriteria, state](int res)
+                    {
+                        if(aliveCriteria->load())
+                        {
+                            if (res > 0)
+                            {
+                                state->m_nextProgress = details::TimingWheel::Clock::now() + copyProgressInterval;
+                                boost::asio::post(*state->m_pool, [state]() { copyStep(state); });
+                            }
+                            else
+                                killSelf();
+                        }
+                    }));
+}
+
+void Connection::feat()
+{
+    reply(replies::features);
 }
 
 void Connection::processNewCommand()
 {
-    std::size_t spaceLocation = m_msg.find(' ');
+    // Все команды, уже полностью пришедшие в m_msg, выполняются подряд,
+    // а ответы на них накапливаются и уходят клиенту одной записью.
+    // Команда, открывающая передачу данных, прерывает цепочку: следующие за ней команды
+    // обрабатываются после окончания передачи, как того требует порядок ответов FTP.
+    // Цепочка также прерывается, когда очередь ответов заполнена наполовину:
+    // остальные команды будут выполнены после ее отправки
+    auto aliveCriteria = m_isAlive;
+    m_isProcessingCommands = true;
+    do
+    {
+        executeCommand();
+        if (!aliveCriteria->load())
+            return;
+    } while (
+            !m_replyContinuation
+            && m_output.freeSpace() >= outputBufferSize / 2
+            && m_msg.find("\r\n") != m_msg.npos);
+    m_isProcessingCommands = false;
+    flushReplies(m_replyContinuation ? std::exchange(m_replyContinuation, nullptr) : m_defaultBehavior);
+}
+
+void Connection::executeCommand()
+{
+    auto started = details::TimingWheel::Clock::now();
+    // Команда и аргумент разбираются без копирования - как участки m_msg
     std::size_t eolLocation = m_msg.find("\r\n");
-    details::ci_string command(
-            m_msg.substr(
-                    0, spaceLocation != std::string::npos && spaceLocation < eolLocation
-                       ? spaceLocation
-                       : eolLocation).c_str());
-    std::string argument;
-    if (spaceLocation != std::string::npos)
-        argument = m_msg.substr(spaceLocation + 1, eolLocation - spaceLocation - 1);
-    // Теперь в command хранится case-insensitive строка с телом команды
-    // (3 или 4 символа перед пробелом или переводом каретки)
-    // из m_msg необходимо удалить тело команды, так как оно уже разобрано на command и argument.
-    // при этом m_msg нельзя очистить полностью, так как после совпадения может оставаться
-    // "хвост" из успевшей дойти части сообщения.
+    if (m_isDiscardingCommand)
+    {
+        // Окончание команды, на которую уже отправлен ответ о превышении длины
+        m_isDiscardingCommand = false;
+        m_msg.erase(0, eolLocation + 2);
+        return;
+    }
+    std::string_view line(m_msg.data(), eolLocation);
+    std::size_t spaceLocation = line.find(' ');
+    std::string_view argument;
+    if (spaceLocation != std::string_view::npos)
+        argument = line.substr(spaceLocation + 1);
+
+    m_currentVerb = line.substr(0, spaceLocation);
+    m_currentArgument = argument;
+    m_replyCode = 0;
+    auto verb = details::packVerb(m_currentVerb);
+    tracing::Span commandSpan("command", traceId(), verb);
+    auto *command = s_commandTable.find(verb);
+    if (!command)
+        reply(m_isAuthenticated ? replies::unknownCommand : replies::notLoggedIn);
+    else if (command->m_requiresAuthentication && !m_isAuthenticated)
+        reply(replies::notLoggedIn);
+    else
+        (this->*command->m_handler)(argument);
+
+    auto duration = details::TimingWheel::Clock::now() - started;
+    if (m_context.m_auditLog)
+        logCommand(duration);
+    // Разобранную команду удаляем из m_msg; при этом m_msg нельзя очистить полностью,
+    // так как после совпадения может оставаться "хвост" из успевшей дойти части сообщения.
     m_msg.erase(0, eolLocation + 2);
-    if (command == "USER")
+    m_currentVerb = m_currentArgument = {};
+
+    auto &threadMetrics = metrics::ThreadMetrics::local();
+    threadMetrics.add(metrics::Counter::Commands);
+    threadMetrics.observe(metrics::Histogram::CommandDuration, duration);
+}
+
+void Connection::discardOverlongCommand()
+{
+    // Буфер заполнен без \r\n. Последний байт сохраняется, так как он может быть первой половиной \r\n;
+    // остальное отбрасывается вплоть до конца команды. Ответ отправляется один раз на команду
+    char last = m_msg.back();
+    m_msg.clear();
+    if (last == '\r')
+        m_msg.push_back(last);
+    if (std::exchange(m_isDiscardingCommand, true))
+        (*m_defaultBehavior)(1);
+    else
+        reply(replies::commandTooLong);
+}
+
+std::optional<std::filesystem::path> Connection::resolvePath(std::string_view argument)
+{
+    std::filesystem::path desiredPath;
+    try
     {
-        if (argument.empty())
-        {
-            reply("501 Please, specify a username");
-            return;
-        }
+        desiredPath = details::helpers::validatePath(argument);
+    } catch (...)
+    {
+        reply(replies::invalidPath);
+        return std::nullopt;
+    }
+    if(!desiredPath.has_filename())
+        desiredPath = desiredPath.parent_path();
+    // Корень обозначается путем без завершающего разделителя, как и в кэше листингов
+    if(desiredPath.empty())
+        return m_context.m_root.parent_path();
+    return m_context.m_root/desiredPath;
+}
+
+void Connection::handleUser(std::string_view argument)
+{
+    if (argument.empty())
+        reply(replies::specifyUsername);
+    else
         user(argument);
+}
+
+void Connection::handleQuit(std::string_view)
+{
+    quit();
+}
+
+void Connection::handleNoop(std::string_view)
+{
+    noop();
+}
+
+void Connection::handleFeat(std::string_view)
+{
+    feat();
+}
+
+void Connection::handleType(std::string_view argument)
+{
+    // Допустимы формы "TYPE <тип>" и "TYPE <тип> <формат>"
+    if ((argument.size() != 1 && (argument.size() != 3 || argument[1] != ' '))
+        || "AEIL"sv.find(argument[0]) == std::string_view::npos
+        || (argument.size() == 3 && "NTC"sv.find(argument[2]) == std::string_view::npos))
+    {
+        reply(replies::invalidArguments);
+        return;
+    }
+    if (argument.size() == 1)
+        type(static_cast<RepresentationType>(argument[0]));
+    else
+        type(static_cast<RepresentationType>(argument[0]), static_cast<Format>(argument[2]));
+}
+
+void Connection::handleMode(std::string_view argument)
+{
+    if (argument.size() != 1)
+        reply(replies::specifyMode);
+    else if ("SBC"sv.find(argument[0]) != std::string_view::npos)
+        mode(static_cast<Mode>(argument[0]));
+    else
+        reply(replies::invalidMode);
+}
+
+void Connection::handleStru(std::string_view argument)
+{
+    if (argument.size() != 1)
+        reply(replies::specifyMode);
+    else if ("FRP"sv.find(argument[0]) != std::string_view::npos)
+        stru(static_cast<Structure>(argument[0]));
+    else
+        reply(replies::invalidStructure);
+}
+
+void Connection::handleRetr(std::string_view argument)
+{
+    if (argument.empty())
+        reply(replies::specifyPath);
+    else if (auto path = resolvePath(argument))
+        retr(*path);
+}
+
+void Connection::handleStor(std::string_view argument)
+{
+    if (argument.empty())
+        reply(replies::specifyPath);
+    else if (auto path = resolvePath(argument))
+        stor(*path);
+}
+
+void Connection::handleList(std::string_view argument)
+{
+    // Без аргумента команды листинга относятся к корневому каталогу
+    if (argument.empty())
+        list(m_context.m_root.parent_path());
+    else if (auto path = resolvePath(argument))
+        list(*path);
+}
+
+void Connection::handleMlsd(std::string_view argument)
+{
+    if (argument.empty())
+        list(m_context.m_root.parent_path(), details::ListingFormat::Machine);
+    else if (auto path = resolvePath(argument))
+        list(*path, details::ListingFormat::Machine);
+}
+
+void Connection::handleMlst(std::string_view argument)
+{
+    if (argument.empty())
+        mlst(m_context.m_root.parent_path());
+    else if (auto path = resolvePath(argument))
+        mlst(*path);
+}
+
+void Connection::handleSize(std::string_view argument)
+{
+    if (argument.empty())
+        reply(replies::specifyPath);
+    else if (auto path = resolvePath(argument))
+        size(*path);
+}
+
+void Connection::handleMdtm(std::string_view argument)
+{
+    if (argument.empty())
+        reply(replies::specifyPath);
+    else if (auto path = resolvePath(argument))
+        mdtm(*path);
+}
+
+void Connection::handlePasv(std::string_view)
+{
+    pasv();
+}
+
+void Connection::handlePwd(std::string_view)
+{
+    pwd();
+}
+
+void Connection::handleSite(std::string_view argument)
+{
+    // Поддерживается единственная команда SITE COPY <откуда> <куда>; путем назначения считается остаток строки
+    auto spaceLocation = argument.find(' ');
+    if (!details::equalsIgnoreCase(argument.substr(0, spaceLocation), "COPY"))
+    {
+        reply(replies::notImplementedForValue);
+        return;
     }
-    else if (command == "QUIT")
+    auto paths = spaceLocation == std::string_view::npos ? std::string_view() : argument.substr(spaceLocation + 1);
+    auto pathsSpace = paths.find(' ');
+    if (pathsSpace == std::string_view::npos || pathsSpace == 0 || pathsSpace + 1 == paths.size())
+    {
+        reply(replies::invalidArguments);
+        return;
+    }
+    auto from = resolvePath(paths.substr(0, pathsSpace));
+    if (!from)
+        return;
+    if (auto to = resolvePath(paths.substr(pathsSpace + 1)))
+        copy(*from, *to);
+}
+
+void Connection::reply(std::initializer_list<std::string_view> parts)
+{
+    queueReply(parts);
+    // Во время обработки пришедших команд ответы копятся и отправляются вместе
+    if (!m_isProcessingCommands)
+        flushReplies(m_defaultBehavior);
+}
+
+void Connection::queueReply(std::initializer_list<std::string_view> parts)
+{
+    if (m_replyCode == 0)
+        m_replyCode = details::replyCode(*parts.begin());
+    // Ответы не помещаются в буфер только при аномально длинных строках либо у клиента,
+    // который не успевает их принимать; тогда они и все последующие до опустошения очереди
+    // идут через m_outputOverflowQueued, чтобы не нарушить порядок. Строку, которую движок
+    // сейчас отправляет, менять нельзя: он пишет прямо из ее памяти
+    if (!m_outputOverflow.empty() || !m_outputOverflowQueued.empty() || !m_output.write(parts))
     {
-        quit();
+        for (auto part: parts)
+            m_outputOverflowQueued.append(part);
     }
-    else if (command == "NOOP")
+}
+
+void Connection::replyAndClose(std::string_view preformattedReply)
+{
+    auto aliveCriteria = m_isAlive;
+    m_isClosing = true;
+    m_stateStart = details::TimingWheel::Clock::now();
+    // Пока ответы не отправляются, движок ждет следующую команду - это ожидание больше не нужно
+    if (!m_isOutputWriting)
+        m_context.m_messageEngine->cancel(m_fd);
+    queueReply({preformattedReply});
+    flushReplies(std::make_shared<messaging::CallbackType>(
+            [this, aliveCriteria](int)
+            {
+                if (aliveCriteria->load())
+                    killSelf();
+            }));
+    if (aliveCriteria->load())
+        armWatchdog();
+}
+
+void Connection::armWatchdog()
+{
+    const auto &timeouts = m_context.m_timeouts;
+    std::optional<details::TimingWheel::Clock::time_point> deadline;
+    if (m_isClosing)
+        deadline = m_stateStart + closingGracePeriod;
+    else if (m_isAwaitingDataConnection)
     {
-        noop();
+        if (timeouts.m_dataConnection.count() > 0)
+            deadline = m_stateStart + timeouts.m_dataConnection;
     }
-    else if (!m_isAuthenticated)
+    else if (m_dataTransmissionFd != -1)
     {
-        reply("530 Not logged in");
+        if (timeouts.m_transferWindow.count() > 0)
+            deadline = m_transferWindowStart + timeouts.m_transferWindow;
     }
-    else if (m_isAuthenticated)
+    // Копирование не ограничено по времени: сроки снова ставятся после итогового ответа
+    else if (m_isCopying)
+        return;
+    else if (timeouts.m_idle.count() > 0)
+        deadline = m_lastActivity + timeouts.m_idle;
+    // Уже поставленный таймер, который сработает раньше, сам переставит проверку на новый срок
+    if (!deadline || *deadline >= m_watchdogDeadline)
+        return;
+    // У сессии в колесе не больше одного таймера: более поздний снимается,
+    // иначе он держал бы сессию живой до своего срока и после ее закрытия
+    if (m_watchdogDeadline != details::TimingWheel::Clock::time_point::max())
+        m_context.m_timingWheel->cancel(m_watchdogTick, m_watchdog);
+    m_watchdogDeadline = *deadline;
+    m_watchdogTick = m_context.m_timingWheel->schedule(*deadline, m_watchdog);
+}
+
+void Connection::checkTimeouts()
+{
+    auto aliveCriteria = m_isAlive;
+    auto now = details::TimingWheel::Clock::now();
+    // Сработавший таймер мог быть поставлен для более раннего состояния сессии; тогда ближайший таймер еще впереди
+    if (now >= m_watchdogDeadline)
+        m_watchdogDeadline = details::TimingWheel::Clock::time_point::max();
+    const auto &timeouts = m_context.m_timeouts;
+    if (m_isClosing)
     {
-        if (command == "TYPE")
+        // Клиент так и не принял последний ответ
+        if (now >= m_stateStart + closingGracePeriod)
         {
-            auto secondSpaceLocation = argument.find(' ', spaceLocation + 1);
-            RepresentationType typeVal;
-            Format formatVal = Format::N;
-            if (secondSpaceLocation == std::string::npos && argument.size() == 1)
-            {
-                if ("AEIL"s.find(argument[0]) != std::string::npos)
-                    typeVal = static_cast<RepresentationType>(argument[0]);
-                else
-                {
-                    reply("501 Invalid argument");
-                    return;
-                }
-                type(typeVal);
-            }
-            else if (argument.size() == 3 && secondSpaceLocation == 1)
-            {
-                if ("AEIL"s.find(argument[0]) != std::string::npos && "NTC"s.find(argument[2]) != std::string::npos)
-                {
-                    typeVal = static_cast<RepresentationType>(argument[0]);
-                    formatVal = static_cast<Format>(argument[2]);
-                }
-                else
-                {
-                    reply("501 Invalid arguments");
-                    return;
-                }
-                type(typeVal, formatVal);
-            }
+            killSelf();
+            return;
         }
-        else if (command == "MODE")
+    }
+    else if (m_isAwaitingDataConnection)
+    {
+        if (timeouts.m_dataConnection.count() > 0 && now >= m_stateStart + timeouts.m_dataConnection)
         {
-            if (argument.size() != 1)
-            {
-                reply("501 Please, specify the mode");
-                return;
-            }
-            if ("SBC"s.find(argument[0]) != std::string::npos)
-                mode(static_cast<Mode>(argument[0]));
-            else
-                reply("501 Invalid mode");
+            metrics::ThreadMetrics::local().add(metrics::Counter::Timeouts);
+            abortTransfer(replies::dataConnectionTimedOut);
         }
-        else if (command == "STRU")
+    }
+    else if (m_dataTransmissionFd != -1)
+    {
+        if (timeouts.m_transferWindow.count() > 0 && now >= m_transferWindowStart + timeouts.m_transferWindow)
         {
-            if (argument.size() != 1)
+            auto requiredBytes = std::max<std::uint64_t>(
+                    timeouts.m_minTransferRate * std::chrono::duration_cast<std::chrono::seconds>(now - m_transferWindowStart).count(), 1);
+            // Пауза, которую выдерживает сам сервер по ограничению скорости, зависанием не считается
+            if (!m_isThrottled && m_transferredBytes - m_transferWindowBytes < requiredBytes)
             {
-                reply("501 Please, specify the mode");
-                return;
+                metrics::ThreadMetrics::local().add(metrics::Counter::Timeouts);
+                finishTransfer(replies::transferTimedOut);
             }
-            if ("FRP"s.find(argument[0]) != std::string::npos)
-                stru(static_cast<Structure>(argument[0]));
             else
-                reply("501 Invalid structure");
-        }
-        else if (command == "RETR" || command == "STOR" || command == "LIST")
-        {
-            if (argument.empty())
-            {
-                if(command != "LIST")
-                {
-                    reply("501 Please, specify the path");
-                    return;
-                }
-                list(m_root.parent_path());
-                return;
-            }
-            std::filesystem::path desiredPath;
-            try
             {
-                desiredPath = details::helpers::validatePath(argument);
-            } catch (...)
-            {
-                reply("501 Invalid path");
-                return;
+                m_transferWindowStart = now;
+                m_transferWindowBytes = m_transferredBytes;
             }
-            if(!desiredPath.has_filename())
-                desiredPath = desiredPath.parent_path();
-            if (command == "RETR")
-                retr(m_root/desiredPath);
-            else if (command == "STOR")
-                stor(m_root/desiredPath);
-            else if (command == "LIST")
-                list(m_root/desiredPath);
-        }
-        else if (command == "PASV")
-        {
-            pasv();
-        }
-        else if (command == "PWD")
-        {
-            pwd();
-        }
-        else
-        {
-            reply("500 Unknown command");
         }
     }
+    else if (!m_isCopying && timeouts.m_idle.count() > 0 && now >= m_lastActivity + timeouts.m_idle)
+    {
+        metrics::ThreadMetrics::local().add(metrics::Counter::Timeouts);
+        replyAndClose(replies::idleTimeout);
+        return;
+    }
+    // Ответ мог не отправиться, и тогда соединение уже уничтожено
+    if (aliveCriteria->load())
+        armWatchdog();
+}
+
+void Connection::setReplyContinuation(std::shared_ptr<messaging::CallbackType> continuation)
+{
+    m_replyContinuation = std::move(continuation);
+}
+
+void Connection::flushReplies(const std::shared_ptr<messaging::CallbackType>& continuation)
+{
+    m_outputContinuation = continuation;
+    // Если запись уже идет, накопленные ответы уйдут следом за ней
+    if (!m_isOutputWriting)
+    {
+        m_flushTraceStart = tracing::start();
+        writeOutput(1);
+    }
+}
+
+void Connection::writeOutput(int lastWriteRes)
+{
+    m_isOutputWriting = !m_output.empty() || !m_outputOverflow.empty() || !m_outputOverflowQueued.empty();
+    if (!m_isOutputWriting)
+    {
+        tracing::async("reply flush", std::exchange(m_flushTraceStart, 0), traceId());
+        // Очередь пуста - всё, что было поставлено до flushReplies(), уже отправлено
+        if (auto continuation = std::exchange(m_outputContinuation, nullptr))
+            (*continuation)(lastWriteRes);
+        return;
+    }
+    if (!m_output.empty())
+        m_context.m_messageEngine->async_write(m_fd, m_output.readable(), m_outputWriter);
     else
     {
-        reply("500 Unknown command");
+        // Накопленное за время предыдущей записи уходит следующей записью
+        if (m_outputOverflow.empty())
+            m_outputOverflow.swap(m_outputOverflowQueued);
+        m_context.m_messageEngine->async_write(m_fd, m_outputOverflow, m_outputWriter);
     }
 }
 
-void Connection::reply(const std::string &reply)
+void Connection::logCommand(std::chrono::nanoseconds duration)
 {
-    m_messageEngine->async_write(m_fd, reply + "\r\n", m_defaultBehavior);
+    AuditLog::Record record;
+    record.m_time = std::chrono::system_clock::now();
+    record.m_duration = std::chrono::duration_cast<std::chrono::microseconds>(duration);
+    record.m_peer = m_peer;
+    record.m_code = m_replyCode;
+    record.m_isAuthenticated = m_isAuthenticated;
+    record.setCommand(m_currentVerb, m_currentArgument);
+    m_context.m_auditLog->append(record);
 }
 
-void Connection::echo(const std::string &msg)
+void Connection::startTransferRecord()
 {
-    auto aliveCriteria = m_isAlive;
-    m_messageEngine->async_write(
-            m_fd,
-            msg + "\r\n",
-            std::make_shared<messaging::CallbackType>(
-                    [this, aliveCriteria](int res)
-                    {
-                        if(aliveCriteria->load())
-                            if(res < 0)
-                                killSelf();
-                    }));
+    if (!m_context.m_auditLog)
+        return;
+    if (!m_transferRecord)
+        m_transferRecord = std::make_unique<AuditLog::Record>();
+    m_transferRecord->m_kind = AuditLog::Record::Kind::Transfer;
+    m_transferRecord->m_transferType = m_representationType == RepresentationType::I ? 'b' : 'a';
+    m_transferRecord->m_peer = m_peer;
+    // До окончания передачи здесь хранится счетчик байт сессии на момент ее начала
+    m_transferRecord->m_bytes = m_transferredBytes;
+    m_transferRecord->setCommand(m_currentVerb, m_currentArgument);
+}
+
+void Connection::logTransfer(std::string_view preformattedReply, std::chrono::nanoseconds duration)
+{
+    m_transferRecord->m_time = std::chrono::system_clock::now();
+    m_transferRecord->m_duration = std::chrono::duration_cast<std::chrono::microseconds>(duration);
+    m_transferRecord->m_bytes = m_transferredBytes - m_transferRecord->m_bytes;
+    m_transferRecord->m_code = details::replyCode(preformattedReply);
+    m_transferRecord->m_isAuthenticated = m_isAuthenticated;
+    m_context.m_auditLog->append(*m_transferRecord);
 }
 
-void Connection::sendFile(int fileFd)
+void Connection::sendFile()
 {
     auto aliveCriteria = m_isAlive;
-    m_messageEngine->async_write(
-            m_fd,
-            "150 Opening data connection\r\n"s,
+    startTransferRecord();
+    reply(replies::openingDataConnection);
+    setReplyContinuation(
             std::make_shared<messaging::CallbackType>(
                     [this, aliveCriteria](int res)
                     {
@@ -386,8 +926,8 @@ void Connection::sendFile(int fileFd)
                         {
                             if (res > 0)
                             {
-                                m_messageEngine->async_accept(
-                                        m_dataFd, std::make_shared<messaging::CallbackType>(
+                                acceptDataConnection(
+                                        std::make_shared<messaging::CallbackType>(
                                                 [this, aliveCriteria](int res)
                                                 {
                                                     if(aliveCriteria->load())
@@ -395,7 +935,7 @@ void Connection::sendFile(int fileFd)
                                                         if (res < 0)
                                                         {
                                                             // Если accept не удался, сообщаем об ошибке и ждем следующей команды
-                                                            reply("425 Cannot open data connection");
+                                                            abortTransfer(replies::cannotOpenDataConnection);
                                                             return;
                                                         }
                                                         // Если accept удался, значит, соединение открыто и можно передавать данные в полученный сокет
@@ -414,29 +954,154 @@ void Connection::sendFile(int fileFd)
 
 }
 
-void Connection::recvFile(int fileFd)
+void Connection::recvFile()
 {
     auto aliveCriteria = m_isAlive;
-    echo("150 Opening data connection");
-    m_messageEngine->async_accept(
-            m_dataFd,
+    startTransferRecord();
+    reply(replies::openingDataConnection);
+    setReplyContinuation(
             std::make_shared<messaging::CallbackType>(
                     [this, aliveCriteria](int res)
                     {
                         if(aliveCriteria->load())
                         {
-                            if (res < 0)
+                            if (res > 0)
+                            {
+                                acceptDataConnection(
+                                        std::make_shared<messaging::CallbackType>(
+                                                [this, aliveCriteria](int res)
+                                                {
+                                                    if(aliveCriteria->load())
+                                                    {
+                                                        if (res < 0)
+                                                        {
+                                                            // Если accept не удался, сообщаем об ошибке и ждем следующей команды
+                                                            abortTransfer(replies::cannotOpenDataConnection);
+                                                            return;
+                                                        }
+                                                        // Если accept удался, значит, соединение открыто и можно передавать данные в полученный сокет
+                                                        m_dataTransmissionFd = res;
+                                                        // Запрашиваем передачу данных по имеющимся дескрипторам
+                                                        (*m_repeatedDataReceiver)(0);
+                                                    }
+                                                }));
+                            }
+                            else
                             {
-                                // Если accept не удался, сообщаем об ошибке и ждем следующей команды
-                                reply("425 Cannot open data connection");
-                                return;
+                                killSelf();
                             }
-                            // Если accept удался, значит, соединение открыто и можно передавать данные в полученный сокет
-                            m_dataTransmissionFd = res;
-                            // Запрашиваем передачу данных по имеющимся дескрипторам
-                            (*m_repeatedDataReceiver)(0);
                         }
                     }));
 }
 
-}
\ No newline at end of file
+void Connection::copyStep(const std::shared_ptr<CopyState> &state)
+{
+    // Соединение закрыто - копия остается незавершенной
+    if (!state->m_isAlive->load())
+        return;
+    auto res = state->m_copier->step(copyChunkSize);
+    if (res > 0)
+    {
+        state->m_copiedBytes += res;
+        auto now = details::TimingWheel::Clock::now();
+        if (now >= state->m_nextProgress)
+        {
+            state->m_nextProgress = now + copyProgressInterval;
+            boost::asio::post(
+                    state->m_strand,
+                    [state, copiedBytes = state->m_copiedBytes]()
+                    {
+                        if (state->m_isAlive->load())
+                            state->m_connection->reportCopyProgress(copiedBytes);
+                    });
+        }
+        // Каждая порция - отдельная задача: одновременные копирования продвигаются по очереди,
+        // а остановка пула прерывает копирование между порциями
+        boost::asio::post(*state->m_pool, [state]() { copyStep(state); });
+        return;
+    }
+    bool isDone = res == 0 && state->m_copier->close();
+    state->m_copier.reset();
+    boost::asio::post(
+            state->m_strand,
+            [state, copiedBytes = state->m_copiedBytes, isDone]()
+            {
+                if (state->m_isAlive->load())
+                    state->m_connection->finishCopy(copiedBytes, isDone);
+            });
+}
+
+void Connection::reportCopyProgress(std::uint64_t copiedBytes)
+{
+    // Строки продолжения уходят клиенту, не возобновляя чтение команд
+    queueReply({" "sv, std::to_string(copiedBytes), " bytes copied\r\n"sv});
+    flushReplies(nullptr);
+}
+
+void Connection::finishCopy(std::uint64_t copiedBytes, bool isDone)
+{
+    auto aliveCriteria = m_isAlive;
+    m_isCopying = false;
+    // Время простоя управляющего соединения отсчитывается от окончания копирования
+    m_lastActivity = details::TimingWheel::Clock::now();
+    queueReply({"150 "sv, std::to_string(copiedBytes), " bytes copied\r\n"sv});
+    reply(isDone ? replies::copyComplete : replies::fileActionNotTaken);
+    if (aliveCriteria->load())
+        armWatchdog();
+}
+
+void Connection::acceptDataConnection(std::shared_ptr<messaging::CallbackType> callback)
+{
+    auto aliveCriteria = m_isAlive;
+    if (m_context.m_passivePortPool && !m_passiveReservation)
+    {
+        // PASV не вызывалась либо ее порт уже использован предыдущей передачей
+        (*callback)(-1);
+        return;
+    }
+    m_isAwaitingDataConnection = true;
+    m_stateStart = details::TimingWheel::Clock::now();
+    m_dataAcceptTraceStart = tracing::start();
+    armWatchdog();
+    // Соединение, пришедшее после истечения срока ожидания, уже никому не нужно
+    auto onDataConnection = serialized(std::make_shared<messaging::CallbackType>(
+            [this, aliveCriteria, callback](int res)
+            {
+                if (aliveCriteria->load() && std::exchange(m_isAwaitingDataConnection, false))
+                {
+                    tracing::async("data accept", std::exchange(m_dataAcceptTraceStart, 0), traceId());
+                    if (res >= 0)
+                        m_transferTraceStart = tracing::start();
+                    if (res >= 0 && !m_context.m_passivePortPool)
+                        details::helpers::setNonBlocking(res);
+                    m_passiveReservation.reset();
+                    m_transferStart = details::TimingWheel::Clock::now();
+                    m_transferWindowStart = m_transferStart;
+                    m_transferWindowBytes = m_transferredBytes;
+                    (*callback)(res);
+                    if (aliveCriteria->load())
+                        armWatchdog();
+                }
+                else if (res >= 0)
+                    close(res);
+            }));
+    if (!m_context.m_passivePortPool)
+        m_context.m_messageEngine->async_accept(m_dataFd, std::move(onDataConnection));
+    else
+        m_context.m_passivePortPool->accept(*m_passiveReservation, std::move(onDataConnection));
+}
+
+void Connection::stopAwaitingDataConnection()
+{
+    m_isAwaitingDataConnection = false;
+    tracing::async("data accept", std::exchange(m_dataAcceptTraceStart, 0), traceId());
+    if (!m_context.m_passivePortPool)
+        m_context.m_messageEngine->cancel(m_dataFd);
+    else if (m_passiveReservation)
+    {
+        m_context.m_passivePortPool->release(*m_passiveReservation);
+        m_passiveReservation.reset();
+    }
+}
+
+}
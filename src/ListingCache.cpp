@@ -0,0 +1,117 @@
+#include <ListingCache.h>
+
+namespace ftp {
+
+void ListingCache::Fill::commit()
+{
+    m_cache->insert(std::move(*this));
+}
+
+ListingCache::ListingCache(const std::shared_ptr<FsWatcher> &watcher, std::size_t maxDirectories)
+: m_watcher(watcher), m_maxDirectories(maxDirectories)
+{
+    m_watcher->addListener(
+            [this](const std::filesystem::path &directory, std::string_view)
+            {
+                if (directory.empty())
+                    clear();
+                else
+                    invalidate(directory);
+            });
+}
+
+ListingCache::ListingType ListingCache::find(const std::filesystem::path &directory, details::ListingFormat format)
+{
+    auto cacheLock = std::lock_guard(m_cacheMutex);
+    auto entryIterator = m_entries.find(directory.native());
+    if (entryIterator != m_entries.end())
+    {
+        if (auto &listing = entryIterator->second->m_listings[static_cast<std::size_t>(format)])
+        {
+            m_hits.fetch_add(1, std::memory_order_relaxed);
+            m_lru.splice(m_lru.begin(), m_lru, entryIterator->second);
+            return listing;
+        }
+    }
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+std::optional<ListingCache::Fill> ListingCache::startFill(
+        const std::filesystem::path &directory, details::ListingFormat format)
+{
+    // Наблюдение устанавливается и снимается без блокировки кэша:
+    // FsWatcher может одновременно вызывать invalidate()
+    int watch = m_watcher->watch(directory);
+    if (watch < 0)
+        return std::nullopt;
+    int releasedWatch = -1;
+    std::uint64_t generation;
+    {
+        auto cacheLock = std::lock_guard(m_cacheMutex);
+        auto entryIterator = m_entries.find(directory.native());
+        if (entryIterator != m_entries.end())
+        {
+            // Запись уже держит наблюдение за каталогом
+            releasedWatch = watch;
+            m_lru.splice(m_lru.begin(), m_lru, entryIterator->second);
+            generation = entryIterator->second->m_generation;
+        }
+        else
+        {
+            if (m_entries.size() >= m_maxDirectories)
+            {
+                // Вытесняем давно не использованный каталог
+                auto &victim = m_lru.back();
+                releasedWatch = victim.m_watch;
+                m_entries.erase(victim.m_directory);
+                m_lru.pop_back();
+            }
+            generation = ++m_generationCounter;
+            m_lru.push_front(Entry{directory.native(), {}, generation, watch});
+            m_entries.emplace(directory.native(), m_lru.begin());
+        }
+    }
+    if (releasedWatch >= 0)
+        m_watcher->unwatch(releasedWatch);
+    return Fill(*this, directory, format, generation);
+}
+
+void ListingCache::insert(Fill &&fill)
+{
+    auto listing = std::make_shared<const std::string>(std::move(fill.m_data));
+    auto cacheLock = std::lock_guard(m_cacheMutex);
+    auto entryIterator = m_entries.find(fill.m_directory.native());
+    if (entryIterator != m_entries.end() && entryIterator->second->m_generation == fill.m_generation)
+        entryIterator->second->m_listings[static_cast<std::size_t>(fill.m_format)] = std::move(listing);
+}
+
+void ListingCache::invalidate(const std::filesystem::path &directory)
+{
+    int releasedWatch;
+    {
+        auto cacheLock = std::lock_guard(m_cacheMutex);
+        auto entryIterator = m_entries.find(directory.native());
+        if (entryIterator == m_entries.end())
+            return;
+        // Запись удаляется вместе с наблюдением: следующий листинг установит его заново
+        releasedWatch = entryIterator->second->m_watch;
+        m_lru.erase(entryIterator->second);
+        m_entries.erase(entryIterator);
+    }
+    m_watcher->unwatch(releasedWatch);
+}
+
+void ListingCache::clear()
+{
+    std::list<Entry> released;
+    {
+        auto cacheLock = std::lock_guard(m_cacheMutex);
+        released.swap(m_lru);
+        m_entries.clear();
+    }
+    for (auto &entry: released)
+        m_watcher->unwatch(entry.m_watch);
+}
+
+} //namespace ftp
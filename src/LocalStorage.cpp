@@ -0,0 +1,482 @@
+#include <LocalStorage.h>
+#include <system_error>
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+namespace ftp {
+
+namespace {
+
+class LocalReader : public Storage::Reader
+{
+public:
+    explicit LocalReader(int fd)
+    : m_fd(fd)
+    {}
+
+    ~LocalReader() override
+    {
+        close(m_fd);
+    }
+
+    int read(std::span<char> out, std::uint64_t offset) override
+    {
+        return static_cast<int>(pread(m_fd, out.data(), out.size(), static_cast<off_t>(offset)));
+    }
+
+    bool attributes(struct statx &attributes) override
+    {
+        return statx(m_fd, "", AT_EMPTY_PATH, details::listingStatxMask, &attributes) == 0;
+    }
+
+private:
+    int m_fd;
+};
+
+class LocalWriter : public Storage::Writer
+{
+public:
+    explicit LocalWriter(int fd)
+    : m_fd(fd)
+    {}
+
+    ~LocalWriter() override
+    {
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+
+    int write(std::span<const char> data) override
+    {
+        std::size_t written = 0;
+        while (written < data.size())
+        {
+            auto res = ::write(m_fd, data.data() + written, data.size() - written);
+            if (res < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            written += res;
+        }
+        return static_cast<int>(written);
+    }
+
+    bool close() override
+    {
+        int fd = m_fd;
+        m_fd = -1;
+        return ::close(fd) == 0;
+    }
+
+private:
+    int m_fd;
+};
+
+// Копирование средствами ядра. Сначала пробуется FICLONE: на файловых системах с reflink (btrfs, XFS)
+// копия разделяет экстенты с исходным файлом, и данные не копируются вовсе. Иначе данные переносит
+// copy_file_range без передачи через память процесса, и только если он недоступен для этой пары
+// файловых систем - pread/pwrite
+class LocalCopier : public Storage::Copier
+{
+public:
+    LocalCopier(int sourceFd, int targetFd, std::uint64_t size)
+    : m_sourceFd(sourceFd), m_targetFd(targetFd), m_size(size)
+    {}
+
+    ~LocalCopier() override
+    {
+        ::close(m_sourceFd);
+        if (m_targetFd >= 0)
+            ::close(m_targetFd);
+    }
+
+    std::uint64_t size() const override
+    {
+        return m_size;
+    }
+
+    std::int64_t step(std::uint64_t maxBytes) override
+    {
+        if (m_mode == Mode::Clone)
+        {
+            if (ioctl(m_targetFd, FICLONE, m_sourceFd) == 0)
+            {
+                // Экстенты разделены целиком за один вызов
+                m_mode = Mode::Finished;
+                return static_cast<std::int64_t>(m_size);
+            }
+            m_mode = Mode::CopyFileRange;
+        }
+        std::uint64_t copied = 0;
+        while (copied < maxBytes && m_mode != Mode::Finished)
+        {
+            auto len = static_cast<std::size_t>(std::min<std::uint64_t>(maxBytes - copied, 1 << 30));
+            ssize_t res;
+            if (m_mode == Mode::CopyFileRange)
+            {
+                auto sourceOffset = static_cast<off_t>(m_offset), targetOffset = static_cast<off_t>(m_offset);
+                res = copy_file_range(m_sourceFd, &sourceOffset, m_targetFd, &targetOffset, len, 0);
+                if (res < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+                {
+                    m_mode = Mode::ReadWrite;
+                    continue;
+                }
+            }
+            else
+                res = readWrite(len);
+            if (res < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (res == 0)
+                m_mode = Mode::Finished;
+            m_offset += res;
+            copied += res;
+        }
+        return static_cast<std::int64_t>(copied);
+    }
+
+    bool close() override
+    {
+        int fd = m_targetFd;
+        m_targetFd = -1;
+        return ::close(fd) == 0;
+    }
+
+private:
+    enum class Mode
+    {
+        Clone,
+        CopyFileRange,
+        ReadWrite,
+        Finished
+    };
+
+    // Переносит одну порцию через буфер процесса
+    ssize_t readWrite(std::size_t len)
+    {
+        if (m_buffer.empty())
+            m_buffer.resize(64 * 1024);
+        auto res = pread(m_sourceFd, m_buffer.data(), std::min(len, m_buffer.size()), static_cast<off_t>(m_offset));
+        if (res <= 0)
+            return res;
+        ssize_t written = 0;
+        while (written < res)
+        {
+            auto writeRes = pwrite(m_targetFd, m_buffer.data() + written, res - written,
+                                   static_cast<off_t>(m_offset + written));
+            if (writeRes < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            written += writeRes;
+        }
+        return res;
+    }
+
+    int m_sourceFd, m_targetFd;
+    std::uint64_t m_size, m_offset = 0;
+    Mode m_mode = Mode::Clone;
+    std::vector<char> m_buffer;
+};
+
+class LocalDirectoryReader : public Storage::DirectoryReader
+{
+public:
+    explicit LocalDirectoryReader(int dirFd)
+    : m_dirFd(dirFd)
+    {}
+
+    ~LocalDirectoryReader() override
+    {
+        close(m_dirFd);
+    }
+
+    bool next(Entry &entry) override
+    {
+        while (!m_isFinished)
+        {
+            if (m_direntPos >= m_direntLen)
+            {
+                // Текущая порция элементов разобрана - запрашиваем следующую
+                auto res = getdents64(m_dirFd, m_direntBuffer, sizeof m_direntBuffer);
+                if (res <= 0)
+                {
+                    m_hasError = res < 0;
+                    m_isFinished = true;
+                    return false;
+                }
+                m_direntLen = static_cast<int>(res);
+                m_direntPos = 0;
+            }
+            auto *dirent = reinterpret_cast<dirent64 *>(m_direntBuffer + m_direntPos);
+            m_direntPos += dirent->d_reclen;
+            // Элемент мог быть удален между getdents64 и statx - просто пропускаем его
+            if (statx(m_dirFd, dirent->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                      details::listingStatxMask, &entry.m_attributes) < 0)
+                continue;
+            entry.m_name = dirent->d_name;
+            entry.m_linkTarget = {};
+            if (S_ISLNK(entry.m_attributes.stx_mode))
+            {
+                auto targetLen = readlinkat(m_dirFd, dirent->d_name, m_linkTarget, sizeof m_linkTarget);
+                if (targetLen > 0 && static_cast<std::size_t>(targetLen) < sizeof m_linkTarget)
+                    entry.m_linkTarget = std::string_view(m_linkTarget, targetLen);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    bool hasError() const override
+    {
+        return m_hasError;
+    }
+
+private:
+    int m_dirFd;
+    bool m_isFinished = false, m_hasError = false;
+    int m_direntPos = 0, m_direntLen = 0;
+    char m_linkTarget[PATH_MAX];
+    alignas(8) std::byte m_direntBuffer[4096];
+};
+
+// Разделяет путь относительно корня на родительский каталог (пустой для корня) и имя последнего элемента
+std::pair<std::string, std::string_view> splitParent(std::string_view relative)
+{
+    auto separator = relative.rfind('/');
+    if (separator == relative.npos)
+        return {std::string(), relative};
+    return {std::string(relative.substr(0, separator)), relative.substr(separator + 1)};
+}
+
+bool isDotName(std::string_view name)
+{
+    return name.empty() || name == "." || name == "..";
+}
+
+} //namespace
+
+LocalStorage::LocalStorage(const std::filesystem::path &root)
+: m_root(root.lexically_normal())
+, m_rootFd(open(m_root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC))
+{
+    if (m_rootFd < 0)
+        throw std::system_error(errno, std::system_category(), m_root.string());
+    if (!m_root.has_filename() && m_root.has_parent_path() && m_root != m_root.root_path())
+        m_root = m_root.parent_path();
+    // Без openat2 безопасно разрешать пути относительно корня нечем
+    int fd = openBeneath(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        int error = errno;
+        close(m_rootFd);
+        throw std::system_error(error, std::system_category(), "openat2");
+    }
+    close(fd);
+}
+
+LocalStorage::~LocalStorage()
+{
+    close(m_rootFd);
+}
+
+const char *LocalStorage::relativePath(const std::filesystem::path &path) const
+{
+    std::string_view pathString = path.native(), rootString = m_root.native();
+    if (!pathString.starts_with(rootString))
+    {
+        errno = ENOENT;
+        return nullptr;
+    }
+    if (pathString.size() == rootString.size()
+        || (pathString.size() == rootString.size() + 1 && pathString.back() == '/'))
+        return ".";
+    if (pathString[rootString.size()] != '/' && rootString != "/")
+    {
+        errno = ENOENT;
+        return nullptr;
+    }
+    return path.c_str() + rootString.size() + (rootString == "/" ? 0 : 1);
+}
+
+int LocalStorage::openBeneath(const std::filesystem::path &path, std::uint64_t flags, std::uint64_t mode) const
+{
+    auto relative = relativePath(path);
+    return relative ? openBeneath(relative, flags, mode) : -1;
+}
+
+int LocalStorage::openBeneath(const char *relative, std::uint64_t flags, std::uint64_t mode) const
+{
+    open_how how{};
+    how.flags = flags;
+    how.mode = mode;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    long res;
+    // EAGAIN - ядро не смогло исключить выход за корень из-за одновременного переименования; повторяем
+    do
+    {
+        res = syscall(SYS_openat2, m_rootFd, relative, &how, sizeof how);
+    } while (res < 0 && (errno == EAGAIN || errno == EINTR));
+    return static_cast<int>(res);
+}
+
+std::unique_ptr<Storage::Reader> LocalStorage::openRead(const std::filesystem::path &path)
+{
+    // O_NONBLOCK не дает зависнуть на открытии FIFO: такой файл все равно будет отвергнут после fstat
+    int fd = openBeneath(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    int error = 0;
+    if (fstat(fd, &st) < 0)
+        error = errno;
+    else if (!S_ISREG(st.st_mode))
+        error = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    if (error != 0)
+    {
+        close(fd);
+        errno = error;
+        return nullptr;
+    }
+    return std::make_unique<LocalReader>(fd);
+}
+
+std::unique_ptr<Storage::Writer> LocalStorage::openWrite(const std::filesystem::path &path)
+{
+    int fd = openBeneath(path, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return nullptr;
+    // Перезаписываются только обычные файлы
+    struct stat st;
+    int error = 0;
+    if (fstat(fd, &st) < 0)
+        error = errno;
+    else if (!S_ISREG(st.st_mode))
+        error = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    if (error != 0)
+    {
+        close(fd);
+        errno = error;
+        return nullptr;
+    }
+    return std::make_unique<LocalWriter>(fd);
+}
+
+bool LocalStorage::stat(const std::filesystem::path &path, struct statx &attributes, bool followSymlinks)
+{
+    auto relative = relativePath(path);
+    if (!relative)
+        return false;
+    std::string_view relativeString = relative;
+    if (relativeString == ".")
+        return statx(m_rootFd, "", AT_EMPTY_PATH, details::listingStatxMask, &attributes) == 0;
+    if (relativeString.find('/') == relativeString.npos && !isDotName(relativeString))
+    {
+        // Элемент самого корня: путь из одного имени без перехода по ссылке не может выйти за корень,
+        // поэтому хватает одного statx относительно дескриптора корня
+        if (statx(m_rootFd, relative, AT_SYMLINK_NOFOLLOW, details::listingStatxMask, &attributes) < 0)
+            return false;
+        if (followSymlinks && S_ISLNK(attributes.stx_mode))
+        {
+            errno = ELOOP;
+            return false;
+        }
+        return true;
+    }
+    int fd = openBeneath(relative, O_PATH | O_CLOEXEC | (followSymlinks ? 0 : O_NOFOLLOW));
+    if (fd < 0)
+        return false;
+    bool isDone = statx(fd, "", AT_EMPTY_PATH, details::listingStatxMask, &attributes) == 0;
+    int error = errno;
+    close(fd);
+    errno = error;
+    return isDone;
+}
+
+std::unique_ptr<Storage::DirectoryReader> LocalStorage::list(const std::filesystem::path &directory)
+{
+    int dirFd = openBeneath(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0)
+        return nullptr;
+    return std::make_unique<LocalDirectoryReader>(dirFd);
+}
+
+bool LocalStorage::rename(const std::filesystem::path &from, const std::filesystem::path &to)
+{
+    auto fromRelative = relativePath(from), toRelative = relativePath(to);
+    if (!fromRelative || !toRelative)
+        return false;
+    auto [fromParent, fromName] = splitParent(fromRelative);
+    auto [toParent, toName] = splitParent(toRelative);
+    if (isDotName(fromName) || isDotName(toName))
+    {
+        errno = EBUSY;
+        return false;
+    }
+    // Родительские каталоги открываются так же, как и все остальные пути, а переименование
+    // выполняется относительно их дескрипторов
+    int fromParentFd = fromParent.empty() ? m_rootFd : openBeneath(fromParent.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fromParentFd < 0)
+        return false;
+    int toParentFd = toParent.empty() ? m_rootFd : openBeneath(toParent.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    bool isDone = toParentFd >= 0
+            && renameat(fromParentFd, std::string(fromName).c_str(), toParentFd, std::string(toName).c_str()) == 0;
+    int error = errno;
+    if (fromParentFd != m_rootFd)
+        close(fromParentFd);
+    if (toParentFd >= 0 && toParentFd != m_rootFd)
+        close(toParentFd);
+    errno = error;
+    return isDone;
+}
+
+std::unique_ptr<Storage::Copier> LocalStorage::copy(const std::filesystem::path &from, const std::filesystem::path &to)
+{
+    int sourceFd = openBeneath(from, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (sourceFd < 0)
+        return nullptr;
+    struct stat sourceSt, targetSt;
+    int targetFd = -1, error = 0;
+    if (fstat(sourceFd, &sourceSt) < 0)
+        error = errno;
+    else if (!S_ISREG(sourceSt.st_mode))
+        error = S_ISDIR(sourceSt.st_mode) ? EISDIR : EINVAL;
+    // Цель открывается без O_TRUNC: копирование файла в самого себя обрезало бы исходные данные
+    else if ((targetFd = openBeneath(to, O_WRONLY | O_CREAT | O_NONBLOCK | O_CLOEXEC, 0666)) < 0
+             || fstat(targetFd, &targetSt) < 0)
+        error = errno;
+    else if (!S_ISREG(targetSt.st_mode))
+        error = S_ISDIR(targetSt.st_mode) ? EISDIR : EINVAL;
+    else if (targetSt.st_dev == sourceSt.st_dev && targetSt.st_ino == sourceSt.st_ino)
+        error = EINVAL;
+    else if (ftruncate(targetFd, 0) < 0)
+        error = errno;
+    if (error != 0)
+    {
+        close(sourceFd);
+        if (targetFd >= 0)
+            close(targetFd);
+        errno = error;
+        return nullptr;
+    }
+    return std::make_unique<LocalCopier>(sourceFd, targetFd, sourceSt.st_size);
+}
+
+} //namespace ftp
@@ -0,0 +1,373 @@
+#include <MemoryStorage.h>
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ftp {
+
+namespace {
+
+statx_timestamp currentTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    statx_timestamp time{};
+    time.tv_sec = now.tv_sec;
+    time.tv_nsec = static_cast<std::uint32_t>(now.tv_nsec);
+    return time;
+}
+
+} //namespace
+
+class MemoryStorage::MemoryReader : public Storage::Reader
+{
+public:
+    MemoryReader(std::shared_ptr<const std::string> content, const struct statx& attributes)
+    : m_content(std::move(content)), m_attributes(attributes)
+    {}
+
+    int read(std::span<char> out, std::uint64_t offset) override
+    {
+        if (offset >= m_content->size())
+            return 0;
+        auto len = std::min<std::size_t>(out.size(), m_content->size() - offset);
+        std::memcpy(out.data(), m_content->data() + offset, len);
+        return static_cast<int>(len);
+    }
+
+    bool attributes(struct statx &attributes) override
+    {
+        attributes = m_attributes;
+        return true;
+    }
+
+    std::span<const char> contents() const override
+    {
+        return *m_content;
+    }
+
+private:
+    std::shared_ptr<const std::string> m_content;
+    struct statx m_attributes;
+};
+
+class MemoryStorage::MemoryWriter : public Storage::Writer
+{
+public:
+    MemoryWriter(MemoryStorage& storage, std::string name)
+    : m_storage(storage), m_name(std::move(name))
+    {}
+
+    int write(std::span<const char> data) override
+    {
+        m_content.append(data.data(), data.size());
+        return static_cast<int>(data.size());
+    }
+
+    bool close() override
+    {
+        // До close() записанное не видно читателям: файл заменяется целиком
+        m_storage.publish(m_name, std::make_shared<const std::string>(std::move(m_content)));
+        return true;
+    }
+
+private:
+    MemoryStorage& m_storage;
+    std::string m_name, m_content;
+};
+
+class MemoryStorage::MemoryCopier : public Storage::Copier
+{
+public:
+    MemoryCopier(MemoryStorage& storage, std::string name, std::shared_ptr<const std::string> content)
+    : m_storage(storage), m_name(std::move(name)), m_content(std::move(content))
+    {}
+
+    std::uint64_t size() const override
+    {
+        return m_content->size();
+    }
+
+    std::int64_t step(std::uint64_t) override
+    {
+        // Содержимое неизменяемо, поэтому копия просто разделяет его с исходным файлом
+        auto copied = m_isCopied ? 0 : static_cast<std::int64_t>(m_content->size());
+        m_isCopied = true;
+        return copied;
+    }
+
+    bool close() override
+    {
+        m_storage.publish(m_name, std::move(m_content));
+        return true;
+    }
+
+private:
+    MemoryStorage& m_storage;
+    std::string m_name;
+    std::shared_ptr<const std::string> m_content;
+    bool m_isCopied = false;
+};
+
+class MemoryStorage::MemoryDirectoryReader : public Storage::DirectoryReader
+{
+public:
+    explicit MemoryDirectoryReader(std::vector<std::pair<std::string, struct statx>> entries)
+    : m_entries(std::move(entries))
+    {}
+
+    bool next(Entry &entry) override
+    {
+        if (m_position == m_entries.size())
+            return false;
+        auto &[name, attributes] = m_entries[m_position++];
+        entry.m_name = name;
+        entry.m_attributes = attributes;
+        entry.m_linkTarget = {};
+        return true;
+    }
+
+    bool hasError() const override
+    {
+        return false;
+    }
+
+private:
+    // Снимок каталога на момент открытия
+    std::vector<std::pair<std::string, struct statx>> m_entries;
+    std::size_t m_position = 0;
+};
+
+MemoryStorage::MemoryStorage(const std::filesystem::path &root, std::size_t shardCount)
+: m_root(root.lexically_normal())
+, m_uid(getuid())
+, m_gid(getgid())
+, m_creationTime(currentTime())
+, m_shards(std::max<std::size_t>(shardCount, 1))
+{
+    if (!m_root.has_filename() && m_root.has_parent_path() && m_root != m_root.root_path())
+        m_root = m_root.parent_path();
+}
+
+void MemoryStorage::put(std::string_view name, std::shared_ptr<const std::string> content)
+{
+    publish(name, std::move(content));
+}
+
+void MemoryStorage::load(const std::filesystem::path &directory)
+{
+    for (auto &directoryEntry: std::filesystem::directory_iterator(directory))
+    {
+        if (!directoryEntry.is_regular_file())
+            continue;
+        int fd = open(directoryEntry.path().c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category(), directoryEntry.path().string());
+        std::string content;
+        char buffer[64 * 1024];
+        while (true)
+        {
+            auto res = ::read(fd, buffer, sizeof buffer);
+            if (res < 0)
+            {
+                int error = errno;
+                close(fd);
+                throw std::system_error(error, std::system_category(), directoryEntry.path().string());
+            }
+            if (res == 0)
+                break;
+            content.append(buffer, res);
+        }
+        close(fd);
+        publish(directoryEntry.path().filename().native(), std::make_shared<const std::string>(std::move(content)));
+    }
+}
+
+std::unique_ptr<Storage::Reader> MemoryStorage::openRead(const std::filesystem::path &path)
+{
+    auto name = nameOf(path);
+    if (name.empty())
+    {
+        errno = isRoot(path) ? EISDIR : ENOENT;
+        return nullptr;
+    }
+    auto &shard = shardFor(name);
+    auto shardLock = std::lock_guard(shard.m_mutex);
+    auto entryIterator = shard.m_entries.find(name);
+    if (entryIterator == shard.m_entries.end())
+    {
+        errno = ENOENT;
+        return nullptr;
+    }
+    struct statx attributes;
+    fillAttributes(entryIterator->second, attributes);
+    return std::make_unique<MemoryReader>(entryIterator->second.m_content, attributes);
+}
+
+std::unique_ptr<Storage::Writer> MemoryStorage::openWrite(const std::filesystem::path &path)
+{
+    auto name = nameOf(path);
+    if (name.empty())
+    {
+        errno = isRoot(path) ? EISDIR : ENOENT;
+        return nullptr;
+    }
+    // Как и O_TRUNC, открытие для записи сразу делает файл пустым
+    publish(name, std::make_shared<const std::string>());
+    return std::make_unique<MemoryWriter>(*this, std::string(name));
+}
+
+bool MemoryStorage::stat(const std::filesystem::path &path, struct statx &attributes, bool)
+{
+    if (isRoot(path))
+    {
+        attributes = {};
+        attributes.stx_mask = details::listingStatxMask;
+        attributes.stx_mode = S_IFDIR | 0755;
+        attributes.stx_nlink = 2;
+        attributes.stx_uid = m_uid;
+        attributes.stx_gid = m_gid;
+        attributes.stx_mtime = m_creationTime;
+        return true;
+    }
+    auto name = nameOf(path);
+    if (name.empty())
+    {
+        errno = ENOENT;
+        return false;
+    }
+    auto &shard = shardFor(name);
+    auto shardLock = std::lock_guard(shard.m_mutex);
+    auto entryIterator = shard.m_entries.find(name);
+    if (entryIterator == shard.m_entries.end())
+    {
+        errno = ENOENT;
+        return false;
+    }
+    fillAttributes(entryIterator->second, attributes);
+    return true;
+}
+
+std::unique_ptr<Storage::DirectoryReader> MemoryStorage::list(const std::filesystem::path &directory)
+{
+    if (!isRoot(directory))
+    {
+        errno = nameOf(directory).empty() ? ENOENT : ENOTDIR;
+        return nullptr;
+    }
+    std::vector<std::pair<std::string, struct statx>> entries;
+    for (auto &shard: m_shards)
+    {
+        auto shardLock = std::lock_guard(shard.m_mutex);
+        for (auto &[name, entry]: shard.m_entries)
+        {
+            auto &[entryName, attributes] = entries.emplace_back();
+            entryName = name;
+            fillAttributes(entry, attributes);
+        }
+    }
+    return std::make_unique<MemoryDirectoryReader>(std::move(entries));
+}
+
+bool MemoryStorage::rename(const std::filesystem::path &from, const std::filesystem::path &to)
+{
+    auto fromName = nameOf(from), toName = nameOf(to);
+    if (fromName.empty() || toName.empty())
+    {
+        errno = isRoot(from) || isRoot(to) ? EBUSY : ENOENT;
+        return false;
+    }
+    auto &fromShard = shardFor(fromName), &toShard = shardFor(toName);
+    // Сегменты блокируются в порядке адресов, чтобы встречные переименования не взаимоблокировались
+    std::unique_lock<std::mutex> firstLock, secondLock;
+    firstLock = std::unique_lock(std::less<>()(&fromShard, &toShard) ? fromShard.m_mutex : toShard.m_mutex);
+    if (&fromShard != &toShard)
+        secondLock = std::unique_lock(std::less<>()(&fromShard, &toShard) ? toShard.m_mutex : fromShard.m_mutex);
+    auto entryIterator = fromShard.m_entries.find(fromName);
+    if (entryIterator == fromShard.m_entries.end())
+    {
+        errno = ENOENT;
+        return false;
+    }
+    if (fromName == toName)
+        return true;
+    auto entry = std::move(entryIterator->second);
+    fromShard.m_entries.erase(entryIterator);
+    toShard.m_entries.insert_or_assign(std::string(toName), std::move(entry));
+    return true;
+}
+
+std::unique_ptr<Storage::Copier> MemoryStorage::copy(const std::filesystem::path &from, const std::filesystem::path &to)
+{
+    auto fromName = nameOf(from), toName = nameOf(to);
+    if (fromName.empty() || toName.empty())
+    {
+        errno = isRoot(from) || isRoot(to) ? EISDIR : ENOENT;
+        return nullptr;
+    }
+    auto &shard = shardFor(fromName);
+    auto shardLock = std::lock_guard(shard.m_mutex);
+    auto entryIterator = shard.m_entries.find(fromName);
+    if (entryIterator == shard.m_entries.end())
+    {
+        errno = ENOENT;
+        return nullptr;
+    }
+    return std::make_unique<MemoryCopier>(*this, std::string(toName), entryIterator->second.m_content);
+}
+
+std::string_view MemoryStorage::nameOf(const std::filesystem::path &path) const
+{
+    std::string_view pathString = path.native(), rootString = m_root.native();
+    if (pathString.size() <= rootString.size() + 1
+        || !pathString.starts_with(rootString)
+        || pathString[rootString.size()] != '/')
+        return {};
+    auto name = pathString.substr(rootString.size() + 1);
+    if (name.find('/') != name.npos || name == "." || name == "..")
+        return {};
+    return name;
+}
+
+bool MemoryStorage::isRoot(const std::filesystem::path &path) const
+{
+    std::string_view pathString = path.native(), rootString = m_root.native();
+    return pathString == rootString
+        || (pathString.size() == rootString.size() + 1 && pathString.starts_with(rootString) && pathString.back() == '/');
+}
+
+MemoryStorage::Shard &MemoryStorage::shardFor(std::string_view name)
+{
+    return m_shards[NameHash()(name) % m_shards.size()];
+}
+
+void MemoryStorage::publish(std::string_view name, std::shared_ptr<const std::string> content)
+{
+    auto modificationTime = currentTime();
+    auto &shard = shardFor(name);
+    auto shardLock = std::lock_guard(shard.m_mutex);
+    if (auto entryIterator = shard.m_entries.find(name); entryIterator != shard.m_entries.end())
+        entryIterator->second = {std::move(content), modificationTime, entryIterator->second.m_unique};
+    else
+        shard.m_entries.emplace(
+                std::string(name),
+                Entry{std::move(content), modificationTime, m_nextUnique.fetch_add(1, std::memory_order_relaxed)});
+}
+
+void MemoryStorage::fillAttributes(const Entry &entry, struct statx &attributes) const
+{
+    attributes = {};
+    attributes.stx_mask = details::listingStatxMask;
+    attributes.stx_mode = S_IFREG | 0644;
+    attributes.stx_nlink = 1;
+    attributes.stx_uid = m_uid;
+    attributes.stx_gid = m_gid;
+    attributes.stx_size = entry.m_content->size();
+    attributes.stx_ino = entry.m_unique;
+    attributes.stx_mtime = entry.m_modificationTime;
+}
+
+} //namespace ftp
@@ -0,0 +1,187 @@
+#include <Metrics.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+namespace ftp::metrics {
+
+namespace {
+
+using namespace std::chrono_literals;
+
+struct CounterInfo
+{
+    std::string_view m_name, m_help;
+};
+
+struct HistogramInfo
+{
+    std::string_view m_name, m_help;
+    std::array<std::chrono::nanoseconds, ThreadMetrics::maxBuckets> m_bounds; // Верхние границы ячеек по возрастанию
+};
+
+constexpr std::array<CounterInfo, static_cast<std::size_t>(Counter::Count)> counterInfos{{
+        {"ftp_sessions_accepted_total", "Control connections admitted by the server"},
+        {"ftp_sessions_closed_total", "Control connections closed"},
+        {"ftp_commands_total", "Control commands processed"},
+        {"ftp_data_bytes_sent_total", "Bytes sent over data connections"},
+        {"ftp_data_bytes_received_total", "Bytes received over data connections"},
+        {"ftp_transfers_completed_total", "Data transfers completed successfully"},
+        {"ftp_transfers_failed_total", "Data transfers aborted or failed"},
+        {"ftp_timeouts_total", "Sessions and transfers closed by a timeout"},
+}};
+
+constexpr std::array<HistogramInfo, static_cast<std::size_t>(Histogram::Count)> histogramInfos{{
+        {
+                "ftp_command_duration_seconds",
+                "Time spent executing a control command",
+                {10us, 25us, 50us, 100us, 250us, 500us, 1ms, 2500us, 5ms, 10ms, 25ms, 50ms, 100ms, 250ms, 500ms, 1s}
+        },
+        {
+                "ftp_transfer_duration_seconds",
+                "Duration of data transfers",
+                {1ms, 10ms, 50ms, 100ms, 250ms, 500ms, 1s, 2500ms, 5s, 10s, 30s, 60s, 120s, 300s, 600s, 1800s}
+        },
+}};
+
+// Значения, сложенные по потокам
+struct Totals
+{
+    std::array<std::uint64_t, static_cast<std::size_t>(Counter::Count)> m_counters{};
+    struct HistogramTotals
+    {
+        std::array<std::uint64_t, ThreadMetrics::maxBuckets + 1> m_buckets{};
+        std::uint64_t m_sumNanoseconds = 0;
+    };
+    std::array<HistogramTotals, static_cast<std::size_t>(Histogram::Count)> m_histograms{};
+};
+
+} //namespace
+
+// Доступ к ячейкам потоков для сборки метрик
+struct Snapshot
+{
+    static void add(Totals& totals, const ThreadMetrics& metrics)
+    {
+        for (std::size_t i = 0; i < totals.m_counters.size(); ++i)
+            totals.m_counters[i] += metrics.m_counters[i].load(std::memory_order_relaxed);
+        for (std::size_t i = 0; i < totals.m_histograms.size(); ++i)
+        {
+            auto &histogram = totals.m_histograms[i];
+            for (std::size_t bucket = 0; bucket < histogram.m_buckets.size(); ++bucket)
+                histogram.m_buckets[bucket] += metrics.m_histograms[i].m_buckets[bucket].load(std::memory_order_relaxed);
+            histogram.m_sumNanoseconds += metrics.m_histograms[i].m_sumNanoseconds.load(std::memory_order_relaxed);
+        }
+    }
+};
+
+namespace {
+
+// Все живые потоки с метриками и итог уже завершившихся
+struct Registry
+{
+    static Registry& instance()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    std::mutex m_registryMutex;
+    std::vector<const ThreadMetrics*> m_threads;
+    Totals m_retired;
+};
+
+void appendHeader(std::string& out, std::string_view name, std::string_view help, std::string_view type)
+{
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+void appendSeconds(std::string& out, std::chrono::nanoseconds duration)
+{
+    char text[32];
+    int len = snprintf(text, sizeof text, "%g", std::chrono::duration<double>(duration).count());
+    out.append(text, len);
+}
+
+} //namespace
+
+ThreadMetrics& ThreadMetrics::local()
+{
+    thread_local ThreadMetrics metrics;
+    return metrics;
+}
+
+ThreadMetrics::ThreadMetrics()
+{
+    auto &registry = Registry::instance();
+    auto registryLock = std::lock_guard(registry.m_registryMutex);
+    registry.m_threads.push_back(this);
+}
+
+ThreadMetrics::~ThreadMetrics()
+{
+    auto &registry = Registry::instance();
+    auto registryLock = std::lock_guard(registry.m_registryMutex);
+    Snapshot::add(registry.m_retired, *this);
+    std::erase(registry.m_threads, this);
+}
+
+void ThreadMetrics::observe(Histogram histogram, std::chrono::nanoseconds duration)
+{
+    auto &bounds = histogramInfos[static_cast<std::size_t>(histogram)].m_bounds;
+    auto &cells = m_histograms[static_cast<std::size_t>(histogram)];
+    auto bucket = std::lower_bound(bounds.begin(), bounds.end(), duration) - bounds.begin();
+    increment(cells.m_buckets[bucket], 1);
+    increment(cells.m_sumNanoseconds, duration.count());
+}
+
+void render(std::string& out)
+{
+    Totals totals;
+    {
+        auto &registry = Registry::instance();
+        auto registryLock = std::lock_guard(registry.m_registryMutex);
+        totals = registry.m_retired;
+        for (const auto *metrics: registry.m_threads)
+            Snapshot::add(totals, *metrics);
+    }
+    for (std::size_t i = 0; i < counterInfos.size(); ++i)
+        renderCounter(out, counterInfos[i].m_name, counterInfos[i].m_help, totals.m_counters[i]);
+    for (std::size_t i = 0; i < histogramInfos.size(); ++i)
+    {
+        auto &info = histogramInfos[i];
+        auto &histogram = totals.m_histograms[i];
+        appendHeader(out, info.m_name, info.m_help, "histogram");
+        // В формате Prometheus ячейки накопительные
+        std::uint64_t count = 0;
+        for (std::size_t bucket = 0; bucket < histogram.m_buckets.size(); ++bucket)
+        {
+            count += histogram.m_buckets[bucket];
+            out.append(info.m_name).append("_bucket{le=\"");
+            if (bucket < info.m_bounds.size())
+                appendSeconds(out, info.m_bounds[bucket]);
+            else
+                out.append("+Inf");
+            out.append("\"} ").append(std::to_string(count)).append("\n");
+        }
+        out.append(info.m_name).append("_sum ");
+        appendSeconds(out, std::chrono::nanoseconds(histogram.m_sumNanoseconds));
+        out.append("\n");
+        out.append(info.m_name).append("_count ").append(std::to_string(count)).append("\n");
+    }
+}
+
+void renderGauge(std::string& out, std::string_view name, std::string_view help, std::uint64_t value)
+{
+    appendHeader(out, name, help, "gauge");
+    out.append(name).append(" ").append(std::to_string(value)).append("\n");
+}
+
+void renderCounter(std::string& out, std::string_view name, std::string_view help, std::uint64_t value)
+{
+    appendHeader(out, name, help, "counter");
+    out.append(name).append(" ").append(std::to_string(value)).append("\n");
+}
+
+} //namespace ftp::metrics
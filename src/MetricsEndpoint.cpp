@@ -0,0 +1,136 @@
+#include <MetricsEndpoint.h>
+#include <FtpConnection.h>
+#include <system_error>
+
+namespace ftp {
+
+MetricsEndpoint::MetricsEndpoint(
+        const std::shared_ptr<messaging::PollMessageEngine> &messageEngine,
+        std::uint16_t port,
+        RenderType render,
+        RenderType renderTrace)
+: m_messageEngine(messageEngine)
+, m_render(std::move(render))
+, m_renderTrace(std::move(renderTrace))
+, m_fd(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0))
+{
+    if (m_fd < 0)
+        throw std::system_error(errno, std::system_category(), "Metrics socket");
+    int reuse = 1;
+    setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(m_fd, reinterpret_cast<sockaddr *>(&address), sizeof address) < 0 || listen(m_fd, SOMAXCONN) < 0)
+    {
+        int error = errno;
+        close(m_fd);
+        throw std::system_error(error, std::system_category(), "Metrics port " + std::to_string(port));
+    }
+    details::helpers::setNonBlocking(m_fd);
+    acceptNext();
+}
+
+MetricsEndpoint::~MetricsEndpoint()
+{
+    m_isAlive->store(false);
+    m_messageEngine->cancel(m_fd);
+    close(m_fd);
+}
+
+void MetricsEndpoint::acceptNext()
+{
+    auto aliveCriteria = m_isAlive;
+    m_messageEngine->async_accept(
+            m_fd,
+            std::make_shared<messaging::CallbackType>(
+                    [this, aliveCriteria](int res)
+                    {
+                        if (!aliveCriteria->load())
+                        {
+                            if (res >= 0)
+                                close(res);
+                            return;
+                        }
+                        if (res >= 0)
+                        {
+                            details::helpers::setNonBlocking(res);
+                            auto request = std::make_shared<Request>(res);
+                            armRequestTimeout(request);
+                            handleRequest(request);
+                            acceptNext();
+                            return;
+                        }
+                        // Как и в PassivePortPool, после ошибки accept() повтор откладывается
+                        m_messageEngine->async_wait(
+                                acceptRetryDelay,
+                                std::make_shared<messaging::CallbackType>(
+                                        [this, aliveCriteria](int)
+                                        {
+                                            if (aliveCriteria->load())
+                                                acceptNext();
+                                        }));
+                    }));
+}
+
+void MetricsEndpoint::handleRequest(const std::shared_ptr<Request> &request)
+{
+    auto aliveCriteria = m_isAlive;
+    m_messageEngine->async_read_until(
+            request->m_fd,
+            request->m_request,
+            std::make_shared<messaging::CallbackType>(
+                    [this, aliveCriteria, request](int res)
+                    {
+                        // Оборванный или слишком длинный запрос остается без ответа
+                        if (!aliveCriteria->load() || res <= 0)
+                            return;
+                        auto requestLine = request->m_request.view().substr(0, request->m_request.find("\r\n"));
+                        std::string body;
+                        std::string_view status = "404 Not Found";
+                        std::string_view contentType = "text/plain; version=0.0.4; charset=utf-8";
+                        if (requestLine.starts_with("GET /metrics ") || requestLine.starts_with("GET / "))
+                        {
+                            status = "200 OK";
+                            m_render(body);
+                        }
+                        else if (m_renderTrace && requestLine.starts_with("GET /trace "))
+                        {
+                            status = "200 OK";
+                            contentType = "application/json";
+                            m_renderTrace(body);
+                        }
+                        auto &response = request->m_response;
+                        response.append("HTTP/1.1 ").append(status).append("\r\n")
+                                .append("Content-Type: ").append(contentType).append("\r\n")
+                                .append("Content-Length: ").append(std::to_string(body.size())).append("\r\n")
+                                .append("Connection: close\r\n\r\n")
+                                .append(body);
+                        // Запрос живет, пока движок хранит коллбек записи; после записи сокет закрывается
+                        m_messageEngine->async_write(
+                                request->m_fd,
+                                response,
+                                std::make_shared<messaging::CallbackType>([request](int) {}));
+                    }),
+            std::string_view("\r\n\r\n"));
+}
+
+void MetricsEndpoint::armRequestTimeout(const std::shared_ptr<Request> &request)
+{
+    auto aliveCriteria = m_isAlive;
+    // Таймер движка не снимается, поэтому не должен продлевать жизнь уже отвеченного запроса
+    m_messageEngine->async_wait(
+            requestTimeout,
+            std::make_shared<messaging::CallbackType>(
+                    [this, aliveCriteria, weakRequest = std::weak_ptr(request)](int)
+                    {
+                        if (!aliveCriteria->load())
+                            return;
+                        // Пока запрос удерживается здесь, его дескриптор не закрыт и не может достаться другому сокету
+                        if (auto request = weakRequest.lock())
+                            m_messageEngine->cancel(request->m_fd);
+                    }));
+}
+
+} //namespace ftp
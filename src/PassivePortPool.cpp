@@ -0,0 +1,173 @@
+#include <PassivePortPool.h>
+#include <FtpConnection.h>
+#include <system_error>
+
+namespace ftp {
+
+PassivePortPool::PassivePortPool(
+        const std::shared_ptr<messaging::PollMessageEngine> &messageEngine,
+        in_addr address,
+        std::uint16_t minPort,
+        std::uint16_t maxPort)
+: m_messageEngine(messageEngine)
+{
+    int lastError = EINVAL;
+    for (unsigned port = minPort; port <= maxPort; ++port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            lastError = errno;
+            break;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+        sockaddr_in listenerAddress{};
+        listenerAddress.sin_family = AF_INET;
+        listenerAddress.sin_addr = address;
+        listenerAddress.sin_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&listenerAddress), sizeof listenerAddress) < 0
+            || listen(fd, SOMAXCONN) < 0)
+        {
+            // Порт занят кем-то еще - обходимся без него
+            lastError = errno;
+            close(fd);
+            continue;
+        }
+        details::helpers::setNonBlocking(fd);
+        m_listeners.push_back({fd, static_cast<std::uint16_t>(port)});
+    }
+    if (m_listeners.empty())
+        throw std::system_error(lastError, std::system_category());
+    for (auto listener: m_listeners)
+        acceptOn(listener);
+}
+
+PassivePortPool::~PassivePortPool()
+{
+    m_isAlive->store(false);
+    for (auto &listener: m_listeners)
+        close(listener.m_fd);
+    for (auto &[peerAndPort, pending]: m_pending)
+        if (pending.m_dataFd >= 0)
+            close(pending.m_dataFd);
+}
+
+std::optional<PassivePortPool::Reservation> PassivePortPool::reserve(in_addr_t peer)
+{
+    auto pendingLock = std::lock_guard(m_pendingMutex);
+    // Порты перебираются по кругу, чтобы резервирования распределялись равномерно
+    for (std::size_t i = 0; i < m_listeners.size(); ++i)
+    {
+        auto &listener = m_listeners[(m_nextListener + i) % m_listeners.size()];
+        auto [pendingIterator, isInserted] = m_pending.try_emplace(key(peer, listener.m_port));
+        if (isInserted)
+        {
+            m_nextListener = (m_nextListener + i + 1) % m_listeners.size();
+            pendingIterator->second.m_ticket = ++m_ticketCounter;
+            return Reservation{peer, listener.m_port, pendingIterator->second.m_ticket};
+        }
+    }
+    return std::nullopt;
+}
+
+void PassivePortPool::accept(const Reservation &reservation, std::shared_ptr<messaging::CallbackType> callback)
+{
+    int dataFd;
+    {
+        auto pendingLock = std::lock_guard(m_pendingMutex);
+        auto pendingIterator = m_pending.find(key(reservation.m_peer, reservation.m_port));
+        if (pendingIterator == m_pending.end() || pendingIterator->second.m_ticket != reservation.m_ticket)
+            dataFd = -1;
+        else if (pendingIterator->second.m_dataFd < 0)
+        {
+            // Клиент еще не подключился - соединение будет передано из acceptOn()
+            pendingIterator->second.m_callback = std::move(callback);
+            return;
+        }
+        else
+        {
+            dataFd = pendingIterator->second.m_dataFd;
+            m_pending.erase(pendingIterator);
+        }
+    }
+    (*callback)(dataFd);
+}
+
+void PassivePortPool::release(const Reservation &reservation)
+{
+    auto pendingLock = std::lock_guard(m_pendingMutex);
+    auto pendingIterator = m_pending.find(key(reservation.m_peer, reservation.m_port));
+    if (pendingIterator == m_pending.end() || pendingIterator->second.m_ticket != reservation.m_ticket)
+        return;
+    if (pendingIterator->second.m_dataFd >= 0)
+        close(pendingIterator->second.m_dataFd);
+    m_pending.erase(pendingIterator);
+}
+
+void PassivePortPool::acceptOn(Listener listener)
+{
+    auto aliveCriteria = m_isAlive;
+    m_messageEngine->async_accept(
+            listener.m_fd,
+            std::make_shared<messaging::CallbackType>(
+                    [this, aliveCriteria, listener](int res)
+                    {
+                        if (!aliveCriteria->load())
+                        {
+                            if (res >= 0)
+                                close(res);
+                            return;
+                        }
+                        if (res >= 0)
+                        {
+                            handleNewDataConnection(listener, res);
+                            acceptOn(listener);
+                            return;
+                        }
+                        // Ошибка accept() сообщается сразу, поэтому немедленный повтор при исчерпанных
+                        // дескрипторах превратился бы в бесконечную рекурсию
+                        m_messageEngine->async_wait(
+                                acceptRetryDelay,
+                                std::make_shared<messaging::CallbackType>(
+                                        [this, aliveCriteria, listener](int)
+                                        {
+                                            if (aliveCriteria->load())
+                                                acceptOn(listener);
+                                        }));
+                    }));
+}
+
+void PassivePortPool::handleNewDataConnection(Listener listener, int dataFd)
+{
+    sockaddr_in peerAddress{};
+    socklen_t addrLen = sizeof peerAddress;
+    if (getpeername(dataFd, reinterpret_cast<sockaddr *>(&peerAddress), &addrLen) < 0)
+    {
+        close(dataFd);
+        return;
+    }
+    details::helpers::setNonBlocking(dataFd);
+    std::shared_ptr<messaging::CallbackType> callback;
+    {
+        auto pendingLock = std::lock_guard(m_pendingMutex);
+        auto pendingIterator = m_pending.find(key(peerAddress.sin_addr.s_addr, listener.m_port));
+        if (pendingIterator == m_pending.end() || pendingIterator->second.m_dataFd >= 0)
+        {
+            // Соединение, которого никто не ждет, либо повторное соединение по тому же резервированию
+            close(dataFd);
+            return;
+        }
+        if (!pendingIterator->second.m_callback)
+        {
+            // Сессия еще не запросила соединение - сохраняем его до запроса
+            pendingIterator->second.m_dataFd = dataFd;
+            return;
+        }
+        callback = std::move(pendingIterator->second.m_callback);
+        m_pending.erase(pendingIterator);
+    }
+    (*callback)(dataFd);
+}
+
+} //namespace ftp
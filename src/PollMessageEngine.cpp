@@ -38,7 +38,7 @@ void PollMessageEngine::async_read_some_impl(
 }
 
 void PollMessageEngine::async_write_some_impl(
-        int fd, std::span<std::byte> buffer, std::shared_ptr<CallbackType> callback)
+        int fd, std::span<const std::byte> buffer, std::shared_ptr<CallbackType> callback)
 {
     int op_res = write(fd, buffer.data(), buffer.size());
     if (op_res >= 0 || errno != EWOULDBLOCK)
@@ -96,7 +96,7 @@ void PollMessageEngine::async_read_impl(
 }
 
 void PollMessageEngine::async_write_impl(
-        int fd, std::span<std::byte> buffer, std::shared_ptr<CallbackType> callback, int offset)
+        int fd, std::span<const std::byte> buffer, std::shared_ptr<CallbackType> callback, int offset)
 {
     auto aliveCriteria = m_isAlive;
     async_write_some_impl(
@@ -159,12 +159,77 @@ void PollMessageEngine::async_accept(int fd, std::shared_ptr<CallbackType> callb
     }
 }
 
+void PollMessageEngine::async_wait(std::chrono::steady_clock::duration delay, std::shared_ptr<CallbackType> callback)
+{
+    auto queriesLock = std::lock_guard(m_queryMutex);
+    m_timers.push({std::chrono::steady_clock::now() + delay, std::move(callback)});
+}
+
+void PollMessageEngine::cancel(int fd)
+{
+    auto queriesLock = std::lock_guard(m_queryMutex);
+    std::erase_if(m_queries, [fd](const innerType& entry) { return entry.m_fd.fd == fd; });
+}
+
+namespace {
+
+std::uint64_t microseconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+} //namespace
+
+void PollMessageEngine::pushReady(
+        std::shared_ptr<CallbackType> callback, bool isInstrumented, std::chrono::steady_clock::time_point readyAt)
+{
+    if (!isInstrumented)
+    {
+        m_readyForOperationQueue.push(
+                [callback]() mutable
+                { (*callback)(0); });
+        return;
+    }
+    m_readyForOperationQueue.push(
+            [callback, readyAt, statistics = m_statistics]() mutable
+            {
+                auto start = std::chrono::steady_clock::now();
+                statistics->m_dispatchLag.record(microseconds(start - readyAt));
+                (*callback)(0);
+                statistics->m_callbackDuration.record(microseconds(std::chrono::steady_clock::now() - start));
+            });
+}
+
+bool PollMessageEngine::collectExpiredTimers(bool isInstrumented)
+{
+    auto queriesLock = std::lock_guard(m_queryMutex);
+    auto now = std::chrono::steady_clock::now();
+    bool isExpired = false;
+    while (!m_timers.empty() && m_timers.top().m_deadline <= now)
+    {
+        // Задержка таймера считается от его срока, а не от момента обнаружения
+        pushReady(m_timers.top().m_callback, isInstrumented, m_timers.top().m_deadline);
+        m_timers.pop();
+        isExpired = true;
+    }
+    return isExpired;
+}
+
 ExtCallbackType PollMessageEngine::waitForEvent()
 {
     if (m_readyForOperationQueue.empty())
     {
+        using Clock = std::chrono::steady_clock;
+        // Флаг читается один раз за цикл ожидания, чтобы замеры цикла были согласованы
+        bool isInstrumented = m_statistics->m_isEnabled.load(std::memory_order_relaxed);
+        Clock::time_point waitStart, rebuildStart;
+        Clock::duration rebuildTime{};
+        if (isInstrumented)
+            waitStart = Clock::now();
         do
         {
+            if (isInstrumented)
+                rebuildStart = Clock::now();
             m_queryMutex.lock();
             m_fds.clear();
             for (auto &entry: m_queries)
@@ -173,7 +238,18 @@ ExtCallbackType PollMessageEngine::waitForEvent()
                 entry.m_associatedIndex = m_fds.size() - 1;
             }
             m_queryMutex.unlock();
-        } while(poll(m_fds.data(), m_fds.size(), 1) == 0 && !m_interruptanceFlag.load());
+            if (isInstrumented)
+                rebuildTime += Clock::now() - rebuildStart;
+        } while(poll(m_fds.data(), m_fds.size(), 1) == 0 && !collectExpiredTimers(isInstrumented) && !m_interruptanceFlag.load());
+        Clock::time_point readyAt;
+        if (isInstrumented)
+        {
+            readyAt = Clock::now();
+            m_statistics->m_pollWait.record(microseconds(readyAt - waitStart - rebuildTime));
+            m_statistics->m_fdsRebuild.record(microseconds(rebuildTime));
+        }
+        // При постоянной активности на дескрипторах таймеры проверяются и после успешного poll
+        collectExpiredTimers(isInstrumented);
         {
             auto queriesLock = std::lock_guard(m_queryMutex);
             while (!m_fds.empty())
@@ -187,19 +263,44 @@ ExtCallbackType PollMessageEngine::waitForEvent()
                             {
                                 return obj.m_associatedIndex == i;
                             });
-                    auto entryCallback = entryIterator->m_callback;
-                    m_readyForOperationQueue.push(
-                            [entryCallback]() mutable
-                            { (*entryCallback)(0); });
+                    // Операция могла быть снята cancel() во время poll
+                    if (entryIterator == m_queries.cend())
+                        continue;
+                    pushReady(entryIterator->m_callback, isInstrumented, readyAt);
                     m_queries.erase(entryIterator);
                 }
             }
         }
+        if (isInstrumented)
+        {
+            m_statistics->m_readyDispatch.record(microseconds(Clock::now() - readyAt));
+            m_statistics->m_readyCount.record(m_readyForOperationQueue.size());
+        }
     }
     auto cb = m_readyForOperationQueue.empty() ? [](){} : m_readyForOperationQueue.front();
     if(!m_readyForOperationQueue.empty())
         m_readyForOperationQueue.pop();
+    m_readyCallbackCount.store(m_readyForOperationQueue.size(), std::memory_order_relaxed);
     return cb;
 }
 
-}
\ No newline at end of file
+EngineStatistics PollMessageEngine::statistics() const
+{
+    return {
+            m_statistics->m_pollWait.snapshot(),
+            m_statistics->m_fdsRebuild.snapshot(),
+            m_statistics->m_readyDispatch.snapshot(),
+            m_statistics->m_readyCount.snapshot(),
+            m_statistics->m_dispatchLag.snapshot(),
+            m_statistics->m_callbackDuration.snapshot()
+    };
+}
+
+void PollMessageEngine::resetStatistics()
+{
+    for (auto *histogram: {&m_statistics->m_pollWait, &m_statistics->m_fdsRebuild, &m_statistics->m_readyDispatch,
+                           &m_statistics->m_readyCount, &m_statistics->m_dispatchLag, &m_statistics->m_callbackDuration})
+        histogram->reset();
+}
+
+}
@@ -0,0 +1,79 @@
+#include <Storage.h>
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+
+namespace ftp {
+
+namespace {
+
+// Копирование через чтение исходного файла и запись копии промежуточным буфером
+class BufferedCopier : public Storage::Copier
+{
+public:
+    BufferedCopier(std::unique_ptr<Storage::Reader> reader, std::unique_ptr<Storage::Writer> writer, std::uint64_t size)
+    : m_reader(std::move(reader)), m_writer(std::move(writer)), m_size(size), m_buffer(64 * 1024)
+    {}
+
+    std::uint64_t size() const override
+    {
+        return m_size;
+    }
+
+    std::int64_t step(std::uint64_t maxBytes) override
+    {
+        std::uint64_t copied = 0;
+        while (copied < maxBytes)
+        {
+            auto len = static_cast<std::size_t>(std::min<std::uint64_t>(m_buffer.size(), maxBytes - copied));
+            auto res = m_reader->read(std::span(m_buffer.data(), len), m_offset);
+            if (res < 0)
+                return -1;
+            if (res == 0)
+                break;
+            if (m_writer->write(std::span<const char>(m_buffer.data(), res)) < 0)
+                return -1;
+            m_offset += res;
+            copied += res;
+        }
+        return static_cast<std::int64_t>(copied);
+    }
+
+    bool close() override
+    {
+        return m_writer->close();
+    }
+
+private:
+    std::unique_ptr<Storage::Reader> m_reader;
+    std::unique_ptr<Storage::Writer> m_writer;
+    std::uint64_t m_size, m_offset = 0;
+    std::vector<char> m_buffer;
+};
+
+} //namespace
+
+std::unique_ptr<Storage::Copier> Storage::copy(const std::filesystem::path &from, const std::filesystem::path &to)
+{
+    auto reader = openRead(from);
+    if (!reader)
+        return nullptr;
+    struct statx attributes;
+    if (!reader->attributes(attributes))
+        return nullptr;
+    // Копирование файла в самого себя обрезало бы его при открытии для записи
+    struct statx targetAttributes;
+    if (stat(to, targetAttributes) && targetAttributes.stx_ino == attributes.stx_ino
+        && targetAttributes.stx_dev_major == attributes.stx_dev_major
+        && targetAttributes.stx_dev_minor == attributes.stx_dev_minor)
+    {
+        errno = EINVAL;
+        return nullptr;
+    }
+    auto writer = openWrite(to);
+    if (!writer)
+        return nullptr;
+    return std::make_unique<BufferedCopier>(std::move(reader), std::move(writer), attributes.stx_size);
+}
+
+} //namespace ftp
@@ -0,0 +1,68 @@
+#include <TimingWheel.h>
+#include <algorithm>
+
+namespace ftp::details {
+
+TimingWheel::TimingWheel(Clock::duration resolution, std::size_t slotCount)
+: m_resolution(resolution)
+, m_slots(std::max<std::size_t>(slotCount, 1)) {}
+
+std::uint64_t TimingWheel::schedule(Clock::time_point deadline, std::shared_ptr<messaging::CallbackType> callback)
+{
+    // Такт округляется вверх, чтобы таймер не сработал раньше срока
+    auto tick = tickOf(deadline + m_resolution - Clock::duration(1));
+    auto wheelLock = std::lock_guard(m_wheelMutex);
+    tick = std::max(tick, m_currentTick + 1);
+    m_slots[tick % m_slots.size()].push_back({tick, std::move(callback)});
+    ++m_size;
+    return tick;
+}
+
+void TimingWheel::cancel(std::uint64_t tick, const std::shared_ptr<messaging::CallbackType>& callback)
+{
+    auto wheelLock = std::lock_guard(m_wheelMutex);
+    auto &slot = m_slots[tick % m_slots.size()];
+    auto entryIterator = std::find_if(
+            slot.begin(), slot.end(),
+            [tick, &callback](const Entry& entry)
+            {
+                return entry.m_tick == tick && entry.m_callback == callback;
+            });
+    if (entryIterator == slot.end())
+        return;
+    *entryIterator = std::move(slot.back());
+    slot.pop_back();
+    --m_size;
+}
+
+void TimingWheel::advance(Clock::time_point now)
+{
+    std::vector<std::shared_ptr<messaging::CallbackType>> expired;
+    {
+        auto wheelLock = std::lock_guard(m_wheelMutex);
+        auto targetTick = tickOf(now);
+        if (targetTick <= m_currentTick)
+            return;
+        // За один оборот просматривается каждая ячейка; таймеры дальних оборотов остаются на месте
+        auto slotsToVisit = std::min<std::uint64_t>(targetTick - m_currentTick, m_slots.size());
+        for (std::uint64_t i = 1; i <= slotsToVisit; ++i)
+        {
+            auto &slot = m_slots[(m_currentTick + i) % m_slots.size()];
+            auto firstPending = std::partition(
+                    slot.begin(), slot.end(),
+                    [targetTick](const Entry& entry)
+                    {
+                        return entry.m_tick > targetTick;
+                    });
+            for (auto entryIterator = firstPending; entryIterator != slot.end(); ++entryIterator)
+                expired.push_back(std::move(entryIterator->m_callback));
+            slot.erase(firstPending, slot.end());
+        }
+        m_currentTick = targetTick;
+        m_size -= expired.size();
+    }
+    for (auto &callback: expired)
+        (*callback)(0);
+}
+
+} //namespace ftp::details
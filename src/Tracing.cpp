@@ -0,0 +1,277 @@
+#include <Tracing.h>
+#include <unistd.h>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ftp::tracing {
+
+namespace {
+
+// Интервалов в буфере одного потока
+constexpr std::size_t bufferCapacity = 1 << 14;
+
+enum class Kind : std::uint8_t
+{
+    Complete,
+    Async
+};
+
+// Поля атомарны, чтобы выгрузку можно было делать во время записи;
+// на x86 relaxed-запись атомарного поля - обычная инструкция записи
+struct Event
+{
+    std::atomic<const char*> m_name = nullptr;
+    std::atomic_uint64_t m_start = 0, m_end = 0, m_id = 0;
+    std::atomic_uint32_t m_verb = 0;
+    std::atomic<Kind> m_kind = Kind::Complete;
+};
+
+struct ThreadBuffer
+{
+    // m_claimed увеличивается до начала записи интервала, m_position - после ее окончания.
+    // По ним выгрузка отличает целые интервалы от перезаписанных во время чтения
+    std::atomic_uint64_t m_claimed = 0, m_position = 0;
+    std::atomic_bool m_isOrphaned = false; // Поток-владелец завершился
+    pid_t m_tid = gettid();
+    std::string m_name; // Защищено мьютексом реестра
+    std::array<Event, bufferCapacity> m_events;
+};
+
+struct Registry
+{
+    static Registry& instance()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    std::mutex m_registryMutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> m_buffers;
+    // Точка отсчета для перевода тактов в микросекунды
+    const Timestamp m_baseTicks = now();
+    const std::chrono::steady_clock::time_point m_baseTime = std::chrono::steady_clock::now();
+};
+
+// Буфер создается при первом интервале потока, поэтому потоки без трассировки не занимают память
+struct LocalBuffer
+{
+    std::shared_ptr<ThreadBuffer> m_buffer;
+    std::string m_name;
+
+    static LocalBuffer& instance()
+    {
+        thread_local LocalBuffer local;
+        return local;
+    }
+
+    ThreadBuffer& buffer()
+    {
+        if (!m_buffer)
+        {
+            m_buffer = std::make_shared<ThreadBuffer>();
+            auto &registry = Registry::instance();
+            auto registryLock = std::lock_guard(registry.m_registryMutex);
+            m_buffer->m_name = m_name;
+            registry.m_buffers.push_back(m_buffer);
+        }
+        return *m_buffer;
+    }
+
+    ~LocalBuffer()
+    {
+        if (m_buffer)
+            m_buffer->m_isOrphaned.store(true, std::memory_order_release);
+    }
+};
+
+void record(Kind kind, const char* name, Timestamp start, std::uint64_t id, std::uint32_t verb)
+{
+    if (start == 0)
+        return;
+    auto end = now();
+    auto &buffer = LocalBuffer::instance().buffer();
+    auto position = buffer.m_position.load(std::memory_order_relaxed);
+    buffer.m_claimed.store(position + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    auto &event = buffer.m_events[position & (bufferCapacity - 1)];
+    event.m_name.store(name, std::memory_order_relaxed);
+    event.m_start.store(start, std::memory_order_relaxed);
+    event.m_end.store(end, std::memory_order_relaxed);
+    event.m_id.store(id, std::memory_order_relaxed);
+    event.m_verb.store(verb, std::memory_order_relaxed);
+    event.m_kind.store(kind, std::memory_order_relaxed);
+    buffer.m_position.store(position + 1, std::memory_order_release);
+}
+
+struct EventCopy
+{
+    const char* m_name;
+    Timestamp m_start, m_end;
+    std::uint64_t m_id;
+    std::uint32_t m_verb;
+    Kind m_kind;
+};
+
+// Копирует интервалы буфера, отбрасывая те, что поток успел перезаписать во время копирования
+std::vector<EventCopy> copyEvents(const ThreadBuffer& buffer)
+{
+    auto position = buffer.m_position.load(std::memory_order_acquire);
+    auto first = position > bufferCapacity ? position - bufferCapacity : 0;
+    std::vector<EventCopy> events;
+    events.reserve(position - first);
+    for (auto index = first; index < position; ++index)
+    {
+        auto &event = buffer.m_events[index & (bufferCapacity - 1)];
+        events.push_back({
+                event.m_name.load(std::memory_order_relaxed),
+                event.m_start.load(std::memory_order_relaxed),
+                event.m_end.load(std::memory_order_relaxed),
+                event.m_id.load(std::memory_order_relaxed),
+                event.m_verb.load(std::memory_order_relaxed),
+                event.m_kind.load(std::memory_order_relaxed)});
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    auto claimed = buffer.m_claimed.load(std::memory_order_relaxed);
+    // Интервал с номером index перезаписывается интервалом index + bufferCapacity
+    auto firstIntact = claimed > bufferCapacity ? claimed - bufferCapacity : 0;
+    if (firstIntact > first)
+        events.erase(events.begin(), events.begin() + std::min<std::size_t>(firstIntact - first, events.size()));
+    return events;
+}
+
+void appendMicroseconds(std::string& out, double microseconds)
+{
+    char text[32];
+    auto len = snprintf(text, sizeof text, "%.3f", microseconds);
+    out.append(text, len);
+}
+
+void appendEscaped(std::string& out, std::string_view text)
+{
+    for (char c: text)
+    {
+        if (c == '"' || c == '\\')
+            out.push_back('\\');
+        if (static_cast<unsigned char>(c) >= 0x20)
+            out.push_back(c);
+    }
+}
+
+} //namespace
+
+void enable(bool isEnabled)
+{
+    // Точка отсчета фиксируется до первого интервала
+    Registry::instance();
+    s_isEnabled.store(isEnabled, std::memory_order_relaxed);
+}
+
+void complete(const char* name, Timestamp start, std::uint64_t id, std::uint32_t verb)
+{
+    record(Kind::Complete, name, start, id, verb);
+}
+
+void async(const char* name, Timestamp start, std::uint64_t id)
+{
+    record(Kind::Async, name, start, id, 0);
+}
+
+void setThreadName(std::string_view name)
+{
+    auto &local = LocalBuffer::instance();
+    local.m_name = name;
+    if (local.m_buffer)
+    {
+        auto &registry = Registry::instance();
+        auto registryLock = std::lock_guard(registry.m_registryMutex);
+        local.m_buffer->m_name = name;
+    }
+}
+
+void exportChromeTrace(std::string& out)
+{
+    auto &registry = Registry::instance();
+    std::vector<std::pair<std::shared_ptr<ThreadBuffer>, std::string>> buffers;
+    {
+        auto registryLock = std::lock_guard(registry.m_registryMutex);
+        for (auto &buffer: registry.m_buffers)
+            buffers.emplace_back(buffer, buffer->m_name);
+        // Буферы завершившихся потоков выгружаются последний раз
+        std::erase_if(registry.m_buffers, [](const auto &buffer) { return buffer->m_isOrphaned.load(std::memory_order_acquire); });
+    }
+    auto elapsedTicks = static_cast<double>(now() - registry.m_baseTicks);
+    auto elapsedMicroseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - registry.m_baseTime).count();
+    auto ticksPerMicrosecond = elapsedMicroseconds > 0 && elapsedTicks > 0 ? elapsedTicks / elapsedMicroseconds : 1.0;
+    auto toMicroseconds = [&](Timestamp ticks)
+    {
+        return (static_cast<double>(ticks) - static_cast<double>(registry.m_baseTicks)) / ticksPerMicrosecond;
+    };
+
+    auto pid = std::to_string(getpid());
+    char id[32];
+    bool isFirst = true;
+    auto beginEvent = [&]()
+    {
+        out.append(isFirst ? "\n{" : ",\n{");
+        isFirst = false;
+    };
+    out.append("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    beginEvent();
+    out.append("\"name\":\"process_name\",\"ph\":\"M\",\"pid\":").append(pid)
+       .append(",\"args\":{\"name\":\"ftp_server_poll\"}}");
+    for (auto &[buffer, name]: buffers)
+    {
+        auto tid = std::to_string(buffer->m_tid);
+        if (!name.empty())
+        {
+            beginEvent();
+            out.append("\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":").append(pid)
+               .append(",\"tid\":").append(tid).append(",\"args\":{\"name\":\"");
+            appendEscaped(out, name);
+            out.append("\"}}");
+        }
+        for (auto &event: copyEvents(*buffer))
+        {
+            snprintf(id, sizeof id, "\"0x%llx\"", static_cast<unsigned long long>(event.m_id));
+            if (event.m_kind == Kind::Complete)
+            {
+                beginEvent();
+                out.append("\"name\":\"").append(event.m_name).append("\",\"cat\":\"ftp\",\"ph\":\"X\",\"pid\":").append(pid)
+                   .append(",\"tid\":").append(tid).append(",\"ts\":");
+                appendMicroseconds(out, toMicroseconds(event.m_start));
+                out.append(",\"dur\":");
+                appendMicroseconds(out, (event.m_end - event.m_start) / ticksPerMicrosecond);
+                out.append(",\"args\":{\"id\":").append(id);
+                if (event.m_verb != 0)
+                {
+                    char verb[5] = {};
+                    for (int i = 0, shift = 24; shift >= 0; shift -= 8)
+                    {
+                        if (char c = static_cast<char>(event.m_verb >> shift); c != 0)
+                            verb[i++] = c;
+                    }
+                    out.append(",\"verb\":\"").append(verb).append("\"");
+                }
+                out.append("}}");
+            }
+            else
+            {
+                // Асинхронный интервал выгружается парой событий начала и конца
+                for (auto [phase, ticks]: {std::pair{"b", event.m_start}, std::pair{"e", event.m_end}})
+                {
+                    beginEvent();
+                    out.append("\"name\":\"").append(event.m_name).append("\",\"cat\":\"").append(event.m_name)
+                       .append("\",\"ph\":\"").append(phase).append("\",\"id\":").append(id)
+                       .append(",\"pid\":").append(pid).append(",\"tid\":").append(tid).append(",\"ts\":");
+                    appendMicroseconds(out, toMicroseconds(ticks));
+                    out.append("}");
+                }
+            }
+        }
+    }
+    out.append("\n]}\n");
+}
+
+} //namespace ftp::tracing
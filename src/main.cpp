@@ -1,8 +1,7 @@
-#include <PollMessageEngine.h>
-
 #include <iostream>
-#include <fcntl.h>
+#include <fstream>
 #include <FTPServer.h>
+#include <MemoryStorage.h>
 #include <thread>
 #include <boost/program_options.hpp>
 
@@ -11,174 +10,14 @@ void interruptionHandler(int signal)
     exit(0);
 }
 
-void checkAsyncIo()
+// Сохраняет накопленную трассировку в файл в формате Chrome trace
+void saveTrace(const std::string& path)
 {
-    std::cout << "-------------- CheckAsyncIo() starts --------------\n";
-    int fd1 = open("1.txt", O_WRONLY | O_CREAT, 0666),
-        fd2 = open("1.txt", O_RDONLY | O_CREAT, 0666);
-    messaging::PollMessageEngine engine;
-    std::string msg1;
-    msg1.resize(10);
-    int eventCount = 0;
-    engine.async_write(
-            fd1,
-            std::string("ABC\n"),
-            std::make_shared<messaging::CallbackType>(
-                    [&eventCount](int res) mutable
-                    {
-                        std::cout << "write successful\n";
-                        ++eventCount;
-                    }));
-
-    engine.async_read(
-            fd2,
-            msg1,
-            std::make_shared<messaging::CallbackType>(
-                    [&msg1, &eventCount](int res) mutable
-                    {
-                        std::cout << "read successful\nmessage: " << msg1 << '\n';
-                        ++eventCount;
-                    }));
-
-    engine.async_write(
-            fd1,
-            std::string("Hello\n"),
-            std::make_shared<messaging::CallbackType>(
-                    [&eventCount](int res)mutable
-                    {
-                        std::cout << "write successful\n";
-                        ++eventCount;
-                    }));
-    while(eventCount < 3)
-        engine.waitForEvent()();
-    remove("1.txt");
-}
-
-void checkAsyncIoSome()
-{
-    std::cout << "------------ CheckAsyncIoSome() starts ------------\n";
-    std::string msg1, msg2, msg3;
-    int fd1 = open("1.txt", O_CREAT | O_RDONLY, 0666),
-        fd2 = open("1.txt", O_CREAT | O_WRONLY, 0666);
-    msg1 = "Hello!\n";
-    msg2 = "My name is Liza\n";
-    msg3.resize(msg1.size() + msg2.size());
-    int eventCount = 0;
-    messaging::PollMessageEngine engine;
-    engine.async_write_some(
-            fd2,
-            msg1,
-            std::make_shared<messaging::CallbackType>(
-                    [&eventCount](int res) mutable
-                    {
-                        if(res > 0)
-                            std::cout << "write successful\n";
-                        else std::cerr << "write failed\n";
-                      ++eventCount;
-                    }));
-
-    engine.async_read_some(
-            fd1,
-            msg3,
-            std::make_shared<messaging::CallbackType>(
-                    [&msg3, &eventCount](int res) mutable
-                    {
-                      if(res > 0)
-                          std::cout << "Got a message: " << msg3 << '\n';
-                      else
-                          std::cerr << "Error reading a message\n";
-                      ++eventCount;
-                    }));
-
-    engine.async_write_some(
-            fd2,
-            msg2,
-            std::make_shared<messaging::CallbackType>(
-                    [&eventCount](int res) mutable
-                    {
-                      if(res > 0)
-                          std::cout << "write successful\n";
-                      else std::cerr << "write failed\n";
-                      ++eventCount;
-                    }));
-
-    engine.async_read_some(
-            fd1,
-            msg3,
-            std::make_shared<messaging::CallbackType>(
-                    [&msg3, &eventCount](int res) mutable
-                    {
-                        if(res > 0)
-                            std::cout << "Got a message: " << msg3 << '\n';
-                        else
-                            std::cerr << "Error reading a message\n";
-                        ++eventCount;
-                    }));
-
-    while(eventCount < 4)
-        engine.waitForEvent()();
-    remove("1.txt");
-}
-
-void checkAsyncIoUntil()
-{
-    int fd1 = open("1.txt", O_CREAT | O_RDONLY, 0666),
-        fd2 = open("1.txt", O_CREAT | O_WRONLY, 0666);
-    std::cout << "------------ CheckAsyncIoUntil() starts -----------\n";
-    std::string msg;
-    messaging::PollMessageEngine engine;
-    int eventCount = 0;
-    engine.async_write(
-            fd2,
-            std::string("Hello!\n"),
-            std::make_shared<messaging::CallbackType>(
-                [&eventCount](int res) mutable
-                {
-                    if(res > 0)
-                        std::cout << "write successful\n";
-                    else
-                        std::cerr << "write failed\n";
-                    ++eventCount;
-                }));
-    engine.async_write(
-            fd2,
-            std::string("My name is Liza\n"),
-            std::make_shared<messaging::CallbackType>(
-                    [&eventCount](int res) mutable
-                    {
-                        if(res > 0)
-                            std::cout << "write successful\n";
-                        else
-                            std::cerr << "write failed\n";
-                        ++eventCount;
-                    }));
-    engine.async_write(
-            fd2,
-            std::string("I am from Russia\n"),
-            std::make_shared<messaging::CallbackType>(
-                   [&eventCount](int res) mutable
-                   {
-                       if(res > 0)
-                           std::cout << "write successful\n";
-                       else
-                           std::cerr << "write failed\n";
-                       ++eventCount;
-                   }));
-    engine.async_read_until(
-            fd1,
-            msg,
-            std::make_shared<messaging::CallbackType>(
-                    [&eventCount, &msg](int res)
-                    {
-                        if(res > 0)
-                            std::cout << "got a message: " << msg << '\n';
-                        else
-                            std::cerr << "read failed\n";
-                        ++eventCount;
-                    }), std::string("from"));
-    while(eventCount < 4)
-        engine.waitForEvent();
-    remove("1.txt");
+    std::string trace;
+    ftp::tracing::exportChromeTrace(trace);
+    std::ofstream file(path, std::ios::binary);
+    file << trace;
+    std::cout << (file ? "Trace saved to " : "Cannot write trace to ") << path << '\n';
 }
 
 int main(int argc, const char* argv[])
@@ -186,13 +25,45 @@ int main(int argc, const char* argv[])
 
     std::uint16_t port = -1;
     unsigned threadCount = -1;
+    ftp::ServerOptions serverOptions;
+    std::size_t fileCacheMegabytes = 0, fileCacheMaxFileKilobytes = 0;
+    std::string passivePorts, reactorCpus, workerCpus, storage = "local";
+    std::uint64_t globalRateKilobytes = 0, sessionRateKilobytes = 0;
+    std::vector<std::string> classRates;
+    unsigned idleTimeout = serverOptions.m_timeouts.m_idle.count(),
+        dataConnectionTimeout = serverOptions.m_timeouts.m_dataConnection.count(),
+        transferTimeout = serverOptions.m_timeouts.m_transferWindow.count();
+    std::uint64_t minTransferRateKilobytes = 0;
+    bool isTracing = false;
 
     //Обработка параметров запуска программы
     boost::program_options::options_description desc("Allowed options");
     desc.add_options()
             ("help", "print this help message")
             ("threads", boost::program_options::value<unsigned>(&threadCount)->default_value(std::thread::hardware_concurrency()), "set the maximum cores to be used")
-            ("port", boost::program_options::value<std::uint16_t>(&port), "set the port for the control connections");
+            ("port", boost::program_options::value<std::uint16_t>(&port), "set the port for the control connections")
+            ("storage", boost::program_options::value<std::string>(&storage)->default_value(storage), "serve files from \"local\" disk or load them into \"memory\" at start")
+            ("file-cache-size", boost::program_options::value<std::size_t>(&fileCacheMegabytes)->default_value(serverOptions.m_fileCacheSize >> 20), "set the in-memory file cache size in MiB (0 disables the cache)")
+            ("file-cache-max-file", boost::program_options::value<std::size_t>(&fileCacheMaxFileKilobytes)->default_value(serverOptions.m_fileCacheMaxFileSize >> 10), "set the largest file size in KiB to be kept in the file cache")
+            ("copy-threads", boost::program_options::value<std::size_t>(&serverOptions.m_copyThreads)->default_value(serverOptions.m_copyThreads), "set the number of threads running SITE COPY")
+            ("pasv-ports", boost::program_options::value<std::string>(&passivePorts), "set the port range shared by all sessions for passive mode, e.g. 50000-50099")
+            ("reactor-cpus", boost::program_options::value<std::string>(&reactorCpus), "pin the event loop thread to the given CPUs, e.g. 0-1")
+            ("worker-cpus", boost::program_options::value<std::string>(&workerCpus), "pin worker threads to the given CPUs, one CPU per thread in turn, e.g. 2-7,10")
+            ("steer-incoming-cpu", "hand each new connection to the worker running on the CPU that receives its packets")
+            ("rate-limit-global", boost::program_options::value<std::uint64_t>(&globalRateKilobytes), "limit the total data transfer rate in KiB/s (0 - no limit)")
+            ("rate-limit-session", boost::program_options::value<std::uint64_t>(&sessionRateKilobytes), "limit the data transfer rate of every session in KiB/s (0 - no limit)")
+            ("rate-limit-class", boost::program_options::value<std::vector<std::string>>(&classRates), "limit the total data transfer rate of a user class in KiB/s, e.g. anonymous=1024")
+            ("max-sessions", boost::program_options::value<std::size_t>(&serverOptions.m_maxSessions), "limit the number of simultaneous sessions (0 - no limit)")
+            ("max-sessions-per-ip", boost::program_options::value<std::size_t>(&serverOptions.m_maxSessionsPerAddress), "limit the number of simultaneous sessions from one client address (0 - no limit)")
+            ("idle-timeout", boost::program_options::value<unsigned>(&idleTimeout)->default_value(idleTimeout), "close control connections idle for the given number of seconds (0 - never)")
+            ("data-connection-timeout", boost::program_options::value<unsigned>(&dataConnectionTimeout)->default_value(dataConnectionTimeout), "give up waiting for a data connection after the given number of seconds (0 - never)")
+            ("transfer-timeout", boost::program_options::value<unsigned>(&transferTimeout)->default_value(transferTimeout), "abort data transfers that make no progress for the given number of seconds (0 - never)")
+            ("transfer-min-rate", boost::program_options::value<std::uint64_t>(&minTransferRateKilobytes), "abort data transfers slower than the given rate in KiB/s over the transfer timeout")
+            ("metrics-port", boost::program_options::value<std::uint16_t>(&serverOptions.m_metricsPort), "serve Prometheus metrics on 127.0.0.1 at the given port")
+            ("xferlog", boost::program_options::value<std::filesystem::path>(&serverOptions.m_transferLogPath), "append file transfers to the given file in xferlog format")
+            ("access-log", boost::program_options::value<std::filesystem::path>(&serverOptions.m_accessLogPath), "append every command and transfer result to the given file")
+            ("engine-stats", boost::program_options::bool_switch(&serverOptions.m_engineStatistics), "collect event engine histograms; SIGUSR1 prints them to stderr")
+            ("trace", boost::program_options::bool_switch(&isTracing), "record session and transfer spans from start; they are served at /trace on the metrics port");
 
     boost::program_options::variables_map options;
 
@@ -216,6 +87,58 @@ int main(int argc, const char* argv[])
         return 2;
     }
 
+    serverOptions.m_fileCacheSize = fileCacheMegabytes << 20;
+    serverOptions.m_fileCacheMaxFileSize = fileCacheMaxFileKilobytes << 10;
+    if(storage != "local" && storage != "memory")
+    {
+        std::cerr << "Invalid storage. Use \"--help\" option to view the list of available options\n";
+        return 2;
+    }
+    if(!passivePorts.empty())
+    {
+        unsigned minPort = 0, maxPort = 0;
+        if(sscanf(passivePorts.c_str(), "%u-%u", &minPort, &maxPort) != 2
+           || minPort == 0 || maxPort > 65535 || minPort > maxPort)
+        {
+            std::cerr << "Invalid passive port range. Use \"--help\" option to view the list of available options\n";
+            return 2;
+        }
+        serverOptions.m_passivePortMin = minPort;
+        serverOptions.m_passivePortMax = maxPort;
+    }
+
+    for (auto [list, cpus]: {std::pair{&reactorCpus, &serverOptions.m_reactorCpus}, std::pair{&workerCpus, &serverOptions.m_workerCpus}})
+    {
+        if (list->empty())
+            continue;
+        auto parsedCpus = ftp::details::parseCpuList(*list);
+        if (!parsedCpus)
+        {
+            std::cerr << "Invalid CPU list \"" << *list << "\". Use \"--help\" option to view the list of available options\n";
+            return 2;
+        }
+        *cpus = std::move(*parsedCpus);
+    }
+    serverOptions.m_steerByIncomingCpu = options.count("steer-incoming-cpu") > 0;
+    serverOptions.m_timeouts.m_idle = std::chrono::seconds(idleTimeout);
+    serverOptions.m_timeouts.m_dataConnection = std::chrono::seconds(dataConnectionTimeout);
+    serverOptions.m_timeouts.m_transferWindow = std::chrono::seconds(transferTimeout);
+    serverOptions.m_timeouts.m_minTransferRate = minTransferRateKilobytes << 10;
+    serverOptions.m_globalRateLimit = globalRateKilobytes << 10;
+    serverOptions.m_sessionRateLimit = sessionRateKilobytes << 10;
+    for (const auto &classRate: classRates)
+    {
+        auto separator = classRate.find('=');
+        std::uint64_t kilobytes = 0;
+        if (separator == std::string::npos || separator == 0
+            || sscanf(classRate.c_str() + separator + 1, "%lu", &kilobytes) != 1)
+        {
+            std::cerr << "Invalid user class rate limit \"" << classRate << "\". Use \"--help\" option to view the list of available options\n";
+            return 2;
+        }
+        serverOptions.m_classRateLimits.emplace_back(classRate.substr(0, separator), kilobytes << 10);
+    }
+
     //Назначаем обработчик сигналов для корректного завершения программы по прерыванию
     struct sigaction actionHandler;
     actionHandler.sa_handler = interruptionHandler;
@@ -225,6 +148,13 @@ int main(int argc, const char* argv[])
     sigaction(SIGTSTP, &actionHandler, nullptr);
     sigaction(SIGTERM, &actionHandler, nullptr);
 
+    // SIGUSR1 принимает только поток вывода статистики через sigwait;
+    // маска наследуется всеми потоками, создаваемыми позже
+    sigset_t statisticsSignals;
+    sigemptyset(&statisticsSignals);
+    sigaddset(&statisticsSignals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &statisticsSignals, nullptr);
+
     //Создаем сокет, на котором будет работать сервер
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if(fd < 0)
@@ -254,13 +184,66 @@ int main(int argc, const char* argv[])
     inet_ntop(AF_INET, &(addr.sin_addr), addrString.data(), INET_ADDRSTRLEN);
     std::cout << "Address: " << addrString << '\n'
                 << "Port: " << htons(addr.sin_port) << '\n';
-    ftp::Server srv(fd, (std::filesystem::current_path()/"FTP/").lexically_normal(), threadCount);
+    auto root = (std::filesystem::current_path()/"FTP/").lexically_normal();
+    std::unique_ptr<ftp::Server> srv;
+    try
+    {
+        if (storage == "memory")
+        {
+            // Файлы корня копируются в память один раз; изменения на диске после запуска не видны
+            auto memoryStorage = std::make_shared<ftp::MemoryStorage>(root);
+            memoryStorage->load(root);
+            serverOptions.m_storage = std::move(memoryStorage);
+        }
+        srv = std::make_unique<ftp::Server>(fd, root, threadCount, serverOptions);
+    } catch(const std::system_error& error)
+    {
+        std::cerr << "Server initialization error: " << error.what() << '\n';
+        return 2;
+    }
 
     // Запуск сервера
-    srv.start();
-    char c;
-    std::cout << "Введите любой символ для остановки сервера\n";
-    std::cin >> c;
-    srv.stop();
+    ftp::tracing::enable(isTracing);
+    srv->start();
+    std::atomic_bool isStopping = false;
+    std::thread statisticsThread(
+            [&]()
+            {
+                int signal = 0;
+                while (sigwait(&statisticsSignals, &signal) == 0 && !isStopping.load())
+                {
+                    if (!srv->isEngineStatisticsEnabled())
+                        std::cerr << "Engine statistics are disabled, enable them with \"stats on\" or --engine-stats\n";
+                    srv->engineStatistics().dump(std::cerr);
+                }
+            });
+    std::cout << "Введите \"rate global|session <KiB/s>\" или \"rate class <класс> <KiB/s>\" для изменения ограничений скорости,\n"
+                 "\"stats on|off\" - для включения гистограмм движка (вывод по SIGUSR1),\n"
+                 "\"trace on|off\" - для включения трассировки, \"trace save <файл>\" - для ее сохранения в формате Chrome trace,\n"
+                 "любую другую строку - для остановки сервера\n";
+    std::string command;
+    while (std::getline(std::cin, command))
+    {
+        char scope[16], userClass[64];
+        std::uint64_t kilobytes = 0;
+        if (sscanf(command.c_str(), "rate class %63s %lu", userClass, &kilobytes) == 2)
+            srv->bandwidthLimiter()->setClassLimit(userClass, kilobytes << 10);
+        else if (sscanf(command.c_str(), "rate %15s %lu", scope, &kilobytes) == 2 && std::string_view(scope) == "global")
+            srv->bandwidthLimiter()->setGlobalLimit(kilobytes << 10);
+        else if (sscanf(command.c_str(), "rate %15s %lu", scope, &kilobytes) == 2 && std::string_view(scope) == "session")
+            srv->bandwidthLimiter()->setSessionLimit(kilobytes << 10);
+        else if (command == "stats on" || command == "stats off")
+            srv->enableEngineStatistics(command == "stats on");
+        else if (command == "trace on" || command == "trace off")
+            ftp::tracing::enable(command == "trace on");
+        else if (command.starts_with("trace save "))
+            saveTrace(command.substr(std::string_view("trace save ").size()));
+        else if (!command.empty())
+            break;
+    }
+    srv->stop();
+    isStopping.store(true);
+    pthread_kill(statisticsThread.native_handle(), SIGUSR1);
+    statisticsThread.join();
     return 0;
 }